@@ -1,206 +1,180 @@
+#include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <vapoursynth/VapourSynth4.h>
 #include <vapoursynth/VSHelper4.h>
 
-
-enum BlendDirection {
-   bdNext,
-   bdPrev,
-   bdBoth
-};
+#include "bifrost_core.h"
+#include "bifrost_diffcache.h"
+#include "bifrost_profile.h"
 
 
 typedef struct {
    VSNode *node;
+   VSNode *diffnode; // BlockDiff with gray=True
+   VSNode *chromadiffnode; // ChromaDiff, NULL unless in linear mode
    VSNode *altnode;
-   float luma_thresh;
-   int variation;
-   int conservative_mask;
+   VSNode *masknode; // NULL unless there is a maskclip
    int interlaced;
+   int tff;
+   int stats;
+   int decisions;
    int block_width;
    int block_height;
-   int block_width_uv;
-   int block_height_uv;
    int blocks_x;
    int blocks_y;
+   int decimation;
+
+   // x, y, width and height of every rectangle, NULL without a roi.
+   int *roi;
+   int roi_size;
 
    const VSVideoInfo *vi;
-   float relativeframediff;
-   int offset;
-} BifrostData;
+   int fields; // 2 in interlaced mode, 1 otherwise
 
+   BifrostCore *core;
 
-static void applyBlockRainbowMask(const uint8_t *srcp_u, const uint8_t *srcp_v,
-                                  const uint8_t *srcc_u, const uint8_t *srcc_v,
-                                  const uint8_t *srcn_u, const uint8_t *srcn_v,
-                                  uint8_t *restrict dst_u, uint8_t *restrict dst_v,
-                                  int block_width_uv, int block_height_uv, ptrdiff_t stride_uv, int blenddirection) {
-
-   for (int y = 0; y < block_height_uv; y++) {
-      if (blenddirection == bdNext) {
-         for (int x = 0; x < block_width_uv; x++) {
-            if (dst_v[x]) {
-               dst_u[x] = (srcc_u[x]+srcn_u[x]+1) >> 1;
-               dst_v[x] = (srcc_v[x]+srcn_v[x]+1) >> 1;
-            } else {
-               dst_u[x] = srcc_u[x];
-               dst_v[x] = srcc_v[x];
-            }
-         }
-      } else if (blenddirection == bdPrev) {
-         for (int x = 0; x < block_width_uv; x++) {
-            if (dst_v[x]) {
-               dst_u[x] = (srcc_u[x]+srcp_u[x]+1) >> 1;
-               dst_v[x] = (srcc_v[x]+srcp_v[x]+1) >> 1;
-            } else {
-               dst_u[x] = srcc_u[x];
-               dst_v[x] = srcc_v[x];
-            }
-         }
-      } else if (blenddirection == bdBoth) {
-         for (int x = 0; x < block_width_uv; x++) {
-            if (dst_v[x]) {
-               dst_u[x] = (2*srcc_u[x]+srcp_u[x]+srcn_u[x]+3) >> 2;
-               dst_v[x] = (2*srcc_v[x]+srcp_v[x]+srcn_v[x]+3) >> 2;
-            } else {
-               dst_u[x] = srcc_u[x];
-               dst_v[x] = srcc_v[x];
-            }
-         }
-      }
-
-      srcp_u += stride_uv;
-      srcp_v += stride_uv;
+   BifrostProfile *profile; // NULL unless profiling is enabled
+} BifrostData;
 
-      srcc_u += stride_uv;
-      srcc_v += stride_uv;
 
-      srcn_u += stride_uv;
-      srcn_v += stride_uv;
+// Every instance starts its own pool, on top of the threads of the core,
+// so more than one thread must be asked for explicitly.
+static const char *checkThreads(int threads) {
+   if (threads < 1)
+      return "Bifrost: threads must be at least 1.";
 
-      dst_u += stride_uv;
-      dst_v += stride_uv;
-   }
+   return NULL;
 }
 
 
-static void processBlockRainbowMask(uint8_t *restrict dst_u, uint8_t *restrict dst_v,
-                                    int block_width_uv, int block_height_uv, ptrdiff_t stride_uv, int conservative_mask) {
+// Reads the rectangles of the roi parameter. *roi is NULL if there are none.
+static const char *getRoi(const VSMap *in, int **roi, int *roi_size, const VSAPI *vsapi) {
+   *roi = NULL;
+   *roi_size = 0;
 
-   // Maybe needed later.
-   uint8_t *tmp = dst_v;
+   int err;
+   const int64_t *values = vsapi->mapGetIntArray(in, "roi", &err);
+   if (err)
+      return NULL;
 
-   //denoise mask, remove marked pixels with no horizontal marked neighbors
-   for (int y = 0; y < block_height_uv; y++) {
-      dst_v[0] = dst_u[0] && dst_u[1];
-      for (int x = 1; x < block_width_uv - 1; x++) {
-         dst_v[x] = dst_u[x] && (dst_u[x-1] || dst_u[x+1]);
-      }
-      dst_v[block_width_uv - 1] = dst_u[block_width_uv - 1] && dst_u[block_width_uv - 2];
+   int size = vsapi->mapNumElements(in, "roi");
+   if (size % 4)
+      return "Bifrost: roi must hold four numbers per rectangle: x, y, width, and height.";
 
-      dst_u += stride_uv;
-      dst_v += stride_uv;
-   }
+   *roi = malloc(size * sizeof(int));
+   *roi_size = size;
 
-   //expand mask vertically
-   if (!conservative_mask) {
-      dst_v = tmp;
+   for (int i = 0; i < size; i++)
+      (*roi)[i] = values[i] < INT_MIN ? INT_MIN : (values[i] > INT_MAX ? INT_MAX : values[i]);
 
-      for (int x = 0; x < block_width_uv; x++) {
-         dst_v[x] = dst_v[x] || dst_v[x + stride_uv];
-      }
+   return NULL;
+}
 
-      dst_v += stride_uv;
 
-      for (int y = 1; y < block_height_uv - 1; y++) {
-         for (int x = 0; x < block_width_uv; x++) {
-            dst_v[x] = dst_v[x] || (dst_v[x + stride_uv] && dst_v[x - stride_uv]);
-         }
+// Profiling is enabled by default when the environment variable BIFROST_PROFILE is set to a nonzero number.
+static int profileRequested(const VSMap *in, const VSAPI *vsapi) {
+   int err;
+   int profile = !!vsapi->mapGetInt(in, "profile", 0, &err);
+   if (err) {
+      const char *env = getenv("BIFROST_PROFILE");
+      profile = env && atoi(env);
+   }
 
-         dst_v += stride_uv;
-      }
+   return profile;
+}
 
-      for (int x = 0; x < block_width_uv; x++) {
-         dst_v[x] = dst_v[x] || dst_v[x - stride_uv];
-      }
+
+static void setProfileProps(const int64_t *times, int first_stage, int last_stage, VSMap *props, const VSAPI *vsapi) {
+   for (int i = first_stage; i <= last_stage; i++) {
+      char key[64];
+      snprintf(key, sizeof(key), "BifrostTime%s", profile_stage_names[i]);
+
+      vsapi->mapSetFloat(props, key, times[i] / 1e9, maReplace);
    }
 }
 
 
-static void makeBlockRainbowMask(const uint8_t *srcp_u, const uint8_t *srcp_v,
-                                 const uint8_t *srcc_u, const uint8_t *srcc_v,
-                                 const uint8_t *srcn_u, const uint8_t *srcn_v,
-                                 uint8_t *restrict dst_u, uint8_t *restrict dst_v,
-                                 int block_width_uv, int block_height_uv, ptrdiff_t stride_uv, int variation) {
+// Logs the total time spent in every stage when a filter instance is freed.
+static void logProfile(BifrostProfile *profile, const char *filter_name, int first_stage, int last_stage, VSCore *core, const VSAPI *vsapi) {
+   ProfileTimes times;
+   int frames = profileTotals(profile, times);
+
+   char message[512];
+   int length = snprintf(message, sizeof(message), "%s: %d frames.", filter_name, frames);
 
-   for (int y = 0; y < block_height_uv; y++) {
-      for (int x = 0; x < block_width_uv; x++) {
-         uint8_t up = srcp_u[x];
-         uint8_t uc = srcc_u[x];
-         uint8_t un = srcn_u[x];
+   for (int i = first_stage; i <= last_stage && length < (int)sizeof(message); i++)
+      length += snprintf(message + length, sizeof(message) - length, " %s: %.3f s.", profile_stage_names[i], times[i] / 1e9);
 
-         uint8_t vp = srcp_v[x];
-         uint8_t vc = srcc_v[x];
-         uint8_t vn = srcn_v[x];
+   vsapi->logMessage(mtInformation, message, core);
+}
 
-         int ucup = uc-up;
-         int ucun = uc-un;
 
-         int vcvp = vc-vp;
-         int vcvn = vc-vn;
 
-         dst_u[x] = ((( ucup+variation) & ( ucun+variation)) < 0)
-                 || (((-ucup+variation) & (-ucun+variation)) < 0)
-                 || ((( vcvp+variation) & ( vcvn+variation)) < 0)
-                 || (((-vcvp+variation) & (-vcvn+variation)) < 0);
-      }
+// Records the decisions made for every block of the frame.
+static void setDecisionProps(const BifrostData *d, const BifrostFrame *frame, VSMap *props, const VSAPI *vsapi) {
+   if (d->stats) {
+      BifrostFrameStats stats;
+      bifrostFrameGetStats(frame, &stats);
 
-      srcp_u += stride_uv;
-      srcp_v += stride_uv;
+      vsapi->mapSetInt(props, "BifrostStaticBlocks", stats.static_blocks, maReplace);
+      vsapi->mapSetInt(props, "BifrostBlendNextBlocks", stats.blend_next_blocks, maReplace);
+      vsapi->mapSetInt(props, "BifrostBlendPrevBlocks", stats.blend_prev_blocks, maReplace);
+      vsapi->mapSetInt(props, "BifrostBlendBothBlocks", stats.blend_both_blocks, maReplace);
+      vsapi->mapSetInt(props, "BifrostAltClipBlocks", stats.alt_blocks, maReplace);
+      vsapi->mapSetInt(props, "BifrostOutsideBlocks", stats.outside_blocks, maReplace);
+      vsapi->mapSetInt(props, "BifrostRainbowPixels", stats.rainbow_pixels, maReplace);
+   }
 
-      srcc_u += stride_uv;
-      srcc_v += stride_uv;
+   if (d->decisions) {
+      // One byte per block, laid out like diffclip.
+      int size = d->fields * d->blocks_x * d->blocks_y;
+      uint8_t *map = malloc(size);
 
-      srcn_u += stride_uv;
-      srcn_v += stride_uv;
+      bifrostFrameGetDecisions(frame, map);
 
-      dst_u += stride_uv;
-      dst_v += stride_uv;
+      vsapi->mapSetData(props, "BifrostDecisions", (const char *)map, size, dtBinary, maReplace);
+      free(map);
    }
 }
 
 
-static void copyChromaBlock(uint8_t *restrict dst_u, uint8_t *restrict dst_v,
-                      const uint8_t *src_u, const uint8_t *src_v,
-                      int block_width_uv, int block_height_uv, ptrdiff_t stride_uv) {
+// Makes sure a frame from diffclip has differences computed with the right parameters.
+// Its dimensions were already checked when the filter was created.
+static const char *checkBlockDiffFrame(const BifrostData *d, const VSFrame *frame, const VSAPI *vsapi) {
+   const VSMap *props = vsapi->getFramePropertiesRO(frame);
+   int err;
 
-   for (int y = 0; y < block_height_uv; y++) {
-      memcpy(dst_u, src_u, block_width_uv);
-      memcpy(dst_v, src_v, block_width_uv);
+   const int64_t *params = vsapi->mapGetIntArray(props, "BifrostBlockDiffParams", &err);
+   int num_params = err ? 0 : vsapi->mapNumElements(props, "BifrostBlockDiffParams");
+   if (num_params < 5)
+      return "Bifrost: The frames of diffclip weren't made by BlockDiff.";
 
-      dst_u += stride_uv;
-      dst_v += stride_uv;
-      src_u += stride_uv;
-      src_v += stride_uv;
-   }
-}
+   if (params[0] != d->block_width || params[1] != d->block_height ||
+       params[2] != d->interlaced || (d->interlaced && params[3] != d->tff))
+      return "Bifrost: diffclip was made with a different block size, interlaced, or tff.";
 
+   // The differences of a decimated BlockDiff are estimates, so clips
+   // made with different values can't be mixed.
+   if (params[4] != d->decimation)
+      return "Bifrost: diffclip was made with a different decimation.";
 
-static int blockLumaDiff(const uint8_t *src1_y, const uint8_t *src2_y, int block_width, int block_height, ptrdiff_t stride_y) {
-   int diff = 0;
+   // A BlockDiff with a roi only has the differences inside it.
+   if (num_params > 5) {
+      int same_roi = num_params - 5 == d->roi_size;
 
-   for (int y = 0; y < block_height; y++) {
-      for (int x = 0; x < block_width; x++) {
-         diff += abs(src1_y[x] - src2_y[x]);
-      }
+      for (int i = 0; i < d->roi_size && same_roi; i++)
+         same_roi = params[5 + i] == d->roi[i];
 
-      src1_y += stride_y;
-      src2_y += stride_y;
+      if (!same_roi)
+         return "Bifrost: diffclip was made with a different roi.";
    }
 
-   return diff;
+   return NULL;
 }
 
 
@@ -211,170 +185,155 @@ static const VSFrame *VS_CC bifrostGetFrame(int n, int activationReason, void *i
 #define max(a, b)  (((a) > (b)) ? (a) : (b))
 
    if (activationReason == arInitial) {
-      vsapi->requestFrameFilter(max(n - d->offset*2, 0), d->node, frameCtx);
-      vsapi->requestFrameFilter(max(n - d->offset,   0), d->node, frameCtx);
+      vsapi->requestFrameFilter(max(n - 2, 0), d->node, frameCtx);
+      vsapi->requestFrameFilter(max(n - 1, 0), d->node, frameCtx);
       vsapi->requestFrameFilter(n, d->node, frameCtx);
-      vsapi->requestFrameFilter(min(n + d->offset,   d->vi->numFrames-1), d->node, frameCtx);
-      vsapi->requestFrameFilter(min(n + d->offset*2, d->vi->numFrames-1), d->node, frameCtx);
+      vsapi->requestFrameFilter(min(n + 1, d->vi->numFrames-1), d->node, frameCtx);
+      vsapi->requestFrameFilter(min(n + 2, d->vi->numFrames-1), d->node, frameCtx);
 
-      vsapi->requestFrameFilter(n, d->altnode, frameCtx);
-   } else if (activationReason == arAllFramesReady) {
-      const VSFrame *srcpp = vsapi->getFrameFilter(max(n - d->offset*2, 0), d->node, frameCtx);
-      const VSFrame *srcp  = vsapi->getFrameFilter(max(n - d->offset,   0), d->node, frameCtx);
-      const VSFrame *srcc  = vsapi->getFrameFilter(n, d->node, frameCtx);
-      const VSFrame *srcn  = vsapi->getFrameFilter(min(n + d->offset,   d->vi->numFrames-1), d->node, frameCtx);
-      const VSFrame *srcnn = vsapi->getFrameFilter(min(n + d->offset*2, d->vi->numFrames-1), d->node, frameCtx);
+      for (int i = -2; i <= 2; i++)
+         vsapi->requestFrameFilter(min(max(n + i, 0), d->vi->numFrames-1), d->diffnode, frameCtx);
 
-      const VSFrame *altsrcc = vsapi->getFrameFilter(n, d->altnode, frameCtx);
+      if (d->chromadiffnode) {
+         for (int i = -2; i <= 1; i++)
+            vsapi->requestFrameFilter(min(max(n + i, 0), d->vi->numFrames-1), d->chromadiffnode, frameCtx);
+      }
+
+      if (d->masknode)
+         vsapi->requestFrameFilter(n, d->masknode, frameCtx);
+   } else if (activationReason == arAllFramesReady) {
+      // Frames n-2 to n+2. They contain every picture needed, even in interlaced mode.
+      const VSFrame *srcs[5];
+      const VSFrame *diff_frames[5];
+      for (int i = 0; i < 5; i++) {
+         srcs[i] = vsapi->getFrameFilter(min(max(n - 2 + i, 0), d->vi->numFrames-1), d->node, frameCtx);
+         diff_frames[i] = vsapi->getFrameFilter(min(max(n - 2 + i, 0), d->vi->numFrames-1), d->diffnode, frameCtx);
+      }
 
+      // Frames n-2 to n+1.
+      const VSFrame *chroma_diff_frames[4] = { NULL };
+      for (int i = 0; i < 4 && d->chromadiffnode; i++)
+         chroma_diff_frames[i] = vsapi->getFrameFilter(min(max(n - 2 + i, 0), d->vi->numFrames-1), d->chromadiffnode, frameCtx);
 #undef min
 #undef max
-      const VSFrame *planeSrc[3] = { srcc, NULL, NULL };
-      const int planes[3] = { 0 };
-      VSFrame *dst = vsapi->newVideoFrame2(&d->vi->format, d->vi->width, d->vi->height, planeSrc, planes, srcc, core);
-      VSMap *dst_props = vsapi->getFramePropertiesRW(dst);
-      const char *prop = "BifrostLumaDiff";
-      vsapi->mapDeleteKey(dst_props, prop);
 
+      const VSFrame *mask_frame = d->masknode ? vsapi->getFrameFilter(n, d->masknode, frameCtx) : NULL;
 
-      const uint8_t *srcpp_u = vsapi->getReadPtr(srcpp, 1);
-      const uint8_t *srcpp_v = vsapi->getReadPtr(srcpp, 2);
-      const VSMap *srcpp_props = vsapi->getFramePropertiesRO(srcpp);
-      const int *srcpp_diffs = (const int *)vsapi->mapGetData(srcpp_props, prop, 0, NULL);
+      for (int i = 0; i < 5; i++) {
+         const char *diff_error = checkBlockDiffFrame(d, diff_frames[i], vsapi);
 
-      const uint8_t *srcp_u = vsapi->getReadPtr(srcp, 1);
-      const uint8_t *srcp_v = vsapi->getReadPtr(srcp, 2);
-      const VSMap *srcp_props = vsapi->getFramePropertiesRO(srcp);
-      const int *srcp_diffs = (const int *)vsapi->mapGetData(srcp_props, prop, 0, NULL);
+         if (diff_error) {
+            vsapi->setFilterError(diff_error, frameCtx);
 
-      const uint8_t *srcc_u = vsapi->getReadPtr(srcc, 1);
-      const uint8_t *srcc_v = vsapi->getReadPtr(srcc, 2);
-      const VSMap *srcc_props = vsapi->getFramePropertiesRO(srcc);
-      const int *srcc_diffs = (const int *)vsapi->mapGetData(srcc_props, prop, 0, NULL);
+            for (int j = 0; j < 5; j++) {
+               vsapi->freeFrame(srcs[j]);
+               vsapi->freeFrame(diff_frames[j]);
+            }
+            for (int j = 0; j < 4; j++)
+               vsapi->freeFrame(chroma_diff_frames[j]);
+            vsapi->freeFrame(mask_frame);
 
-      const uint8_t *srcn_u = vsapi->getReadPtr(srcn, 1);
-      const uint8_t *srcn_v = vsapi->getReadPtr(srcn, 2);
-      const VSMap *srcn_props = vsapi->getFramePropertiesRO(srcn);
-      const int *srcn_diffs = (const int *)vsapi->mapGetData(srcn_props, prop, 0, NULL);
+            return NULL;
+         }
+      }
 
-      const uint8_t *srcnn_u = vsapi->getReadPtr(srcnn, 1);
-      const uint8_t *srcnn_v = vsapi->getReadPtr(srcnn, 2);
+      const VSFrame *altsrcc = NULL;
+      if (*frameData)
+         altsrcc = vsapi->getFrameFilter(n, d->altnode, frameCtx);
 
-      const uint8_t *altsrcc_u = vsapi->getReadPtr(altsrcc, 1);
-      const uint8_t *altsrcc_v = vsapi->getReadPtr(altsrcc, 2);
+      BifrostFrameInput input;
 
-      uint8_t *dst_u = vsapi->getWritePtr(dst, 1);
-      uint8_t *dst_v = vsapi->getWritePtr(dst, 2);
+      for (int i = 0; i < 5; i++) {
+         input.src_u[i] = vsapi->getReadPtr(srcs[i], 1);
+         input.src_v[i] = vsapi->getReadPtr(srcs[i], 2);
+         input.diffs[i] = (const int *)vsapi->getReadPtr(diff_frames[i], 0);
+      }
+      input.stride_uv = vsapi->getStride(srcs[2], 1);
+      input.diffs_stride = vsapi->getStride(diff_frames[2], 0) / sizeof(int);
 
-      ptrdiff_t stride_uv = vsapi->getStride(srcc, 1);
+      for (int i = 0; i < 4; i++)
+         input.chroma_diffs[i] = chroma_diff_frames[i] ? vsapi->getReadPtr(chroma_diff_frames[i], 0) : NULL;
+      input.chroma_diffs_stride = chroma_diff_frames[0] ? vsapi->getStride(chroma_diff_frames[0], 0) : 0;
 
-      int block_width_uv = d->block_width_uv;
-      int block_height_uv = d->block_height_uv;
+      input.alt_u = altsrcc ? vsapi->getReadPtr(altsrcc, 1) : NULL;
+      input.alt_v = altsrcc ? vsapi->getReadPtr(altsrcc, 2) : NULL;
 
-      int blocks_x = d->blocks_x;
-      int blocks_y = d->blocks_y;
+      input.src_y = vsapi->getReadPtr(srcs[2], 0);
+      input.stride_y = vsapi->getStride(srcs[2], 0);
 
-      for (int y = 0; y < blocks_y; y++) {
-         for (int x = 0; x < blocks_x; x++) {
-            int current_block = y*blocks_x + x;
-            float ldprev = srcp_diffs[current_block];
-            float ldnext = srcc_diffs[current_block];
-            float ldprevprev = 0.0f;
-            float ldnextnext = 0.0f;
+      input.mask = mask_frame ? vsapi->getReadPtr(mask_frame, 0) : NULL;
+      input.mask_stride = mask_frame ? vsapi->getStride(mask_frame, 0) : 0;
+      input.mask_bytes_per_sample = d->masknode ? vsapi->getVideoInfo(d->masknode)->format.bytesPerSample : 0;
 
-            //too much movement in both directions?
-            if (ldnext > d->luma_thresh && ldprev > d->luma_thresh) {
-               copyChromaBlock(dst_u + block_width_uv*x, dst_v + block_width_uv*x,
-                               altsrcc_u + block_width_uv*x, altsrcc_v + block_width_uv*x,
-                               block_width_uv, block_height_uv, stride_uv);
-               continue;
-            }
+      BifrostFrame *frame = bifrostFrameCreate(d->core, n, d->vi->numFrames, &input);
 
-            if (ldnext > d->luma_thresh) {
-               ldprevprev = srcpp_diffs[current_block];
-            } else if (ldprev > d->luma_thresh) {
-               ldnextnext = srcn_diffs[current_block];
-            }
+      // The altclip frame is only requested once it's known that some block needs it.
+      // Without altclip the chroma of srcc is copied.
+      if (d->altnode && !*frameData && bifrostFrameNeedsAltClip(frame)) {
+         vsapi->requestFrameFilter(n, d->altnode, frameCtx);
+         *frameData = (void *)1;
 
-            //two consecutive frames in one direction to generate mask?
-            if ((ldnext > d->luma_thresh && ldprevprev > d->luma_thresh) ||
-                (ldprev > d->luma_thresh && ldnextnext > d->luma_thresh)) {
-               copyChromaBlock(dst_u + block_width_uv*x, dst_v + block_width_uv*x,
-                               altsrcc_u + block_width_uv*x, altsrcc_v + block_width_uv*x,
-                               block_width_uv, block_height_uv, stride_uv);
-               continue;
-            }
+         bifrostFrameFree(frame);
 
-            //generate mask from correct side of scenechange
-            if (ldnext > d->luma_thresh) {
-               makeBlockRainbowMask(srcpp_u + block_width_uv*x, srcpp_v + block_width_uv*x,
-                                     srcp_u + block_width_uv*x,  srcp_v + block_width_uv*x,
-                                     srcc_u + block_width_uv*x,  srcc_v + block_width_uv*x,
-                                      dst_u + block_width_uv*x,   dst_v + block_width_uv*x,
-                                    block_width_uv, block_height_uv, stride_uv, d->variation);
-            } else if (ldprev > d->luma_thresh) {
-               makeBlockRainbowMask( srcc_u + block_width_uv*x,  srcc_v + block_width_uv*x,
-                                     srcn_u + block_width_uv*x,  srcn_v + block_width_uv*x,
-                                    srcnn_u + block_width_uv*x, srcnn_v + block_width_uv*x,
-                                      dst_u + block_width_uv*x,   dst_v + block_width_uv*x,
-                                    block_width_uv, block_height_uv, stride_uv, d->variation);
-            } else {
-               makeBlockRainbowMask(srcp_u + block_width_uv*x, srcp_v + block_width_uv*x,
-                                    srcc_u + block_width_uv*x, srcc_v + block_width_uv*x,
-                                    srcn_u + block_width_uv*x, srcn_v + block_width_uv*x,
-                                     dst_u + block_width_uv*x,  dst_v + block_width_uv*x,
-                                    block_width_uv, block_height_uv, stride_uv, d->variation);
-            }
+         for (int i = 0; i < 5; i++) {
+            vsapi->freeFrame(srcs[i]);
+            vsapi->freeFrame(diff_frames[i]);
+         }
+         for (int i = 0; i < 4; i++)
+            vsapi->freeFrame(chroma_diff_frames[i]);
+         vsapi->freeFrame(mask_frame);
 
-            //denoise and expand mask
-            processBlockRainbowMask(dst_u + block_width_uv*x, dst_v + block_width_uv*x,
-                                    block_width_uv, block_height_uv, stride_uv, d->conservative_mask);
-
-            //determine direction to blend in
-            int direction;
-            if (ldprev > ldnext*d->relativeframediff) {
-               direction = bdNext;
-            } else if (ldnext > ldprev*d->relativeframediff) {
-               direction = bdPrev;
-            } else {
-               direction = bdBoth;
-            }
-            applyBlockRainbowMask(srcp_u + block_width_uv*x, srcp_v + block_width_uv*x,
-                                  srcc_u + block_width_uv*x, srcc_v + block_width_uv*x,
-                                  srcn_u + block_width_uv*x, srcn_v + block_width_uv*x,
-                                   dst_u + block_width_uv*x,  dst_v + block_width_uv*x,
-                                  block_width_uv, block_height_uv, stride_uv, direction);
+         return NULL;
+      }
 
-         }
+      int chroma_source = bifrostFrameAnalyse(frame);
 
-         srcpp_u += block_height_uv * stride_uv;
-         srcpp_v += block_height_uv * stride_uv;
+      VSFrame *dst;
 
-         srcp_u += block_height_uv * stride_uv;
-         srcp_v += block_height_uv * stride_uv;
+      // When every block is copied from altclip, or no block has rainbows,
+      // the output frame simply references the chroma planes of that frame.
+      if (chroma_source == bcsProcessed) {
+         const VSFrame *planeSrc[3] = { srcs[2], NULL, NULL };
+         const int planes[3] = { 0 };
+         dst = vsapi->newVideoFrame2(&d->vi->format, d->vi->width, d->vi->height, planeSrc, planes, srcs[2], core);
 
-         srcc_u += block_height_uv * stride_uv;
-         srcc_v += block_height_uv * stride_uv;
+         bifrostFrameProcess(frame, vsapi->getWritePtr(dst, 1), vsapi->getWritePtr(dst, 2));
+      } else {
+         const VSFrame *chroma_src = chroma_source == bcsAltClip ? altsrcc : srcs[2];
+
+         const VSFrame *planeSrc[3] = { srcs[2], chroma_src, chroma_src };
+         const int planes[3] = { 0, 1, 2 };
+         dst = vsapi->newVideoFrame2(&d->vi->format, d->vi->width, d->vi->height, planeSrc, planes, srcs[2], core);
+      }
 
-         srcn_u += block_height_uv * stride_uv;
-         srcn_v += block_height_uv * stride_uv;
+      VSMap *dst_props = vsapi->getFramePropertiesRW(dst);
 
-         srcnn_u += block_height_uv * stride_uv;
-         srcnn_v += block_height_uv * stride_uv;
+      if (d->stats || d->decisions)
+         setDecisionProps(d, frame, dst_props, vsapi);
 
-         altsrcc_u += block_height_uv * stride_uv;
-         altsrcc_v += block_height_uv * stride_uv;
+      if (d->profile) {
+         const int64_t *times = bifrostFrameGetTimes(frame);
 
-         dst_u += block_height_uv * stride_uv;
-         dst_v += block_height_uv * stride_uv;
+         setProfileProps(times, psClassify, psCopy, dst_props, vsapi);
+
+         // Only there when BlockDiff was profiled too.
+         int err;
+         double blockdiff_time = vsapi->mapGetFloat(vsapi->getFramePropertiesRO(diff_frames[2]), "BifrostTimeBlockDiff", 0, &err);
+         if (!err)
+            vsapi->mapSetFloat(dst_props, "BifrostTimeBlockDiff", blockdiff_time, maReplace);
+         profileAddFrame(d->profile, times);
       }
 
-      vsapi->freeFrame(srcpp);
-      vsapi->freeFrame(srcp);
-      vsapi->freeFrame(srcc);
-      vsapi->freeFrame(srcn);
-      vsapi->freeFrame(srcnn);
+      bifrostFrameFree(frame);
+
+      for (int i = 0; i < 5; i++) {
+         vsapi->freeFrame(srcs[i]);
+         vsapi->freeFrame(diff_frames[i]);
+      }
+      for (int i = 0; i < 4; i++)
+         vsapi->freeFrame(chroma_diff_frames[i]);
       vsapi->freeFrame(altsrcc);
+      vsapi->freeFrame(mask_frame);
 
       return dst;
    }
@@ -383,11 +342,89 @@ static const VSFrame *VS_CC bifrostGetFrame(int n, int activationReason, void *i
 }
 
 
+typedef struct {
+   VSNode *node;
+   const VSVideoInfo *vi;
+   VSVideoInfo diffs_vi; // 8 bit Gray, the size of the chroma planes
+
+   const BifrostCore *core; // belongs to the Bifrost instance that made this filter
+} ChromaDiffData;
+
+
+// Used in linear mode. Every frame holds the chroma differences of a frame and
+// the next one, which are then used by the Bifrost frames before and after it,
+// instead of each of them computing the same differences.
+static const VSFrame *VS_CC chromaDiffGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+   const ChromaDiffData *d = (const ChromaDiffData *)instanceData;
+
+#define min(a, b)  (((a) < (b)) ? (a) : (b))
+
+   if (activationReason == arInitial) {
+      vsapi->requestFrameFilter(n, d->node, frameCtx);
+      vsapi->requestFrameFilter(min(n + 1, d->vi->numFrames-1), d->node, frameCtx);
+   } else if (activationReason == arAllFramesReady) {
+      const VSFrame *src1 = vsapi->getFrameFilter(n, d->node, frameCtx);
+      const VSFrame *src2 = vsapi->getFrameFilter(min(n + 1, d->vi->numFrames-1), d->node, frameCtx);
+#undef min
+
+      VSFrame *dst = vsapi->newVideoFrame(&d->diffs_vi.format, d->diffs_vi.width, d->diffs_vi.height, NULL, core);
+
+      bifrostCoreChromaDiff(d->core, vsapi->getReadPtr(src1, 1), vsapi->getReadPtr(src1, 2),
+                            vsapi->getReadPtr(src2, 1), vsapi->getReadPtr(src2, 2), vsapi->getStride(src1, 1),
+                            vsapi->getWritePtr(dst, 0), vsapi->getStride(dst, 0));
+
+      vsapi->freeFrame(src1);
+      vsapi->freeFrame(src2);
+
+      return dst;
+   }
+
+   return NULL;
+}
+
+
+static void VS_CC chromaDiffFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+   ChromaDiffData *d = (ChromaDiffData *)instanceData;
+
+   vsapi->freeNode(d->node);
+   free(d);
+}
+
+
+static VSNode *createChromaDiff(VSNode *node, const BifrostCore *bifrost_core, VSCore *core, const VSAPI *vsapi) {
+   ChromaDiffData *d = malloc(sizeof(ChromaDiffData));
+
+   d->node = vsapi->addNodeRef(node);
+   d->vi = vsapi->getVideoInfo(node);
+   d->core = bifrost_core;
+
+   d->diffs_vi = *d->vi;
+   vsapi->queryVideoFormat(&d->diffs_vi.format, cfGray, stInteger, 8, 0, 0, core);
+   d->diffs_vi.width = d->vi->width >> d->vi->format.subSamplingW;
+   d->diffs_vi.height = d->vi->height >> d->vi->format.subSamplingH;
+
+   VSFilterDependency deps[1] = { {d->node, rpGeneral} };
+
+   return vsapi->createVideoFilter2("ChromaDiff", &d->diffs_vi, chromaDiffGetFrame, chromaDiffFree, fmParallel, deps, 1, d, core);
+}
+
+
 static void VS_CC bifrostFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
    BifrostData *d = (BifrostData *)instanceData;
 
+   if (d->profile) {
+      logProfile(d->profile, "Bifrost", psClassify, psCopy, core, vsapi);
+      profileFree(d->profile);
+   }
+
    vsapi->freeNode(d->node);
+   vsapi->freeNode(d->diffnode);
+   // Only this instance uses ChromaDiff, so it's gone before the core it uses.
+   vsapi->freeNode(d->chromadiffnode);
    vsapi->freeNode(d->altnode);
+   vsapi->freeNode(d->masknode);
+   bifrostCoreFree(d->core);
+   free(d->roi);
    free(d);
 }
 
@@ -398,15 +435,9 @@ static void VS_CC bifrostFree(void *instanceData, VSCore *core, const VSAPI *vsa
         vsapi->freeMap(ret);\
         vsapi->freeNode(d.node);\
         vsapi->freeNode(d.altnode);\
-        return;\
-    }\
-} while (0);
-
-#define BIFROST_CHECK_ERROR2 do {\
-    if (vsapi->mapGetError(ret)) {\
-        vsapi->mapSetError(out, vsapi->mapGetError(ret));\
-        vsapi->freeMap(args);\
-        vsapi->freeMap(ret);\
+        vsapi->freeNode(d.masknode);\
+        bifrostCoreFree(d.core);\
+        free(d.roi);\
         return;\
     }\
 } while (0);
@@ -416,160 +447,245 @@ static void VS_CC bifrostCreate(const VSMap *in, VSMap *out, void *userData, VSC
    BifrostData *data;
    int err;
 
-   d.variation = vsapi->mapGetIntSaturated(in, "variation", 0, &err);
+   BifrostParams defaults;
+   bifrostDefaultParams(&defaults);
+
+   BifrostParams params = defaults;
+
+   params.variation = vsapi->mapGetIntSaturated(in, "variation", 0, &err);
    if (err)
-      d.variation = 5;
+      params.variation = defaults.variation;
 
-   d.interlaced = !!vsapi->mapGetInt(in, "interlaced", 0, &err);
+   params.interlaced = d.interlaced = !!vsapi->mapGetInt(in, "interlaced", 0, &err);
    if (err)
-      d.interlaced = 1;
+      params.interlaced = d.interlaced = defaults.interlaced;
 
-   d.offset = d.interlaced ? 2 : 1;
+   params.tff = d.tff = !!vsapi->mapGetInt(in, "tff", 0, &err);
+   if (err)
+      params.tff = d.tff = defaults.tff;
 
-   d.relativeframediff = 1.2f;
+   d.fields = d.interlaced ? 2 : 1;
 
-   d.luma_thresh = vsapi->mapGetFloatSaturated(in, "luma_thresh", 0, &err);
+   params.luma_thresh = vsapi->mapGetFloatSaturated(in, "luma_thresh", 0, &err);
    if (err)
-      d.luma_thresh = 10.0f;
+      params.luma_thresh = defaults.luma_thresh;
+
+   params.conservative_mask = !!vsapi->mapGetInt(in, "conservative_mask", 0, &err);
+
+   params.stats = d.stats = !!vsapi->mapGetInt(in, "stats", 0, &err);
 
-   d.conservative_mask = !!vsapi->mapGetInt(in, "conservative_mask", 0, &err);
+   d.decisions = !!vsapi->mapGetInt(in, "decisions", 0, &err);
 
-   d.block_width = vsapi->mapGetIntSaturated(in, "blockx", 0, &err);
+   int linear = !!vsapi->mapGetInt(in, "linear", 0, &err);
+
+   params.block_width = d.block_width = vsapi->mapGetIntSaturated(in, "blockx", 0, &err);
+   if (err)
+      params.block_width = d.block_width = defaults.block_width;
+
+   params.block_height = d.block_height = vsapi->mapGetIntSaturated(in, "blocky", 0, &err);
    if (err)
-      d.block_width = 4;
+      params.block_height = d.block_height = defaults.block_height;
 
-   d.block_height = vsapi->mapGetIntSaturated(in, "blocky", 0, &err);
+   params.decimation = d.decimation = vsapi->mapGetIntSaturated(in, "decimation", 0, &err);
    if (err)
-      d.block_height = 4;
+      params.decimation = d.decimation = defaults.decimation;
 
-   d.luma_thresh = d.luma_thresh * d.block_width * d.block_height;
+   params.spatial = !!vsapi->mapGetInt(in, "spatial", 0, &err);
+
+   params.spatial_thresh = vsapi->mapGetFloatSaturated(in, "spatial_thresh", 0, &err);
+   if (err)
+      params.spatial_thresh = defaults.spatial_thresh;
+
+   params.opt = vsapi->mapGetIntSaturated(in, "opt", 0, &err);
+
+   const char *opt_error = bifrostSelectOptLevel(&params.opt);
+   if (opt_error) {
+      vsapi->mapSetError(out, opt_error);
+      return;
+   }
+
+   params.threads = vsapi->mapGetIntSaturated(in, "threads", 0, &err);
+   if (err)
+      params.threads = defaults.threads;
+
+   const char *threads_error = checkThreads(params.threads);
+   if (threads_error) {
+      vsapi->mapSetError(out, threads_error);
+      return;
+   }
+
+   params.profile = profileRequested(in, vsapi);
+
+   const char *roi_error = getRoi(in, &d.roi, &d.roi_size, vsapi);
+   if (roi_error) {
+      vsapi->mapSetError(out, roi_error);
+      return;
+   }
+
+   params.roi = d.roi;
+   params.roi_count = d.roi_size / 4;
 
    d.node = vsapi->mapGetNode(in, "clip", 0, 0);
    d.vi = vsapi->getVideoInfo(d.node);
 
    d.altnode = vsapi->mapGetNode(in, "altclip", 0, &err);
-   int altnodeIsSame = err;
-   if (err)
-      d.altnode = vsapi->addNodeRef(d.node);
-
-   const VSVideoInfo *altvi = vsapi->getVideoInfo(d.altnode);
+   d.masknode = vsapi->mapGetNode(in, "maskclip", 0, &err);
 
    if (!vsh_isConstantVideoFormat(d.vi) ||
        d.vi->format.colorFamily != cfYUV ||
        d.vi->format.sampleType != stInteger ||
-       d.vi->format.bitsPerSample != 8) {
-      vsapi->mapSetError(out, "Bifrost: Only constant format 8 bit integer YUV allowed.");
+       d.vi->format.bitsPerSample > 16) {
+      vsapi->mapSetError(out, "Bifrost: Only constant format 8 to 16 bit integer YUV allowed.");
       vsapi->freeNode(d.node);
       vsapi->freeNode(d.altnode);
+      vsapi->freeNode(d.masknode);
+      free(d.roi);
       return;
    }
-   
-   if (!vsh_isSameVideoInfo(d.vi, altvi) ||
-       d.vi->numFrames != altvi->numFrames) {
+
+   if (d.altnode &&
+       (!vsh_isSameVideoInfo(d.vi, vsapi->getVideoInfo(d.altnode)) ||
+        d.vi->numFrames != vsapi->getVideoInfo(d.altnode)->numFrames)) {
 
       vsapi->mapSetError(out, "Bifrost: The two input clips must have the same format, dimensions and length.");
       vsapi->freeNode(d.node);
       vsapi->freeNode(d.altnode);
+      vsapi->freeNode(d.masknode);
+      free(d.roi);
       return;
    }
 
-   VSMap *args = vsapi->createMap();
-   VSMap *ret = NULL;
-   VSPlugin *stdPlugin = vsapi->getPluginByID(VSH_STD_PLUGIN_ID, core);
-
-   if (d.interlaced) {
-      vsapi->mapSetInt(args, "tff", 1, maReplace);
-      vsapi->mapConsumeNode(args, "clip", d.node, maReplace);
-      d.node = NULL;
-
-      ret = vsapi->invoke(stdPlugin, "SeparateFields", args);
-      BIFROST_CHECK_ERROR1
-      d.node = vsapi->mapGetNode(ret, "clip", 0, NULL);
-      vsapi->freeMap(ret);
-      ret = NULL;
+   if (d.altnode && params.spatial) {
+      vsapi->mapSetError(out, "Bifrost: altclip and spatial can't be used together.");
+      vsapi->freeNode(d.node);
+      vsapi->freeNode(d.altnode);
+      vsapi->freeNode(d.masknode);
+      free(d.roi);
+      return;
+   }
 
-      if (altnodeIsSame) {
-          vsapi->freeNode(d.altnode);
-          d.altnode = vsapi->addNodeRef(d.node);
-      } else {
-          vsapi->mapConsumeNode(args, "clip", d.altnode, maReplace);
-          d.altnode = NULL;
-          ret = vsapi->invoke(stdPlugin, "SeparateFields", args);
-          BIFROST_CHECK_ERROR1
-          d.altnode = vsapi->mapGetNode(ret, "clip", 0, NULL);
-          vsapi->freeMap(ret);
-          ret = NULL;
+   if (d.masknode) {
+      const VSVideoInfo *maskvi = vsapi->getVideoInfo(d.masknode);
+
+      if (!vsh_isConstantVideoFormat(maskvi) ||
+          maskvi->format.sampleType != stInteger ||
+          maskvi->format.bitsPerSample > 16 ||
+          maskvi->width != d.vi->width ||
+          maskvi->height != d.vi->height ||
+          maskvi->numFrames != d.vi->numFrames) {
+
+         vsapi->mapSetError(out, "Bifrost: maskclip must have 8 to 16 bit integer samples, and the same dimensions and length as clip.");
+         vsapi->freeNode(d.node);
+         vsapi->freeNode(d.altnode);
+         vsapi->freeNode(d.masknode);
+         free(d.roi);
+         return;
       }
+   }
 
-      vsapi->clearMap(args);
+   BifrostFormat format = { d.vi->width, d.vi->height, d.vi->format.subSamplingW, d.vi->format.subSamplingH, d.vi->format.bitsPerSample };
+
+   const char *core_error = NULL;
+   d.core = bifrostCoreCreate(&params, &format, &core_error);
+   if (!d.core) {
+      vsapi->mapSetError(out, core_error);
+      vsapi->freeNode(d.node);
+      vsapi->freeNode(d.altnode);
+      vsapi->freeNode(d.masknode);
+      free(d.roi);
+      return;
    }
 
-   vsapi->mapConsumeNode(args, "clip", d.node, maReplace);
-   d.node = NULL;
-   vsapi->mapSetInt(args, "interlaced", d.interlaced, maReplace);
-   vsapi->mapSetInt(args, "blockx", d.block_width, maReplace);
-   vsapi->mapSetInt(args, "blocky", d.block_height, maReplace);
+   bifrostCoreGetBlocks(d.core, &d.blocks_x, &d.blocks_y);
 
-   VSPlugin *bifrostPlugin = vsapi->getPluginByID("com.nodame.bifrost", core);
-   ret = vsapi->invoke(bifrostPlugin, "BlockDiff", args);
-   BIFROST_CHECK_ERROR1
-   d.node = vsapi->mapGetNode(ret, "clip", 0, NULL);
-   vsapi->freeMap(ret);
-   ret = NULL;
-   vsapi->clearMap(args);
+   VSMap *args = vsapi->createMap();
+   VSMap *ret = NULL;
 
-   d.vi = vsapi->getVideoInfo(d.node);
+   // The luma differences come from diffclip, or from a BlockDiff made here.
+   // Whether diffclip was made with the same field order can only be checked
+   // once its frames are available.
+   d.diffnode = vsapi->mapGetNode(in, "diffclip", 0, &err);
 
-   if (d.block_width % (1 << d.vi->format.subSamplingW) ||
-       d.block_height % (1 << d.vi->format.subSamplingH)) {
-      vsapi->mapSetError(out, "Bifrost: The requested block size is incompatible with the clip's subsampling.");
+   // Bifrost itself doesn't compute any differences that could be cached.
+   if (d.diffnode && vsapi->mapNumElements(in, "cache") > 0) {
+      vsapi->mapSetError(out, "Bifrost: cache can't be used with diffclip. It should be passed to the BlockDiff that makes diffclip.");
       vsapi->freeMap(args);
       vsapi->freeNode(d.node);
+      vsapi->freeNode(d.diffnode);
       vsapi->freeNode(d.altnode);
+      vsapi->freeNode(d.masknode);
+      bifrostCoreFree(d.core);
+      free(d.roi);
       return;
    }
 
-   d.block_width_uv = d.block_width >> d.vi->format.subSamplingW;
-   d.block_height_uv = d.block_height >> d.vi->format.subSamplingH;
+   if (!d.diffnode) {
+      vsapi->mapSetNode(args, "clip", d.node, maReplace);
+      vsapi->mapSetInt(args, "interlaced", d.interlaced, maReplace);
+      vsapi->mapSetInt(args, "tff", d.tff, maReplace);
+      vsapi->mapSetInt(args, "blockx", d.block_width, maReplace);
+      vsapi->mapSetInt(args, "blocky", d.block_height, maReplace);
+      vsapi->mapSetInt(args, "decimation", params.decimation, maReplace);
+      vsapi->mapSetInt(args, "opt", params.opt, maReplace);
+      vsapi->mapSetInt(args, "threads", params.threads, maReplace);
+      vsapi->mapSetInt(args, "profile", params.profile, maReplace);
+      vsapi->mapSetInt(args, "gray", 1, maReplace);
+
+      // The differences are only needed inside the roi. A maskclip can
+      // change every frame, so it doesn't restrict them.
+      for (int i = 0; i < d.roi_size; i++)
+         vsapi->mapSetInt(args, "roi", d.roi[i], maAppend);
+
+      const char *cache_path = vsapi->mapGetData(in, "cache", 0, &err);
+      if (!err)
+         vsapi->mapSetData(args, "cache", cache_path, -1, dtUtf8, maReplace);
+
+      VSPlugin *bifrostPlugin = vsapi->getPluginByID("com.nodame.bifrost", core);
+      ret = vsapi->invoke(bifrostPlugin, "BlockDiff", args);
+      BIFROST_CHECK_ERROR1
+      d.diffnode = vsapi->mapGetNode(ret, "clip", 0, NULL);
+      vsapi->freeMap(ret);
+      ret = NULL;
+      vsapi->clearMap(args);
+   }
 
-   if (d.block_width_uv < 2 || d.block_height_uv < 2) {
-      vsapi->mapSetError(out, "Bifrost: The requested block size is too small.");
+   const VSVideoInfo *diffvi = vsapi->getVideoInfo(d.diffnode);
+
+   if (diffvi->format.colorFamily != cfGray ||
+       diffvi->format.sampleType != stInteger ||
+       diffvi->format.bitsPerSample != 32 ||
+       diffvi->width != d.blocks_x ||
+       diffvi->height != d.blocks_y * d.fields ||
+       diffvi->numFrames != d.vi->numFrames) {
+      vsapi->mapSetError(out, "Bifrost: diffclip must be made from clip by BlockDiff with gray=True and the same blockx, blocky, and interlaced.");
       vsapi->freeMap(args);
       vsapi->freeNode(d.node);
+      vsapi->freeNode(d.diffnode);
       vsapi->freeNode(d.altnode);
+      vsapi->freeNode(d.masknode);
+      bifrostCoreFree(d.core);
+      free(d.roi);
       return;
    }
 
-   d.blocks_x = d.vi->width / d.block_width;
-   d.blocks_y = d.vi->height / d.block_height;
+   d.profile = params.profile ? profileCreate() : NULL;
 
+   d.chromadiffnode = linear ? createChromaDiff(d.node, d.core, core, vsapi) : NULL;
 
    data = malloc(sizeof(d));
    *data = d;
 
-   VSFilterDependency deps[2] = { {data->node, rpGeneral}, {data->altnode, rpStrictSpatial} };
-
-   vsapi->createVideoFilter(out, "Bifrost", data->vi, bifrostGetFrame, bifrostFree, fmParallel, deps, 2, data, core);
+   VSFilterDependency deps[5] = { {data->node, rpGeneral}, {data->diffnode, rpGeneral} };
+   int num_deps = 2;
 
-   if (d.interlaced) {
-      vsapi->mapSetInt(args, "tff", 1, maReplace);
-      vsapi->mapConsumeNode(args, "clip", vsapi->mapGetNode(out, "clip", 0, NULL), maReplace);
-      ret = vsapi->invoke(stdPlugin, "DoubleWeave", args);
-      BIFROST_CHECK_ERROR2
-      vsapi->clearMap(args);
+   if (data->chromadiffnode)
+      deps[num_deps++] = (VSFilterDependency){ data->chromadiffnode, rpGeneral };
+   if (data->altnode)
+      deps[num_deps++] = (VSFilterDependency){ data->altnode, rpStrictSpatial };
+   if (data->masknode)
+      deps[num_deps++] = (VSFilterDependency){ data->masknode, rpStrictSpatial };
 
-      vsapi->mapSetInt(args, "cycle", 2, maReplace);
-      vsapi->mapSetInt(args, "offsets", 0, maReplace);
-      vsapi->mapConsumeNode(args, "clip", vsapi->mapGetNode(ret, "clip", 0, NULL), maReplace);
-      vsapi->freeMap(ret);
-      ret = NULL;
-
-      ret = vsapi->invoke(stdPlugin, "SelectEvery", args);
-      BIFROST_CHECK_ERROR2
-      vsapi->mapConsumeNode(out, "clip", vsapi->mapGetNode(ret, "clip", 0, NULL), maReplace);
-      vsapi->freeMap(ret);
-      ret = NULL;
-   }
+   vsapi->createVideoFilter(out, "Bifrost", data->vi, bifrostGetFrame, bifrostFree, fmParallel, deps, num_deps, data, core);
 
    vsapi->freeMap(args);
 }
@@ -578,61 +694,213 @@ static void VS_CC bifrostCreate(const VSMap *in, VSMap *out, void *userData, VSC
 typedef struct {
    VSNode *node;
    int interlaced;
+   int tff;
    int block_width;
    int block_height;
    int blocks_x;
    int blocks_y;
+   int decimation;
+
+   int *roi; // NULL without a roi
+   int roi_size;
 
    const VSVideoInfo *vi;
-   int offset;
+   int fields; // 2 in interlaced mode, 1 otherwise
+
+   // The differences are returned as a clip with one 32 bit sample per block
+   // when gray is set, and attached to the frames of the input clip otherwise.
+   int gray;
+   VSVideoInfo gray_vi;
+
+   BlockDiffCore *core;
+
+   BifrostProfile *profile;
+
+   // The cache file is only opened when the first frame is made, because
+   // the fingerprint of the clip needs some of its frames.
+   char *cache_path; // NULL if no cache file was given
+   int32_t cache_key[9];
+   int cache_key_size;
+   pthread_mutex_t cache_lock;
+   BifrostDiffCache *cache; // NULL until the file is opened
+   const char *cache_error; // set if the file couldn't be opened
 } BlockDiffData;
 
 
+#define FINGERPRINT_FRAMES 3
+
+// The frames whose luma tells different clips of the same size apart: the
+// first, middle and last ones, so clips that only differ after their first
+// frame, e.g. different cuts of the same source, get different files.
+static int fingerprintFrame(const BlockDiffData *d, int i) {
+   return (int)((int64_t)(d->vi->numFrames - 1) * i / (FINGERPRINT_FRAMES - 1));
+}
+
+
+static BifrostDiffCache *getBlockDiffCache(BlockDiffData *d) {
+   return __atomic_load_n(&d->cache, __ATOMIC_ACQUIRE);
+}
+
+
+// Opens the cache file, unless another frame already did. The fingerprint
+// frames must have been requested if the file wasn't open when the frame
+// was requested. Returns an error message, or NULL.
+static const char *openBlockDiffCache(BlockDiffData *d, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+   pthread_mutex_lock(&d->cache_lock);
+
+   if (!d->cache && !d->cache_error) {
+      uint64_t fingerprint = DIFF_CACHE_FINGERPRINT_START;
+
+      for (int i = 0; i < FINGERPRINT_FRAMES; i++) {
+         const VSFrame *frame = vsapi->getFrameFilter(fingerprintFrame(d, i), d->node, frameCtx);
+
+         fingerprint = diffCacheFingerprint(fingerprint, vsapi->getReadPtr(frame, 0), vsapi->getStride(frame, 0),
+                                            (size_t)d->vi->width * d->vi->format.bytesPerSample, d->vi->height);
+         vsapi->freeFrame(frame);
+      }
+
+      BifrostDiffCache *cache = diffCacheOpen(d->cache_path, d->cache_key, d->cache_key_size, d->vi->numFrames,
+                                              d->fields * d->blocks_x * d->blocks_y * sizeof(int), fingerprint, &d->cache_error);
+      __atomic_store_n(&d->cache, cache, __ATOMIC_RELEASE);
+   }
+
+   const char *error = d->cache_error;
+
+   pthread_mutex_unlock(&d->cache_lock);
+
+   return error;
+}
+
+
+// Computes the differences between the pictures of frame n and the following ones.
+static void computeBlockDiffs(const BlockDiffData *d, int n, const VSFrame **srcs, int *diffs, ptrdiff_t diffs_stride, VSMap *props, const VSAPI *vsapi) {
+   ProfileTimes times = { 0 };
+
+   blockDiffCoreCompute(d->core, n, d->vi->numFrames, vsapi->getReadPtr(srcs[0], 0), vsapi->getReadPtr(srcs[1], 0), vsapi->getStride(srcs[0], 0),
+                        diffs, diffs_stride, d->profile ? times : NULL);
+
+   if (d->profile) {
+      setProfileProps(times, psBlockDiff, psBlockDiff, props, vsapi);
+      profileAddFrame(d->profile, times);
+   }
+}
+
+
+// Lets Bifrost check that a diffclip was made with the parameters it uses.
+// The roi, if any, follows the other parameters.
+static void setBlockDiffParams(const BlockDiffData *d, VSMap *props, const VSAPI *vsapi) {
+   int64_t params[5] = { d->block_width, d->block_height, d->interlaced, d->tff, d->decimation };
+   vsapi->mapSetIntArray(props, "BifrostBlockDiffParams", params, 5);
+
+   for (int i = 0; i < d->roi_size; i++)
+      vsapi->mapSetInt(props, "BifrostBlockDiffParams", d->roi[i], maAppend);
+}
+
+
+// Makes a frame of the gray clip out of differences stored contiguously.
+static VSFrame *newGrayDiffFrame(const BlockDiffData *d, const void *diffs, VSCore *core, const VSAPI *vsapi) {
+   VSFrame *dst = vsapi->newVideoFrame(&d->gray_vi.format, d->gray_vi.width, d->gray_vi.height, NULL, core);
+
+   vsh_bitblt(vsapi->getWritePtr(dst, 0), vsapi->getStride(dst, 0), diffs, d->blocks_x * sizeof(int),
+              d->blocks_x * sizeof(int), d->gray_vi.height);
+
+   setBlockDiffParams(d, vsapi->getFramePropertiesRW(dst), vsapi);
+
+   return dst;
+}
+
+
 static const VSFrame *VS_CC blockDiffGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
    BlockDiffData *d = (BlockDiffData *)instanceData;
 
 #define min(a, b)  (((a) < (b)) ? (a) : (b))
-#define max(a, b)  (((a) > (b)) ? (a) : (b))
    if (activationReason == arInitial) {
+      BifrostDiffCache *cache = getBlockDiffCache(d);
+      const void *cached_diffs = cache ? diffCacheGet(cache, n) : NULL;
+
+      // A frame of the gray clip can be made from the cache without any input frames.
+      if (cached_diffs && d->gray)
+         return newGrayDiffFrame(d, cached_diffs, core, vsapi);
+
       vsapi->requestFrameFilter(n, d->node, frameCtx);
-      vsapi->requestFrameFilter(min(n + d->offset, d->vi->numFrames-1), d->node, frameCtx);
+
+      // The luma of the next frame isn't needed when the differences are in the cache.
+      if (!cached_diffs)
+         vsapi->requestFrameFilter(min(n + 1, d->vi->numFrames-1), d->node, frameCtx);
+
+      if (d->cache_path && !cache)
+         for (int i = 0; i < FINGERPRINT_FRAMES; i++)
+            vsapi->requestFrameFilter(fingerprintFrame(d, i), d->node, frameCtx);
    } else if (activationReason == arAllFramesReady) {
-      const VSFrame *srcc = vsapi->getFrameFilter(n, d->node, frameCtx);
-      const VSFrame *srcn = vsapi->getFrameFilter(min(n + d->offset, d->vi->numFrames-1), d->node, frameCtx);
-#undef min
-#undef max
+      if (d->cache_path && !getBlockDiffCache(d)) {
+         const char *cache_error = openBlockDiffCache(d, frameCtx, vsapi);
 
-      VSFrame *dst = vsapi->copyFrame(srcc, core);
+         if (cache_error) {
+            vsapi->setFilterError(cache_error, frameCtx);
+            return NULL;
+         }
+      }
 
-      VSMap *props = vsapi->getFramePropertiesRW(dst);
+      // Frames are only ever added to the cache, so if frame n wasn't there
+      // when the frames were requested, the next frame was requested too.
+      BifrostDiffCache *cache = getBlockDiffCache(d);
+      const void *cached_diffs = cache ? diffCacheGet(cache, n) : NULL;
 
-      const uint8_t *srcc_y = vsapi->getReadPtr(srcc, 0);
-      const uint8_t *srcn_y = vsapi->getReadPtr(srcn, 0);
+      if (cached_diffs && d->gray)
+         return newGrayDiffFrame(d, cached_diffs, core, vsapi);
 
-      ptrdiff_t stride_y = vsapi->getStride(srcc, 0);
+      const VSFrame *srcs[2];
+      srcs[0] = vsapi->getFrameFilter(n, d->node, frameCtx);
+      srcs[1] = cached_diffs ? NULL : vsapi->getFrameFilter(min(n + 1, d->vi->numFrames-1), d->node, frameCtx);
+#undef min
 
-      int block_width = d->block_width;
-      int block_height = d->block_height;
+      size_t diffs_size = d->fields * d->blocks_x * d->blocks_y * sizeof(int);
 
-      int blocks_x = d->blocks_x;
-      int blocks_y = d->blocks_y;
+      VSFrame *dst;
 
-      void *diffs = malloc(blocks_x * blocks_y * sizeof(int));
+      if (d->gray) {
+         // Without a cache the differences are computed directly in the output frame.
+         if (cache) {
+            int *diffs = malloc(diffs_size);
 
-      for (int y = 0; y < blocks_y; y++) {
-         for (int x = 0; x < blocks_x; x++) {
-            ((int *)diffs)[y*blocks_x+x] = blockLumaDiff(srcc_y + block_width*x, srcn_y + block_width*x, block_width, block_height, stride_y);
+            dst = vsapi->newVideoFrame(&d->gray_vi.format, d->gray_vi.width, d->gray_vi.height, NULL, core);
+            computeBlockDiffs(d, n, srcs, diffs, d->blocks_x, vsapi->getFramePropertiesRW(dst), vsapi);
+            diffCachePut(cache, n, diffs);
+
+            vsh_bitblt(vsapi->getWritePtr(dst, 0), vsapi->getStride(dst, 0), diffs, d->blocks_x * sizeof(int),
+                       d->blocks_x * sizeof(int), d->gray_vi.height);
+            free(diffs);
+         } else {
+            dst = vsapi->newVideoFrame(&d->gray_vi.format, d->gray_vi.width, d->gray_vi.height, NULL, core);
+            computeBlockDiffs(d, n, srcs, (int *)vsapi->getWritePtr(dst, 0), vsapi->getStride(dst, 0) / sizeof(int),
+                              vsapi->getFramePropertiesRW(dst), vsapi);
          }
 
-         srcc_y += block_height * stride_y;
-         srcn_y += block_height * stride_y;
-      }
+         setBlockDiffParams(d, vsapi->getFramePropertiesRW(dst), vsapi);
+      } else {
+         dst = vsapi->copyFrame(srcs[0], core);
+
+         VSMap *props = vsapi->getFramePropertiesRW(dst);
+
+         setBlockDiffParams(d, props, vsapi);
+
+         if (cached_diffs) {
+            vsapi->mapSetData(props, "BifrostLumaDiff", (const char *)cached_diffs, diffs_size, dtBinary, maReplace);
+         } else {
+            int *diffs = malloc(diffs_size);
 
-      vsapi->mapSetData(props, "BifrostLumaDiff", (const char *)diffs, blocks_x * blocks_y * sizeof(int), dtBinary, maReplace);
-      free(diffs);
+            computeBlockDiffs(d, n, srcs, diffs, d->blocks_x, props, vsapi);
 
-      vsapi->freeFrame(srcc);
-      vsapi->freeFrame(srcn);
+            if (cache)
+               diffCachePut(cache, n, diffs);
+
+            vsapi->mapSetData(props, "BifrostLumaDiff", (const char *)diffs, diffs_size, dtBinary, maReplace);
+            free(diffs);
+         }
+      }
+
+      vsapi->freeFrame(srcs[0]);
+      vsapi->freeFrame(srcs[1]);
 
       return dst;
    }
@@ -644,7 +912,17 @@ static const VSFrame *VS_CC blockDiffGetFrame(int n, int activationReason, void
 static void VS_CC blockDiffFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
    BlockDiffData *d = (BlockDiffData *)instanceData;
 
+   if (d->profile) {
+      logProfile(d->profile, "BlockDiff", psBlockDiff, psBlockDiff, core, vsapi);
+      profileFree(d->profile);
+   }
+
+   diffCacheClose(d->cache);
+   pthread_mutex_destroy(&d->cache_lock);
+   free(d->cache_path);
+   blockDiffCoreFree(d->core);
    vsapi->freeNode(d->node);
+   free(d->roi);
    free(d);
 }
 
@@ -654,41 +932,143 @@ static void VS_CC blockDiffCreate(const VSMap *in, VSMap *out, void *userData, V
    BlockDiffData *data;
    int err;
 
-   d.interlaced = !!vsapi->mapGetInt(in, "interlaced", 0, &err);
+   BifrostParams defaults;
+   bifrostDefaultParams(&defaults);
+
+   BifrostParams params = defaults;
+
+   params.interlaced = d.interlaced = !!vsapi->mapGetInt(in, "interlaced", 0, &err);
    if (err)
-      d.interlaced = 1;
+      params.interlaced = d.interlaced = defaults.interlaced;
 
-   d.offset = d.interlaced ? 2 : 1;
+   params.tff = d.tff = !!vsapi->mapGetInt(in, "tff", 0, &err);
+   if (err)
+      params.tff = d.tff = defaults.tff;
+
+   d.fields = d.interlaced ? 2 : 1;
 
-   d.block_width = vsapi->mapGetIntSaturated(in, "blockx", 0, &err);
+   params.block_width = d.block_width = vsapi->mapGetIntSaturated(in, "blockx", 0, &err);
    if (err)
-      d.block_width = 4;
+      params.block_width = d.block_width = defaults.block_width;
 
-   d.block_height = vsapi->mapGetIntSaturated(in, "blocky", 0, &err);
+   params.block_height = d.block_height = vsapi->mapGetIntSaturated(in, "blocky", 0, &err);
    if (err)
-      d.block_height = 4;
+      params.block_height = d.block_height = defaults.block_height;
+
+   params.decimation = d.decimation = vsapi->mapGetIntSaturated(in, "decimation", 0, &err);
+   if (err)
+      params.decimation = d.decimation = defaults.decimation;
+
+   params.opt = vsapi->mapGetIntSaturated(in, "opt", 0, &err);
+
+   const char *opt_error = bifrostSelectOptLevel(&params.opt);
+   if (opt_error) {
+      vsapi->mapSetError(out, opt_error);
+      return;
+   }
+
+   params.threads = vsapi->mapGetIntSaturated(in, "threads", 0, &err);
+   if (err)
+      params.threads = defaults.threads;
+
+   const char *threads_error = checkThreads(params.threads);
+   if (threads_error) {
+      vsapi->mapSetError(out, threads_error);
+      return;
+   }
+
+   params.profile = profileRequested(in, vsapi);
+
+   const char *roi_error = getRoi(in, &d.roi, &d.roi_size, vsapi);
+   if (roi_error) {
+      vsapi->mapSetError(out, roi_error);
+      return;
+   }
+
+   params.roi = d.roi;
+   params.roi_count = d.roi_size / 4;
 
    d.node = vsapi->mapGetNode(in, "clip", 0, 0);
    d.vi = vsapi->getVideoInfo(d.node);
 
-   d.blocks_x = d.vi->width / d.block_width;
-   d.blocks_y = d.vi->height / d.block_height;
-
    if (!vsh_isConstantVideoFormat(d.vi) ||
        d.vi->format.colorFamily != cfYUV ||
        d.vi->format.sampleType != stInteger ||
-       d.vi->format.bitsPerSample != 8) {
-      vsapi->mapSetError(out, "Bifrost: Only constant format 8 bit integer YUV allowed.");
+       d.vi->format.bitsPerSample > 16) {
+      vsapi->mapSetError(out, "Bifrost: Only constant format 8 to 16 bit integer YUV allowed.");
+      vsapi->freeNode(d.node);
+      free(d.roi);
+      return;
+   }
+
+   BifrostFormat format = { d.vi->width, d.vi->height, d.vi->format.subSamplingW, d.vi->format.subSamplingH, d.vi->format.bitsPerSample };
+
+   const char *core_error = NULL;
+   d.core = blockDiffCoreCreate(&params, &format, &core_error);
+   if (!d.core) {
+      vsapi->mapSetError(out, core_error);
       vsapi->freeNode(d.node);
+      free(d.roi);
       return;
    }
 
+   blockDiffCoreGetBlocks(d.core, &d.blocks_x, &d.blocks_y);
+
+   d.cache_path = NULL;
+   d.cache = NULL;
+   d.cache_error = NULL;
+
+   const char *cache_path = vsapi->mapGetData(in, "cache", 0, &err);
+   if (!err) {
+      d.cache_path = malloc(strlen(cache_path) + 1);
+      strcpy(d.cache_path, cache_path);
+
+      // Everything the differences depend on, besides the clip's contents.
+      int32_t key[9] = {
+         d.vi->width,
+         d.vi->height,
+         d.vi->format.bitsPerSample,
+         d.block_width,
+         d.block_height,
+         d.interlaced,
+         d.interlaced && d.tff,
+         d.decimation
+      };
+      int key_size = 8;
+
+      // A roi is added as a hash of its rectangles.
+      if (d.roi) {
+         uint32_t hash = 2166136261u;
+         for (int i = 0; i < d.roi_size; i++)
+            hash = (hash ^ (uint32_t)d.roi[i]) * 16777619u;
+
+         key[key_size++] = (int32_t)hash;
+      }
+
+      memcpy(d.cache_key, key, sizeof(key));
+      d.cache_key_size = key_size;
+   }
+
+   d.gray = !!vsapi->mapGetInt(in, "gray", 0, &err);
+
+   if (d.gray) {
+      // One row of samples per row of blocks, with the second field below the first one.
+      d.gray_vi = *d.vi;
+      vsapi->queryVideoFormat(&d.gray_vi.format, cfGray, stInteger, 32, 0, 0, core);
+      d.gray_vi.width = d.blocks_x;
+      d.gray_vi.height = d.blocks_y * d.fields;
+   }
+
+   d.profile = params.profile ? profileCreate() : NULL;
+
    data = malloc(sizeof(d));
    *data = d;
 
+   pthread_mutex_init(&data->cache_lock, NULL);
+
    VSFilterDependency deps[1] = { {data->node, rpGeneral} };
 
-   vsapi->createVideoFilter(out, "BlockDiff", data->vi, blockDiffGetFrame, blockDiffFree, fmParallel, deps, 1, data, core);
+   vsapi->createVideoFilter(out, "BlockDiff", data->gray ? &data->gray_vi : data->vi, blockDiffGetFrame, blockDiffFree, fmParallel, deps, 1, data, core);
 }
 
 VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI *vspapi) {
@@ -700,15 +1080,37 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI
         "variation:int:opt;"
         "conservative_mask:int:opt;"
         "interlaced:int:opt;"
+        "tff:int:opt;"
         "blockx:int:opt;"
-        "blocky:int:opt;",
+        "blocky:int:opt;"
+        "decimation:int:opt;"
+        "spatial:int:opt;"
+        "spatial_thresh:float:opt;"
+        "opt:int:opt;"
+        "threads:int:opt;"
+        "stats:int:opt;"
+        "decisions:int:opt;"
+        "profile:int:opt;"
+        "cache:data:opt;"
+        "diffclip:vnode:opt;"
+        "linear:int:opt;"
+        "roi:int[]:opt;"
+        "maskclip:vnode:opt;",
         "clip:vnode;",
         bifrostCreate, 0, plugin);
     vspapi->registerFunction("BlockDiff",
         "clip:vnode;"
         "interlaced:int:opt;"
+        "tff:int:opt;"
         "blockx:int:opt;"
-        "blocky:int:opt;",
+        "blocky:int:opt;"
+        "decimation:int:opt;"
+        "opt:int:opt;"
+        "threads:int:opt;"
+        "profile:int:opt;"
+        "cache:data:opt;"
+        "gray:int:opt;"
+        "roi:int[]:opt;",
         "clip:vnode;",
         blockDiffCreate, 0, plugin);
 }
@@ -0,0 +1,243 @@
+#ifndef BIFROST_H
+#define BIFROST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+// Which three consecutive frames the rainbow mask of a block is made from.
+enum MaskSource {
+   msPrev,     // srcpp, srcp, srcc
+   msCurrent,  // srcp, srcc, srcn
+   msNext,     // srcc, srcn, srcnn
+   msAltClip,  // none, the block is copied from altclip
+   msSkip      // none, the block is outside the region of interest and keeps its chroma
+};
+
+
+enum BlendDirection {
+   bdNext,
+   bdPrev,
+   bdBoth
+};
+
+
+enum OptLevel {
+   optAuto,
+   optC,
+   optSSE2,
+   optAVX2
+};
+
+
+// All functions come in a version for 8 bit samples and one for 9 to 16 bit
+// samples, which have "16" in their names. The sample pointers are uint8_t
+// even in the latter case. Strides are in samples, not bytes, and the blend
+// directions use one byte per sample with the same stride.
+//
+// The rainbow masks use one bit per sample: sample x of a row is bit x % 8 of
+// byte x / 8, and the rows are mask_stride bytes apart. Every row has 8 bytes
+// more than its samples need, so that 8 bytes can be read and written at any
+// sample. The mask functions take the row and the first sample of their span.
+
+
+static inline uint64_t loadMask64(const uint8_t *p) {
+   uint64_t value;
+   memcpy(&value, p, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+   value = __builtin_bswap64(value);
+#endif
+   return value;
+}
+
+
+static inline void storeMask64(uint8_t *p, uint64_t value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+   value = __builtin_bswap64(value);
+#endif
+   memcpy(p, &value, sizeof(value));
+}
+
+
+// The 32 bits of a row of the mask that start at sample x.
+static inline uint32_t loadMaskBits(const uint8_t *mask, int x) {
+   return (uint32_t)(loadMask64(mask + (x >> 3)) >> (x & 7));
+}
+
+
+// Sets count <= 64 bits of a row of the mask, starting at sample x, and leaves
+// the others alone. Whole words are read and written, so that storing the bits
+// of a row in order doesn't wait for the previous store.
+static inline void storeMaskBits(uint8_t *mask, int x, uint64_t bits, int count) {
+   uint8_t *p = mask + (x >> 6) * 8;
+   int shift = x & 63;
+
+   uint64_t written = count < 64 ? ((uint64_t)1 << count) - 1 : ~(uint64_t)0;
+   bits &= written;
+
+   storeMask64(p, (loadMask64(p) & ~(written << shift)) | (bits << shift));
+
+   if (shift && count > 64 - shift)
+      storeMask64(p + 8, (loadMask64(p + 8) & ~(written >> (64 - shift))) | (bits >> (64 - shift)));
+}
+
+
+// Computes the sum of absolute differences of every block in one row of blocks.
+typedef void (*BlockLumaDiffRowFunction)(const uint8_t *src1_y, const uint8_t *src2_y, int *diffs,
+                                         int blocks_x, int block_width, int block_height, ptrdiff_t stride_y);
+
+
+// Decides the MaskSource and BlendDirection of every block in one row of blocks,
+// from the luma differences of srcpp and srcp, srcp and srcc, srcc and srcn,
+// and srcn and srcnn. Returns the number of blocks copied from altclip, and
+// adds the number of blocks with MaskSource msCurrent to *static_blocks.
+typedef int (*ClassifyRowFunction)(const int *srcpp_diffs, const int *srcp_diffs, const int *srcc_diffs, const int *srcn_diffs,
+                                   uint8_t *sources, uint8_t *directions, int blocks_x, float luma_thresh, float relativeframediff, int *static_blocks);
+
+
+// The following operate on a span of adjacent blocks from one row of blocks.
+// The last block of the span is narrower when it's at the right edge of a
+// picture whose width isn't divisible by the block width.
+// A rainbow mask is set where a rainbow was detected. The mask of the span is
+// written to the samples mask_x to mask_x + width - 1 of the rows of mask.
+typedef void (*MakeRainbowMaskFunction)(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                                        const uint8_t *srcc_u, const uint8_t *srcc_v,
+                                        const uint8_t *srcn_u, const uint8_t *srcn_v,
+                                        uint8_t *mask, int mask_x, int width, int height,
+                                        ptrdiff_t stride_uv, ptrdiff_t mask_stride, int variation);
+
+// mask is the processed rainbow mask, read from sample mask_x of its rows.
+// directions holds the BlendDirection of every column.
+typedef void (*ApplyRainbowMaskFunction)(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                                         const uint8_t *srcc_u, const uint8_t *srcc_v,
+                                         const uint8_t *srcn_u, const uint8_t *srcn_v,
+                                         const uint8_t *mask, int mask_x, uint8_t *dst_u, uint8_t *dst_v, const uint8_t *directions,
+                                         int width, int block_width_uv, int height, ptrdiff_t stride_uv, ptrdiff_t mask_stride);
+
+
+// Linear mode computes the differences of the chroma of every picture and the
+// next one once, and makes the rainbow masks from those.
+// In each byte of diffs, bits 0 to 3 are set where U of the first picture is
+// greater than U of the second one by more than variation, where it is smaller
+// by more than variation, and the same for V. Bits 4 to 7 are the same with
+// greater and smaller swapped, so a sample is a rainbow where
+// diffsp & (diffsc >> 4) & 0xf is nonzero.
+typedef void (*ChromaDiffFunction)(const uint8_t *src1_u, const uint8_t *src1_v,
+                                   const uint8_t *src2_u, const uint8_t *src2_v,
+                                   uint8_t *diffs, int width, int height, ptrdiff_t stride_uv, ptrdiff_t diffs_stride, int variation);
+
+// Same mask as MakeRainbowMaskFunction, from the differences of srcp and srcc,
+// and of srcc and srcn. The same for every bit depth.
+typedef void (*MakeRainbowMaskFromDiffsFunction)(const uint8_t *diffsp, const uint8_t *diffsc, uint8_t *mask, int mask_x,
+                                                 int width, int height, ptrdiff_t diffs_stride, ptrdiff_t mask_stride);
+
+
+// Smooths the chroma of the width × height samples starting at column x and
+// line y, for the blocks that move too much to be processed. Every sample
+// becomes the average of the samples of its 3×3 neighborhood whose luma
+// differs from its own by at most thresh, so that edges are kept.
+// The pointers point to the first sample of the picture, whose size is
+// width_uv × height_uv, so that the neighbors of the edges of the span can be
+// read. The luma is read at the top left sample covered by each chroma sample.
+typedef void (*SpatialFilterFunction)(const uint8_t *src_u, const uint8_t *src_v, const uint8_t *src_y,
+                                      uint8_t *dst_u, uint8_t *dst_v, int x, int y, int width, int height,
+                                      int width_uv, int height_uv, ptrdiff_t stride_uv, ptrdiff_t stride_y,
+                                      int subsampling_w, int subsampling_h, int thresh);
+
+
+#if defined(BIFROST_X86)
+// The rainbow mask functions need width >= 16 and variation >= 0.
+
+void blockLumaDiffRow_sse2(const uint8_t *src1_y, const uint8_t *src2_y, int *diffs,
+                           int blocks_x, int block_width, int block_height, ptrdiff_t stride_y);
+
+// blocks_x must be a multiple of 4.
+int classifyRow_sse2(const int *srcpp_diffs, const int *srcp_diffs, const int *srcc_diffs, const int *srcn_diffs,
+                     uint8_t *sources, uint8_t *directions, int blocks_x, float luma_thresh, float relativeframediff, int *static_blocks);
+
+void makeRainbowMaskRow_sse2(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                             const uint8_t *srcc_u, const uint8_t *srcc_v,
+                             const uint8_t *srcn_u, const uint8_t *srcn_v,
+                             uint8_t *mask, int mask_x, int width, int height,
+                             ptrdiff_t stride_uv, ptrdiff_t mask_stride, int variation);
+
+void applyRainbowMaskRow_sse2(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                              const uint8_t *srcc_u, const uint8_t *srcc_v,
+                              const uint8_t *srcn_u, const uint8_t *srcn_v,
+                              const uint8_t *mask, int mask_x, uint8_t *dst_u, uint8_t *dst_v, const uint8_t *directions,
+                              int width, int block_width_uv, int height, ptrdiff_t stride_uv, ptrdiff_t mask_stride);
+
+void chromaDiff_sse2(const uint8_t *src1_u, const uint8_t *src1_v,
+                     const uint8_t *src2_u, const uint8_t *src2_v,
+                     uint8_t *diffs, int width, int height, ptrdiff_t stride_uv, ptrdiff_t diffs_stride, int variation);
+
+void makeRainbowMaskFromDiffsRow_sse2(const uint8_t *diffsp, const uint8_t *diffsc, uint8_t *mask, int mask_x,
+                                      int width, int height, ptrdiff_t diffs_stride, ptrdiff_t mask_stride);
+
+void blockLumaDiffRow16_sse2(const uint8_t *src1_y, const uint8_t *src2_y, int *diffs,
+                             int blocks_x, int block_width, int block_height, ptrdiff_t stride_y);
+
+void makeRainbowMaskRow16_sse2(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                               const uint8_t *srcc_u, const uint8_t *srcc_v,
+                               const uint8_t *srcn_u, const uint8_t *srcn_v,
+                               uint8_t *mask, int mask_x, int width, int height,
+                               ptrdiff_t stride_uv, ptrdiff_t mask_stride, int variation);
+
+void applyRainbowMaskRow16_sse2(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                                const uint8_t *srcc_u, const uint8_t *srcc_v,
+                                const uint8_t *srcn_u, const uint8_t *srcn_v,
+                                const uint8_t *mask, int mask_x, uint8_t *dst_u, uint8_t *dst_v, const uint8_t *directions,
+                                int width, int block_width_uv, int height, ptrdiff_t stride_uv, ptrdiff_t mask_stride);
+
+void chromaDiff16_sse2(const uint8_t *src1_u, const uint8_t *src1_v,
+                       const uint8_t *src2_u, const uint8_t *src2_v,
+                       uint8_t *diffs, int width, int height, ptrdiff_t stride_uv, ptrdiff_t diffs_stride, int variation);
+
+void blockLumaDiffRow_avx2(const uint8_t *src1_y, const uint8_t *src2_y, int *diffs,
+                           int blocks_x, int block_width, int block_height, ptrdiff_t stride_y);
+
+// blocks_x must be a multiple of 8.
+int classifyRow_avx2(const int *srcpp_diffs, const int *srcp_diffs, const int *srcc_diffs, const int *srcn_diffs,
+                     uint8_t *sources, uint8_t *directions, int blocks_x, float luma_thresh, float relativeframediff, int *static_blocks);
+
+void makeRainbowMaskRow_avx2(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                             const uint8_t *srcc_u, const uint8_t *srcc_v,
+                             const uint8_t *srcn_u, const uint8_t *srcn_v,
+                             uint8_t *mask, int mask_x, int width, int height,
+                             ptrdiff_t stride_uv, ptrdiff_t mask_stride, int variation);
+
+void applyRainbowMaskRow_avx2(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                              const uint8_t *srcc_u, const uint8_t *srcc_v,
+                              const uint8_t *srcn_u, const uint8_t *srcn_v,
+                              const uint8_t *mask, int mask_x, uint8_t *dst_u, uint8_t *dst_v, const uint8_t *directions,
+                              int width, int block_width_uv, int height, ptrdiff_t stride_uv, ptrdiff_t mask_stride);
+
+void chromaDiff_avx2(const uint8_t *src1_u, const uint8_t *src1_v,
+                     const uint8_t *src2_u, const uint8_t *src2_v,
+                     uint8_t *diffs, int width, int height, ptrdiff_t stride_uv, ptrdiff_t diffs_stride, int variation);
+
+void makeRainbowMaskFromDiffsRow_avx2(const uint8_t *diffsp, const uint8_t *diffsc, uint8_t *mask, int mask_x,
+                                      int width, int height, ptrdiff_t diffs_stride, ptrdiff_t mask_stride);
+
+void blockLumaDiffRow16_avx2(const uint8_t *src1_y, const uint8_t *src2_y, int *diffs,
+                             int blocks_x, int block_width, int block_height, ptrdiff_t stride_y);
+
+void makeRainbowMaskRow16_avx2(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                               const uint8_t *srcc_u, const uint8_t *srcc_v,
+                               const uint8_t *srcn_u, const uint8_t *srcn_v,
+                               uint8_t *mask, int mask_x, int width, int height,
+                               ptrdiff_t stride_uv, ptrdiff_t mask_stride, int variation);
+
+void applyRainbowMaskRow16_avx2(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                                const uint8_t *srcc_u, const uint8_t *srcc_v,
+                                const uint8_t *srcn_u, const uint8_t *srcn_v,
+                                const uint8_t *mask, int mask_x, uint8_t *dst_u, uint8_t *dst_v, const uint8_t *directions,
+                                int width, int block_width_uv, int height, ptrdiff_t stride_uv, ptrdiff_t mask_stride);
+
+void chromaDiff16_avx2(const uint8_t *src1_u, const uint8_t *src1_v,
+                       const uint8_t *src2_u, const uint8_t *src2_v,
+                       uint8_t *diffs, int width, int height, ptrdiff_t stride_uv, ptrdiff_t diffs_stride, int variation);
+#endif
+
+#endif // BIFROST_H
@@ -0,0 +1,706 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <immintrin.h>
+
+#include "bifrost.h"
+
+
+// block_width must be a multiple of 4.
+void blockLumaDiffRow_avx2(const uint8_t *src1_y, const uint8_t *src2_y, int *diffs,
+                           int blocks_x, int block_width, int block_height, ptrdiff_t stride_y) {
+   int width = blocks_x * block_width;
+   int width_simd = width & ~31;
+
+   for (int x = 0; x < blocks_x; x++)
+      diffs[x] = 0;
+
+   if (block_width % 8 == 0) {
+      for (int x = 0; x < width_simd; x += 32) {
+         __m256i sum = _mm256_setzero_si256();
+
+         for (int y = 0; y < block_height; y++) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)&src1_y[y * stride_y + x]);
+            __m256i b = _mm256_loadu_si256((const __m256i *)&src2_y[y * stride_y + x]);
+            sum = _mm256_add_epi64(sum, _mm256_sad_epu8(a, b));
+         }
+
+         int64_t sums[4];
+         _mm256_storeu_si256((__m256i *)sums, sum);
+
+         for (int i = 0; i < 4; i++)
+            diffs[(x + 8 * i) / block_width] += (int)sums[i];
+      }
+   } else {
+      const __m256i zero = _mm256_setzero_si256();
+      const __m256i low_dwords = _mm256_set_epi32(0, -1, 0, -1, 0, -1, 0, -1);
+
+      for (int x = 0; x < width_simd; x += 32) {
+         __m256i sum_low = _mm256_setzero_si256();
+         __m256i sum_high = _mm256_setzero_si256();
+
+         for (int y = 0; y < block_height; y++) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)&src1_y[y * stride_y + x]);
+            __m256i b = _mm256_loadu_si256((const __m256i *)&src2_y[y * stride_y + x]);
+            __m256i absdiff = _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+
+            // vpsadbw sums groups of 8 bytes, so mask out half of each group to get sums of 4 bytes.
+            sum_low = _mm256_add_epi64(sum_low, _mm256_sad_epu8(_mm256_and_si256(absdiff, low_dwords), zero));
+            sum_high = _mm256_add_epi64(sum_high, _mm256_sad_epu8(_mm256_andnot_si256(low_dwords, absdiff), zero));
+         }
+
+         int sums[8];
+         _mm256_storeu_si256((__m256i *)sums, _mm256_or_si256(sum_low, _mm256_slli_epi64(sum_high, 32)));
+
+         for (int i = 0; i < 8; i++)
+            diffs[(x + 4 * i) / block_width] += sums[i];
+      }
+   }
+
+   for (int x = width_simd; x < width; x++) {
+      int diff = 0;
+
+      for (int y = 0; y < block_height; y++)
+         diff += abs(src1_y[y * stride_y + x] - src2_y[y * stride_y + x]);
+
+      diffs[x / block_width] += diff;
+   }
+}
+
+
+static inline __m256i select_si256(__m256i mask, __m256i a, __m256i b) {
+   return _mm256_blendv_epi8(b, a, mask);
+}
+
+
+// Packs the low bytes of eight 32 bit values.
+static inline int64_t packBytes_avx2(__m256i a) {
+   __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+
+   return _mm_cvtsi128_si64(_mm_packs_epi16(words, words));
+}
+
+
+int classifyRow_avx2(const int *srcpp_diffs, const int *srcp_diffs, const int *srcc_diffs, const int *srcn_diffs,
+                     uint8_t *sources, uint8_t *directions, int blocks_x, float luma_thresh, float relativeframediff, int *static_blocks) {
+
+   const __m256 thresh = _mm256_set1_ps(luma_thresh);
+   const __m256 relative = _mm256_set1_ps(relativeframediff);
+   const __m256i one = _mm256_set1_epi32(1);
+   const __m256i two = _mm256_set1_epi32(2);
+
+   __m256i alt_count = _mm256_setzero_si256();
+   __m256i static_count = _mm256_setzero_si256();
+
+   for (int x = 0; x < blocks_x; x += 8) {
+      __m256 ldprevprev = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)&srcpp_diffs[x]));
+      __m256 ldprev = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)&srcp_diffs[x]));
+      __m256 ldnext = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)&srcc_diffs[x]));
+      __m256 ldnextnext = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)&srcn_diffs[x]));
+
+      __m256i prev_moves = _mm256_castps_si256(_mm256_cmp_ps(ldprev, thresh, _CMP_GT_OS));
+      __m256i next_moves = _mm256_castps_si256(_mm256_cmp_ps(ldnext, thresh, _CMP_GT_OS));
+
+      __m256i alt = _mm256_or_si256(_mm256_and_si256(next_moves, _mm256_or_si256(prev_moves, _mm256_castps_si256(_mm256_cmp_ps(ldprevprev, thresh, _CMP_GT_OS)))),
+                                    _mm256_and_si256(prev_moves, _mm256_castps_si256(_mm256_cmp_ps(ldnextnext, thresh, _CMP_GT_OS))));
+
+      __m256i blend_next = _mm256_castps_si256(_mm256_cmp_ps(ldprev, _mm256_mul_ps(ldnext, relative), _CMP_GT_OS));
+      __m256i blend_prev = _mm256_castps_si256(_mm256_cmp_ps(ldnext, _mm256_mul_ps(ldprev, relative), _CMP_GT_OS));
+
+      // msPrev if next_moves, otherwise msNext if prev_moves, otherwise msCurrent.
+      __m256i source = _mm256_andnot_si256(next_moves, _mm256_sub_epi32(one, prev_moves));
+      source = select_si256(alt, _mm256_set1_epi32(msAltClip), source);
+
+      // bdNext if blend_next, otherwise bdPrev if blend_prev, otherwise bdBoth.
+      __m256i direction = _mm256_andnot_si256(blend_next, _mm256_add_epi32(two, blend_prev));
+      direction = select_si256(alt, _mm256_set1_epi32(bdBoth), direction);
+
+      alt_count = _mm256_sub_epi32(alt_count, alt);
+      static_count = _mm256_add_epi32(static_count, _mm256_andnot_si256(_mm256_or_si256(alt, _mm256_or_si256(prev_moves, next_moves)), one));
+
+      int64_t packed = packBytes_avx2(source);
+      memcpy(&sources[x], &packed, 8);
+      packed = packBytes_avx2(direction);
+      memcpy(&directions[x], &packed, 8);
+   }
+
+   int counts[16];
+   _mm256_storeu_si256((__m256i *)&counts[0], alt_count);
+   _mm256_storeu_si256((__m256i *)&counts[8], static_count);
+
+   int alt_blocks = 0;
+   for (int i = 0; i < 8; i++) {
+      alt_blocks += counts[i];
+      *static_blocks += counts[8 + i];
+   }
+
+   return alt_blocks;
+}
+
+
+// Nonzero where c is smaller or greater than both p and n by more than variation.
+static inline __m256i rainbow_avx2(__m256i p, __m256i c, __m256i n, __m256i variation) {
+   __m256i below = _mm256_subs_epu8(_mm256_subs_epu8(_mm256_min_epu8(p, n), c), variation);
+   __m256i above = _mm256_subs_epu8(_mm256_subs_epu8(c, _mm256_max_epu8(p, n)), variation);
+
+   return _mm256_or_si256(below, above);
+}
+
+
+// One bit for each of the 32 samples starting at x, set where there is a rainbow.
+static inline uint64_t rainbowBits_avx2(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                                        const uint8_t *srcc_u, const uint8_t *srcc_v,
+                                        const uint8_t *srcn_u, const uint8_t *srcn_v,
+                                        int x, __m256i variation) {
+
+   __m256i up = _mm256_loadu_si256((const __m256i *)&srcp_u[x]);
+   __m256i uc = _mm256_loadu_si256((const __m256i *)&srcc_u[x]);
+   __m256i un = _mm256_loadu_si256((const __m256i *)&srcn_u[x]);
+
+   __m256i vp = _mm256_loadu_si256((const __m256i *)&srcp_v[x]);
+   __m256i vc = _mm256_loadu_si256((const __m256i *)&srcc_v[x]);
+   __m256i vn = _mm256_loadu_si256((const __m256i *)&srcn_v[x]);
+
+   __m256i rainbow = _mm256_or_si256(rainbow_avx2(up, uc, un, variation), rainbow_avx2(vp, vc, vn, variation));
+
+   // Adding 127 sets the top bit of the nonzero bytes.
+   return (uint32_t)_mm256_movemask_epi8(_mm256_adds_epu8(rainbow, _mm256_set1_epi8(127)));
+}
+
+
+void makeRainbowMaskRow_avx2(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                             const uint8_t *srcc_u, const uint8_t *srcc_v,
+                             const uint8_t *srcn_u, const uint8_t *srcn_v,
+                             uint8_t *mask, int mask_x, int width, int height,
+                             ptrdiff_t stride_uv, ptrdiff_t mask_stride, int variation) {
+
+   if (width < 32) {
+      makeRainbowMaskRow_sse2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, mask, mask_x, width, height, stride_uv, mask_stride, variation);
+      return;
+   }
+
+   const __m256i var = _mm256_set1_epi8((char)(variation > 255 ? 255 : variation));
+
+   for (int y = 0; y < height; y++) {
+      int x = 0;
+
+      for ( ; x + 64 <= width; x += 64) {
+         uint64_t bits = rainbowBits_avx2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, x, var) |
+                         rainbowBits_avx2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, x + 32, var) << 32;
+
+         storeMaskBits(mask, mask_x + x, bits, 64);
+      }
+
+      if (x < width) {
+         // The last vector overlaps the previous one if width isn't a multiple of 32.
+         int i = x;
+         uint64_t bits = 0;
+
+         for ( ; x < width; x += 32) {
+            int j = x < width - 32 ? x : width - 32;
+            bits |= rainbowBits_avx2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, j, var) >> (x - j) << (x - i);
+         }
+
+         storeMaskBits(mask, mask_x + i, bits, width - i);
+      }
+
+      srcp_u += stride_uv;
+      srcp_v += stride_uv;
+
+      srcc_u += stride_uv;
+      srcc_v += stride_uv;
+
+      srcn_u += stride_uv;
+      srcn_v += stride_uv;
+
+      mask += mask_stride;
+   }
+}
+
+
+// 0xff for the samples whose bit of the 32 bits is 0.
+static inline __m256i maskIsZero_avx2(uint32_t bits) {
+   const __m256i bit_values = _mm256_set1_epi64x((int64_t)0x8040201008040201);
+
+   // Byte i of bits goes to bytes 8 * i to 8 * i + 7. vpshufb works within each lane.
+   const __m256i byte_indices = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                                 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+
+   __m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32((int)bits), byte_indices);
+
+   return _mm256_cmpeq_epi8(_mm256_and_si256(bytes, bit_values), _mm256_setzero_si256());
+}
+
+
+static inline __m256i blend_avx2(__m256i p, __m256i c, __m256i n, __m256i mask_is_zero, __m256i is_next, __m256i is_prev) {
+   // (2*c + p + n + 3) >> 2 is equal to avg(c, avg(p, n)).
+   __m256i blended = _mm256_avg_epu8(c, _mm256_avg_epu8(p, n));
+   blended = select_si256(is_next, _mm256_avg_epu8(c, n), blended);
+   blended = select_si256(is_prev, _mm256_avg_epu8(c, p), blended);
+
+   return select_si256(mask_is_zero, c, blended);
+}
+
+
+static inline void applyRainbowMask_avx2(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                                         const uint8_t *srcc_u, const uint8_t *srcc_v,
+                                         const uint8_t *srcn_u, const uint8_t *srcn_v,
+                                         uint32_t mask_bits, const uint8_t *directions,
+                                         __m256i *result_u, __m256i *result_v) {
+
+   __m256i dirs = _mm256_loadu_si256((const __m256i *)directions);
+   __m256i is_next = _mm256_cmpeq_epi8(dirs, _mm256_set1_epi8(bdNext));
+   __m256i is_prev = _mm256_cmpeq_epi8(dirs, _mm256_set1_epi8(bdPrev));
+   __m256i mask_is_zero = maskIsZero_avx2(mask_bits);
+
+   *result_u = blend_avx2(_mm256_loadu_si256((const __m256i *)srcp_u),
+                          _mm256_loadu_si256((const __m256i *)srcc_u),
+                          _mm256_loadu_si256((const __m256i *)srcn_u),
+                          mask_is_zero, is_next, is_prev);
+   *result_v = blend_avx2(_mm256_loadu_si256((const __m256i *)srcp_v),
+                          _mm256_loadu_si256((const __m256i *)srcc_v),
+                          _mm256_loadu_si256((const __m256i *)srcn_v),
+                          mask_is_zero, is_next, is_prev);
+}
+
+
+void applyRainbowMaskRow_avx2(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                              const uint8_t *srcc_u, const uint8_t *srcc_v,
+                              const uint8_t *srcn_u, const uint8_t *srcn_v,
+                              const uint8_t *mask, int mask_x, uint8_t *dst_u, uint8_t *dst_v, const uint8_t *directions,
+                              int width, int block_width_uv, int height, ptrdiff_t stride_uv, ptrdiff_t mask_stride) {
+
+   if (width < 32) {
+      applyRainbowMaskRow_sse2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, mask, mask_x, dst_u, dst_v, directions,
+                               width, block_width_uv, height, stride_uv, mask_stride);
+      return;
+   }
+
+   for (int y = 0; y < height; y++) {
+      // The last vector overlaps the previous one if width isn't a multiple of 32.
+      for (int i = 0; i < width; i += 32) {
+         int x = i < width - 32 ? i : width - 32;
+
+         __m256i result_u, result_v;
+
+         applyRainbowMask_avx2(srcp_u + x, srcp_v + x,
+                               srcc_u + x, srcc_v + x,
+                               srcn_u + x, srcn_v + x,
+                               loadMaskBits(mask, mask_x + x), directions + x, &result_u, &result_v);
+
+         _mm256_storeu_si256((__m256i *)&dst_u[x], result_u);
+         _mm256_storeu_si256((__m256i *)&dst_v[x], result_v);
+      }
+
+      srcp_u += stride_uv;
+      srcp_v += stride_uv;
+
+      srcc_u += stride_uv;
+      srcc_v += stride_uv;
+
+      srcn_u += stride_uv;
+      srcn_v += stride_uv;
+
+      mask += mask_stride;
+
+      dst_u += stride_uv;
+      dst_v += stride_uv;
+   }
+}
+
+
+// 0xff where a - b isn't greater than variation.
+static inline __m256i notGreater_avx2(__m256i a, __m256i b, __m256i variation) {
+   return _mm256_cmpeq_epi8(_mm256_subs_epu8(_mm256_subs_epu8(a, b), variation), _mm256_setzero_si256());
+}
+
+
+void chromaDiff_avx2(const uint8_t *src1_u, const uint8_t *src1_v,
+                     const uint8_t *src2_u, const uint8_t *src2_v,
+                     uint8_t *diffs, int width, int height, ptrdiff_t stride_uv, ptrdiff_t diffs_stride, int variation) {
+
+   if (width < 32) {
+      chromaDiff_sse2(src1_u, src1_v, src2_u, src2_v, diffs, width, height, stride_uv, diffs_stride, variation);
+      return;
+   }
+
+   const __m256i var = _mm256_set1_epi8((char)(variation > 255 ? 255 : variation));
+
+   const __m256i u_greater = _mm256_set1_epi8(0x21);
+   const __m256i u_smaller = _mm256_set1_epi8(0x12);
+   const __m256i v_greater = _mm256_set1_epi8((char)0x84);
+   const __m256i v_smaller = _mm256_set1_epi8(0x48);
+
+   for (int y = 0; y < height; y++) {
+      // The last vector overlaps the previous one if width isn't a multiple of 32.
+      for (int i = 0; i < width; i += 32) {
+         int x = i < width - 32 ? i : width - 32;
+
+         __m256i u1 = _mm256_loadu_si256((const __m256i *)&src1_u[x]);
+         __m256i u2 = _mm256_loadu_si256((const __m256i *)&src2_u[x]);
+
+         __m256i v1 = _mm256_loadu_si256((const __m256i *)&src1_v[x]);
+         __m256i v2 = _mm256_loadu_si256((const __m256i *)&src2_v[x]);
+
+         __m256i bits = _mm256_or_si256(_mm256_or_si256(_mm256_andnot_si256(notGreater_avx2(u1, u2, var), u_greater),
+                                                        _mm256_andnot_si256(notGreater_avx2(u2, u1, var), u_smaller)),
+                                        _mm256_or_si256(_mm256_andnot_si256(notGreater_avx2(v1, v2, var), v_greater),
+                                                        _mm256_andnot_si256(notGreater_avx2(v2, v1, var), v_smaller)));
+
+         _mm256_storeu_si256((__m256i *)&diffs[x], bits);
+      }
+
+      src1_u += stride_uv;
+      src1_v += stride_uv;
+
+      src2_u += stride_uv;
+      src2_v += stride_uv;
+
+      diffs += diffs_stride;
+   }
+}
+
+
+// One bit for each of the 32 samples starting at x, set where there is a rainbow.
+static inline uint64_t rainbowBitsFromDiffs_avx2(const uint8_t *diffsp, const uint8_t *diffsc, int x) {
+   __m256i p = _mm256_loadu_si256((const __m256i *)&diffsp[x]);
+   __m256i c = _mm256_loadu_si256((const __m256i *)&diffsc[x]);
+
+   // There is no byte shift, so the bits shifted in from the next byte are masked out.
+   __m256i rainbow = _mm256_and_si256(p, _mm256_and_si256(_mm256_srli_epi16(c, 4), _mm256_set1_epi8(0x0f)));
+
+   // Adding 127 sets the top bit of the nonzero bytes.
+   return (uint32_t)_mm256_movemask_epi8(_mm256_adds_epu8(rainbow, _mm256_set1_epi8(127)));
+}
+
+
+void makeRainbowMaskFromDiffsRow_avx2(const uint8_t *diffsp, const uint8_t *diffsc, uint8_t *mask, int mask_x,
+                                      int width, int height, ptrdiff_t diffs_stride, ptrdiff_t mask_stride) {
+
+   if (width < 32) {
+      makeRainbowMaskFromDiffsRow_sse2(diffsp, diffsc, mask, mask_x, width, height, diffs_stride, mask_stride);
+      return;
+   }
+
+   for (int y = 0; y < height; y++) {
+      int x = 0;
+
+      for ( ; x + 64 <= width; x += 64) {
+         uint64_t bits = rainbowBitsFromDiffs_avx2(diffsp, diffsc, x) |
+                         rainbowBitsFromDiffs_avx2(diffsp, diffsc, x + 32) << 32;
+
+         storeMaskBits(mask, mask_x + x, bits, 64);
+      }
+
+      if (x < width) {
+         // The last vector overlaps the previous one if width isn't a multiple of 32.
+         int i = x;
+         uint64_t bits = 0;
+
+         for ( ; x < width; x += 32) {
+            int j = x < width - 32 ? x : width - 32;
+            bits |= rainbowBitsFromDiffs_avx2(diffsp, diffsc, j) >> (x - j) << (x - i);
+         }
+
+         storeMaskBits(mask, mask_x + i, bits, width - i);
+      }
+
+      diffsp += diffs_stride;
+      diffsc += diffs_stride;
+
+      mask += mask_stride;
+   }
+}
+
+
+// block_width must be a multiple of 4.
+void blockLumaDiffRow16_avx2(const uint8_t *src1_y8, const uint8_t *src2_y8, int *diffs,
+                             int blocks_x, int block_width, int block_height, ptrdiff_t stride_y) {
+   const uint16_t *src1_y = (const uint16_t *)src1_y8;
+   const uint16_t *src2_y = (const uint16_t *)src2_y8;
+
+   int width = blocks_x * block_width;
+   int width_simd = width & ~15;
+
+   for (int x = 0; x < blocks_x; x++)
+      diffs[x] = 0;
+
+   for (int x = 0; x < width_simd; x += 16) {
+      __m256i sum_low = _mm256_setzero_si256();
+      __m256i sum_high = _mm256_setzero_si256();
+
+      for (int y = 0; y < block_height; y++) {
+         __m256i a = _mm256_loadu_si256((const __m256i *)&src1_y[y * stride_y + x]);
+         __m256i b = _mm256_loadu_si256((const __m256i *)&src2_y[y * stride_y + x]);
+         __m256i absdiff = _mm256_or_si256(_mm256_subs_epu16(a, b), _mm256_subs_epu16(b, a));
+
+         sum_low = _mm256_add_epi32(sum_low, _mm256_cvtepu16_epi32(_mm256_castsi256_si128(absdiff)));
+         sum_high = _mm256_add_epi32(sum_high, _mm256_cvtepu16_epi32(_mm256_extracti128_si256(absdiff, 1)));
+      }
+
+      // Every group of four columns belongs to the same block.
+      int sums[16];
+      _mm256_storeu_si256((__m256i *)&sums[0], sum_low);
+      _mm256_storeu_si256((__m256i *)&sums[8], sum_high);
+
+      for (int i = 0; i < 4; i++)
+         diffs[(x + 4 * i) / block_width] += sums[4 * i] + sums[4 * i + 1] + sums[4 * i + 2] + sums[4 * i + 3];
+   }
+
+   for (int x = width_simd; x < width; x++) {
+      int diff = 0;
+
+      for (int y = 0; y < block_height; y++)
+         diff += abs(src1_y[y * stride_y + x] - src2_y[y * stride_y + x]);
+
+      diffs[x / block_width] += diff;
+   }
+}
+
+
+// Nonzero where c is smaller or greater than both p and n by more than variation.
+static inline __m256i rainbow16_avx2(__m256i p, __m256i c, __m256i n, __m256i variation) {
+   __m256i below = _mm256_subs_epu16(_mm256_subs_epu16(_mm256_min_epu16(p, n), c), variation);
+   __m256i above = _mm256_subs_epu16(_mm256_subs_epu16(c, _mm256_max_epu16(p, n)), variation);
+
+   return _mm256_or_si256(below, above);
+}
+
+
+static inline __m256i makeRainbowMask16_avx2(const uint16_t *srcp_u, const uint16_t *srcp_v,
+                                             const uint16_t *srcc_u, const uint16_t *srcc_v,
+                                             const uint16_t *srcn_u, const uint16_t *srcn_v,
+                                             __m256i variation) {
+
+   __m256i up = _mm256_loadu_si256((const __m256i *)srcp_u);
+   __m256i uc = _mm256_loadu_si256((const __m256i *)srcc_u);
+   __m256i un = _mm256_loadu_si256((const __m256i *)srcn_u);
+
+   __m256i vp = _mm256_loadu_si256((const __m256i *)srcp_v);
+   __m256i vc = _mm256_loadu_si256((const __m256i *)srcc_v);
+   __m256i vn = _mm256_loadu_si256((const __m256i *)srcn_v);
+
+   __m256i mask = _mm256_or_si256(rainbow16_avx2(up, uc, un, variation), rainbow16_avx2(vp, vc, vn, variation));
+
+   // 0xffff where there is no rainbow.
+   return _mm256_cmpeq_epi16(mask, _mm256_setzero_si256());
+}
+
+
+// One bit for each of the 32 samples starting at x, set where there is a rainbow.
+static inline uint64_t rainbowBits16_avx2(const uint16_t *srcp_u, const uint16_t *srcp_v,
+                                          const uint16_t *srcc_u, const uint16_t *srcc_v,
+                                          const uint16_t *srcn_u, const uint16_t *srcn_v,
+                                          int x, __m256i variation) {
+
+   __m256i no_rainbow_low = makeRainbowMask16_avx2(srcp_u + x, srcp_v + x,
+                                                   srcc_u + x, srcc_v + x,
+                                                   srcn_u + x, srcn_v + x, variation);
+   __m256i no_rainbow_high = makeRainbowMask16_avx2(srcp_u + x + 16, srcp_v + x + 16,
+                                                    srcc_u + x + 16, srcc_v + x + 16,
+                                                    srcn_u + x + 16, srcn_v + x + 16, variation);
+
+   // vpacksswb works within each lane, so the middle quarters must be swapped.
+   __m256i packed = _mm256_packs_epi16(no_rainbow_low, no_rainbow_high);
+   __m256i no_rainbow = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+
+   return (uint32_t)~_mm256_movemask_epi8(no_rainbow);
+}
+
+
+void makeRainbowMaskRow16_avx2(const uint8_t *srcp_u8, const uint8_t *srcp_v8,
+                               const uint8_t *srcc_u8, const uint8_t *srcc_v8,
+                               const uint8_t *srcn_u8, const uint8_t *srcn_v8,
+                               uint8_t *mask, int mask_x, int width, int height,
+                               ptrdiff_t stride_uv, ptrdiff_t mask_stride, int variation) {
+
+   if (width < 32) {
+      makeRainbowMaskRow16_sse2(srcp_u8, srcp_v8, srcc_u8, srcc_v8, srcn_u8, srcn_v8, mask, mask_x, width, height, stride_uv, mask_stride, variation);
+      return;
+   }
+
+   const uint16_t *srcp_u = (const uint16_t *)srcp_u8;
+   const uint16_t *srcp_v = (const uint16_t *)srcp_v8;
+   const uint16_t *srcc_u = (const uint16_t *)srcc_u8;
+   const uint16_t *srcc_v = (const uint16_t *)srcc_v8;
+   const uint16_t *srcn_u = (const uint16_t *)srcn_u8;
+   const uint16_t *srcn_v = (const uint16_t *)srcn_v8;
+
+   const __m256i var = _mm256_set1_epi16((short)(variation > 65535 ? 65535 : variation));
+
+   for (int y = 0; y < height; y++) {
+      int x = 0;
+
+      for ( ; x + 64 <= width; x += 64) {
+         uint64_t bits = rainbowBits16_avx2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, x, var) |
+                         rainbowBits16_avx2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, x + 32, var) << 32;
+
+         storeMaskBits(mask, mask_x + x, bits, 64);
+      }
+
+      if (x < width) {
+         // The last vector overlaps the previous one if width isn't a multiple of 32.
+         int i = x;
+         uint64_t bits = 0;
+
+         for ( ; x < width; x += 32) {
+            int j = x < width - 32 ? x : width - 32;
+            bits |= rainbowBits16_avx2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, j, var) >> (x - j) << (x - i);
+         }
+
+         storeMaskBits(mask, mask_x + i, bits, width - i);
+      }
+
+      srcp_u += stride_uv;
+      srcp_v += stride_uv;
+
+      srcc_u += stride_uv;
+      srcc_v += stride_uv;
+
+      srcn_u += stride_uv;
+      srcn_v += stride_uv;
+
+      mask += mask_stride;
+   }
+}
+
+
+static inline __m256i blend16_avx2(__m256i p, __m256i c, __m256i n, __m256i mask_is_zero, __m256i is_next, __m256i is_prev) {
+   __m256i blended = _mm256_avg_epu16(c, _mm256_avg_epu16(p, n));
+   blended = select_si256(is_next, _mm256_avg_epu16(c, n), blended);
+   blended = select_si256(is_prev, _mm256_avg_epu16(c, p), blended);
+
+   return select_si256(mask_is_zero, c, blended);
+}
+
+
+void applyRainbowMaskRow16_avx2(const uint8_t *srcp_u8, const uint8_t *srcp_v8,
+                                const uint8_t *srcc_u8, const uint8_t *srcc_v8,
+                                const uint8_t *srcn_u8, const uint8_t *srcn_v8,
+                                const uint8_t *mask, int mask_x, uint8_t *dst_u8, uint8_t *dst_v8, const uint8_t *directions,
+                                int width, int block_width_uv, int height, ptrdiff_t stride_uv, ptrdiff_t mask_stride) {
+
+   if (width < 32) {
+      applyRainbowMaskRow16_sse2(srcp_u8, srcp_v8, srcc_u8, srcc_v8, srcn_u8, srcn_v8, mask, mask_x, dst_u8, dst_v8, directions,
+                                 width, block_width_uv, height, stride_uv, mask_stride);
+      return;
+   }
+
+   const uint16_t *srcp_u = (const uint16_t *)srcp_u8;
+   const uint16_t *srcp_v = (const uint16_t *)srcp_v8;
+   const uint16_t *srcc_u = (const uint16_t *)srcc_u8;
+   const uint16_t *srcc_v = (const uint16_t *)srcc_v8;
+   const uint16_t *srcn_u = (const uint16_t *)srcn_u8;
+   const uint16_t *srcn_v = (const uint16_t *)srcn_v8;
+   uint16_t *dst_u = (uint16_t *)dst_u8;
+   uint16_t *dst_v = (uint16_t *)dst_v8;
+
+   const __m256i zero = _mm256_setzero_si256();
+
+   // Bit i of the mask for the 16 bit sample i.
+   const __m256i bit_values = _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, -32768);
+
+   for (int y = 0; y < height; y++) {
+      // The last vector overlaps the previous one if width isn't a multiple of 32.
+      for (int i = 0; i < width; i += 32) {
+         int x = i < width - 32 ? i : width - 32;
+
+         // Widen the bytes to 16 bits, sixteen columns at a time.
+         for (int half = 0; half < 32; half += 16) {
+            int xx = x + half;
+
+            __m256i dirs = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)&directions[xx]));
+            __m256i is_next = _mm256_cmpeq_epi16(dirs, _mm256_set1_epi16(bdNext));
+            __m256i is_prev = _mm256_cmpeq_epi16(dirs, _mm256_set1_epi16(bdPrev));
+            __m256i mask_bits = _mm256_set1_epi16((short)loadMaskBits(mask, mask_x + xx));
+            __m256i mask_is_zero = _mm256_cmpeq_epi16(_mm256_and_si256(mask_bits, bit_values), zero);
+
+            __m256i result_u = blend16_avx2(_mm256_loadu_si256((const __m256i *)&srcp_u[xx]),
+                                            _mm256_loadu_si256((const __m256i *)&srcc_u[xx]),
+                                            _mm256_loadu_si256((const __m256i *)&srcn_u[xx]),
+                                            mask_is_zero, is_next, is_prev);
+            __m256i result_v = blend16_avx2(_mm256_loadu_si256((const __m256i *)&srcp_v[xx]),
+                                            _mm256_loadu_si256((const __m256i *)&srcc_v[xx]),
+                                            _mm256_loadu_si256((const __m256i *)&srcn_v[xx]),
+                                            mask_is_zero, is_next, is_prev);
+
+            _mm256_storeu_si256((__m256i *)&dst_u[xx], result_u);
+            _mm256_storeu_si256((__m256i *)&dst_v[xx], result_v);
+         }
+      }
+
+      srcp_u += stride_uv;
+      srcp_v += stride_uv;
+
+      srcc_u += stride_uv;
+      srcc_v += stride_uv;
+
+      srcn_u += stride_uv;
+      srcn_v += stride_uv;
+
+      mask += mask_stride;
+
+      dst_u += stride_uv;
+      dst_v += stride_uv;
+   }
+}
+
+
+// 0xff where a - b isn't greater than variation, for 32 samples.
+static inline __m256i notGreater16_avx2(const uint16_t *a, const uint16_t *b, __m256i variation) {
+   const __m256i zero = _mm256_setzero_si256();
+
+   __m256i low = _mm256_subs_epu16(_mm256_loadu_si256((const __m256i *)a), _mm256_loadu_si256((const __m256i *)b));
+   __m256i high = _mm256_subs_epu16(_mm256_loadu_si256((const __m256i *)(a + 16)), _mm256_loadu_si256((const __m256i *)(b + 16)));
+
+   // vpacksswb works within each lane, so the middle quarters must be swapped.
+   __m256i packed = _mm256_packs_epi16(_mm256_cmpeq_epi16(_mm256_subs_epu16(low, variation), zero),
+                                       _mm256_cmpeq_epi16(_mm256_subs_epu16(high, variation), zero));
+
+   return _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+
+void chromaDiff16_avx2(const uint8_t *src1_u8, const uint8_t *src1_v8,
+                       const uint8_t *src2_u8, const uint8_t *src2_v8,
+                       uint8_t *diffs, int width, int height, ptrdiff_t stride_uv, ptrdiff_t diffs_stride, int variation) {
+
+   if (width < 32) {
+      chromaDiff16_sse2(src1_u8, src1_v8, src2_u8, src2_v8, diffs, width, height, stride_uv, diffs_stride, variation);
+      return;
+   }
+
+   const uint16_t *src1_u = (const uint16_t *)src1_u8;
+   const uint16_t *src1_v = (const uint16_t *)src1_v8;
+   const uint16_t *src2_u = (const uint16_t *)src2_u8;
+   const uint16_t *src2_v = (const uint16_t *)src2_v8;
+
+   const __m256i var = _mm256_set1_epi16((short)(variation > 65535 ? 65535 : variation));
+
+   const __m256i u_greater = _mm256_set1_epi8(0x21);
+   const __m256i u_smaller = _mm256_set1_epi8(0x12);
+   const __m256i v_greater = _mm256_set1_epi8((char)0x84);
+   const __m256i v_smaller = _mm256_set1_epi8(0x48);
+
+   for (int y = 0; y < height; y++) {
+      // The last vector overlaps the previous one if width isn't a multiple of 32.
+      for (int i = 0; i < width; i += 32) {
+         int x = i < width - 32 ? i : width - 32;
+
+         __m256i bits = _mm256_or_si256(_mm256_or_si256(_mm256_andnot_si256(notGreater16_avx2(src1_u + x, src2_u + x, var), u_greater),
+                                                        _mm256_andnot_si256(notGreater16_avx2(src2_u + x, src1_u + x, var), u_smaller)),
+                                        _mm256_or_si256(_mm256_andnot_si256(notGreater16_avx2(src1_v + x, src2_v + x, var), v_greater),
+                                                        _mm256_andnot_si256(notGreater16_avx2(src2_v + x, src1_v + x, var), v_smaller)));
+
+         _mm256_storeu_si256((__m256i *)&diffs[x], bits);
+      }
+
+      src1_u += stride_uv;
+      src1_v += stride_uv;
+
+      src2_u += stride_uv;
+      src2_v += stride_uv;
+
+      diffs += diffs_stride;
+   }
+}
@@ -0,0 +1,515 @@
+// bifrost_check: makes sure that the SIMD code and the threads give exactly the
+// same output as the plain C code, and measures how fast each of them is.
+//
+// Usage: bifrost_check [width height frames]
+//
+// Synthetic clips of every subsampling and several bit depths and block sizes
+// are processed with opt=1, 2, and 3, each with one and with several threads.
+// The luma differences, the decisions, and the chroma of every frame are
+// compared with those of opt=1 with one thread, and the speed of every stage
+// is printed in megapixels per second. The exit status is 1 if anything
+// differs. Instruction sets the CPU doesn't support are skipped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bifrost_core.h"
+#include "bifrost_profile.h"
+
+
+#define CHECK_THREADS 4
+
+
+typedef struct {
+   BifrostFormat format;
+   int frames;
+
+   int bytes_per_sample;
+   int width_uv;
+   int height_uv;
+   ptrdiff_t stride[3]; // in bytes
+
+   uint8_t **planes[3]; // of every frame
+   uint8_t *alt_u; // the same for every frame
+   uint8_t *alt_v;
+} Clip;
+
+
+// The output of one run, compared between runs.
+typedef struct {
+   int *diffs; // of every frame
+   uint8_t *decisions;
+   uint8_t *dst_u;
+   uint8_t *dst_v;
+   int64_t rainbow_pixels;
+
+   int64_t block_diff_time; // in nanoseconds
+   int64_t frame_time;
+   ProfileTimes times;
+} Result;
+
+
+typedef struct {
+   const char *name;
+
+   int subsampling_w;
+   int subsampling_h;
+   int bits_per_sample;
+   int block_width;
+   int block_height;
+
+   int interlaced;
+   int linear;
+   int spatial;
+   int altclip;
+   int roi;
+   int decimation;
+   int conservative_mask;
+} Case;
+
+
+static const Case cases[] = {
+   { "",             1, 1,  8,  4,  4, 0, 0, 0, 0, 0, 1, 0 },
+   { "",             1, 1,  8,  8,  8, 0, 0, 0, 0, 0, 1, 0 },
+   { "",             1, 1,  8, 16, 16, 0, 0, 0, 0, 0, 1, 0 },
+   { "",             1, 0,  8,  4,  4, 0, 0, 0, 0, 0, 1, 0 },
+   { "",             1, 0,  8,  8,  8, 0, 0, 0, 0, 0, 1, 0 },
+   { "",             1, 0,  8, 16, 16, 0, 0, 0, 0, 0, 1, 0 },
+   { "",             0, 0,  8,  2,  2, 0, 0, 0, 0, 0, 1, 0 },
+   { "",             0, 0,  8,  4,  4, 0, 0, 0, 0, 0, 1, 0 },
+   { "",             0, 0,  8,  8,  8, 0, 0, 0, 0, 0, 1, 0 },
+   { "",             0, 0,  8, 16, 16, 0, 0, 0, 0, 0, 1, 0 },
+   { "",             1, 1, 10,  4,  4, 0, 0, 0, 0, 0, 1, 0 },
+   { "",             1, 1, 10,  8,  8, 0, 0, 0, 0, 0, 1, 0 },
+   { "",             1, 0, 10,  4,  4, 0, 0, 0, 0, 0, 1, 0 },
+   { "",             0, 0, 10,  4,  4, 0, 0, 0, 0, 0, 1, 0 },
+   { "",             1, 1, 16,  4,  4, 0, 0, 0, 0, 0, 1, 0 },
+   { "interlaced",   1, 1,  8,  4,  4, 1, 0, 0, 0, 0, 1, 0 },
+   { "linear",       1, 1,  8,  4,  4, 0, 1, 0, 0, 0, 1, 0 },
+   { "linear",       1, 1, 10,  4,  4, 0, 1, 0, 0, 0, 1, 0 },
+   { "spatial",      1, 1,  8,  4,  4, 0, 0, 1, 0, 0, 1, 0 },
+   { "spatial",      1, 1, 10,  4,  4, 0, 0, 1, 0, 0, 1, 0 },
+   { "altclip",      1, 1,  8,  4,  4, 0, 0, 0, 1, 0, 1, 0 },
+   { "roi",          1, 1,  8,  4,  4, 0, 0, 0, 0, 1, 1, 0 },
+   { "decimation=2", 1, 1,  8,  8,  8, 0, 0, 0, 0, 0, 2, 0 },
+   { "conservative", 1, 0,  8,  8,  8, 0, 0, 0, 0, 0, 1, 1 },
+   { "conservative", 0, 0,  8,  4,  4, 0, 0, 0, 0, 0, 1, 1 },
+};
+
+
+// The stages that are timed, in the order they're printed.
+static const int printed_stages[] = { psBlockDiff, psClassify, psMakeMask, psProcessMask, psBlend, psSpatial, psCopy };
+
+
+static uint32_t nextRandom(uint32_t *state) {
+   *state = *state * 1664525u + 1013904223u;
+   return *state >> 8;
+}
+
+
+static void writeSample(uint8_t *plane, ptrdiff_t stride, int bytes_per_sample, int x, int y, int value) {
+   if (bytes_per_sample == 2)
+      ((uint16_t *)(plane + y * stride))[x] = value;
+   else
+      plane[y * stride + x] = value;
+}
+
+
+// The luma is a static texture with a square moving across it. The chroma has
+// a static part, a part that flips between two colours every frame, which is
+// what a rainbow looks like, and the square, which keeps its colour as it
+// moves. Every plane gets a little noise, so that no two frames are equal.
+static void makeClip(Clip *clip, const Case *c, int width, int height, int frames) {
+   memset(clip, 0, sizeof(Clip));
+
+   clip->format.width = width;
+   clip->format.height = height;
+   clip->format.subsampling_w = c->subsampling_w;
+   clip->format.subsampling_h = c->subsampling_h;
+   clip->format.bits_per_sample = c->bits_per_sample;
+   clip->frames = frames;
+
+   clip->bytes_per_sample = c->bits_per_sample > 8 ? 2 : 1;
+   clip->width_uv = width >> c->subsampling_w;
+   clip->height_uv = height >> c->subsampling_h;
+
+   int shift = c->bits_per_sample - 8;
+   uint32_t state = 1;
+
+   for (int plane = 0; plane < 3; plane++) {
+      int plane_width = plane ? clip->width_uv : width;
+      int plane_height = plane ? clip->height_uv : height;
+      int sub_w = plane ? c->subsampling_w : 0;
+      int sub_h = plane ? c->subsampling_h : 0;
+
+      // Padded like the frames of VapourSynth, so that the SIMD code doesn't
+      // get the same alignment everywhere.
+      clip->stride[plane] = ((ptrdiff_t)plane_width * clip->bytes_per_sample + 63) & ~(ptrdiff_t)31;
+      clip->planes[plane] = malloc(frames * sizeof(uint8_t *));
+
+      for (int n = 0; n < frames; n++) {
+         uint8_t *p = malloc(clip->stride[plane] * plane_height);
+         clip->planes[plane][n] = p;
+
+         int square_x = (n * 7) % (width / 2);
+         int square_y = height / 4;
+         int square_size = width / 8;
+
+         for (int y = 0; y < plane_height; y++) {
+            for (int x = 0; x < plane_width; x++) {
+               int luma_x = x << sub_w;
+               int luma_y = y << sub_h;
+
+               int in_square = luma_x >= square_x && luma_x < square_x + square_size &&
+                               luma_y >= square_y && luma_y < square_y + square_size;
+               int value;
+
+               if (plane == 0)
+                  value = in_square ? 200 : 64 + ((luma_x * 3 + luma_y * 5) & 63);
+               else if (in_square)
+                  value = plane == 1 ? 90 : 170;
+               else if (luma_x > width / 2 && luma_y > height / 2)
+                  value = 128 + ((n & 1) ? 40 : -40) * (plane == 1 ? 1 : -1);
+               else
+                  value = 128 + ((luma_x + luma_y) & 15);
+
+               value += nextRandom(&state) % 3 - 1;
+
+               writeSample(p, clip->stride[plane], clip->bytes_per_sample, x, y, value << shift);
+            }
+         }
+      }
+   }
+
+   if (c->altclip) {
+      clip->alt_u = malloc(clip->stride[1] * clip->height_uv);
+      clip->alt_v = malloc(clip->stride[2] * clip->height_uv);
+
+      for (int y = 0; y < clip->height_uv; y++) {
+         for (int x = 0; x < clip->width_uv; x++) {
+            writeSample(clip->alt_u, clip->stride[1], clip->bytes_per_sample, x, y, 100 << shift);
+            writeSample(clip->alt_v, clip->stride[2], clip->bytes_per_sample, x, y, 150 << shift);
+         }
+      }
+   }
+}
+
+
+static void freeClip(Clip *clip) {
+   for (int plane = 0; plane < 3; plane++) {
+      for (int n = 0; n < clip->frames; n++)
+         free(clip->planes[plane][n]);
+      free(clip->planes[plane]);
+   }
+
+   free(clip->alt_u);
+   free(clip->alt_v);
+}
+
+
+static void freeResult(Result *result) {
+   free(result->diffs);
+   free(result->decisions);
+   free(result->dst_u);
+   free(result->dst_v);
+}
+
+
+static int clampFrame(int n, int frames) {
+   return n < 0 ? 0 : (n < frames ? n : frames - 1);
+}
+
+
+static void copyPlane(uint8_t *dst, const uint8_t *src, ptrdiff_t stride, int height) {
+   memcpy(dst, src, stride * height);
+}
+
+
+// Processes the whole clip the way the filter does. Returns an error message, or NULL.
+static const char *runCase(const Clip *clip, const Case *c, int opt, int threads, Result *result) {
+   memset(result, 0, sizeof(Result));
+
+   BifrostParams params;
+   bifrostDefaultParams(&params);
+
+   params.interlaced = c->interlaced;
+   params.block_width = c->block_width;
+   params.block_height = c->block_height;
+   params.spatial = c->spatial;
+   params.decimation = c->decimation;
+   params.conservative_mask = c->conservative_mask;
+   params.opt = opt;
+   params.threads = threads;
+   params.stats = 1;
+   params.profile = 1;
+
+   int roi[8] = { 16, 8, clip->format.width / 3, clip->format.height / 2,
+                  clip->format.width / 2, clip->format.height / 3, 40, 24 };
+   if (c->roi) {
+      params.roi = roi;
+      params.roi_count = 2;
+   }
+
+   const char *error = NULL;
+
+   BifrostCore *core = bifrostCoreCreate(&params, &clip->format, &error);
+   if (!core)
+      return error;
+
+   BlockDiffCore *block_diff = blockDiffCoreCreate(&params, &clip->format, &error);
+   if (!block_diff) {
+      bifrostCoreFree(core);
+      return error;
+   }
+
+   int frames = clip->frames;
+   int blocks_x, blocks_y;
+   bifrostCoreGetBlocks(core, &blocks_x, &blocks_y);
+
+   int blocks = (c->interlaced ? 2 : 1) * blocks_x * blocks_y;
+   size_t plane_size_uv = clip->stride[1] * clip->height_uv;
+
+   result->diffs = malloc(frames * blocks * sizeof(int));
+   result->decisions = malloc(frames * blocks);
+   result->dst_u = malloc(frames * plane_size_uv);
+   result->dst_v = malloc(frames * plane_size_uv);
+
+   ptrdiff_t chroma_diffs_stride = clip->width_uv;
+   uint8_t *chroma_diffs = c->linear ? malloc(frames * chroma_diffs_stride * clip->height_uv) : NULL;
+
+   for (int n = 0; n < frames; n++) {
+      int next = clampFrame(n + 1, frames);
+
+      int64_t start = profileClock();
+
+      blockDiffCoreCompute(block_diff, n, frames, clip->planes[0][n], clip->planes[0][next], clip->stride[0],
+                           result->diffs + n * blocks, blocks_x, result->times);
+
+      result->block_diff_time += profileClock() - start;
+
+      if (chroma_diffs)
+         bifrostCoreChromaDiff(core, clip->planes[1][n], clip->planes[2][n], clip->planes[1][next], clip->planes[2][next],
+                               clip->stride[1], chroma_diffs + n * chroma_diffs_stride * clip->height_uv, chroma_diffs_stride);
+   }
+
+   for (int n = 0; n < frames; n++) {
+      BifrostFrameInput input;
+      memset(&input, 0, sizeof(input));
+
+      for (int i = 0; i < 5; i++) {
+         int source = clampFrame(n - 2 + i, frames);
+
+         input.src_u[i] = clip->planes[1][source];
+         input.src_v[i] = clip->planes[2][source];
+         input.diffs[i] = result->diffs + source * blocks;
+
+         if (i < 4)
+            input.chroma_diffs[i] = chroma_diffs ? chroma_diffs + source * chroma_diffs_stride * clip->height_uv : NULL;
+      }
+
+      input.stride_uv = clip->stride[1];
+      input.diffs_stride = blocks_x;
+      input.chroma_diffs_stride = chroma_diffs_stride;
+      input.alt_u = clip->alt_u;
+      input.alt_v = clip->alt_v;
+      input.src_y = clip->planes[0][n];
+      input.stride_y = clip->stride[0];
+
+      uint8_t *dst_u = result->dst_u + n * plane_size_uv;
+      uint8_t *dst_v = result->dst_v + n * plane_size_uv;
+
+      int64_t start = profileClock();
+
+      BifrostFrame *frame = bifrostFrameCreate(core, n, frames, &input);
+
+      int chroma_source = bifrostFrameAnalyse(frame);
+      if (chroma_source == bcsProcessed)
+         bifrostFrameProcess(frame, dst_u, dst_v);
+
+      result->frame_time += profileClock() - start;
+
+      if (chroma_source == bcsSource) {
+         copyPlane(dst_u, clip->planes[1][n], clip->stride[1], clip->height_uv);
+         copyPlane(dst_v, clip->planes[2][n], clip->stride[2], clip->height_uv);
+      } else if (chroma_source == bcsAltClip) {
+         copyPlane(dst_u, clip->alt_u, clip->stride[1], clip->height_uv);
+         copyPlane(dst_v, clip->alt_v, clip->stride[2], clip->height_uv);
+      }
+
+      BifrostFrameStats stats;
+      bifrostFrameGetStats(frame, &stats);
+      result->rainbow_pixels += stats.rainbow_pixels;
+
+      bifrostFrameGetDecisions(frame, result->decisions + n * blocks);
+
+      const int64_t *times = bifrostFrameGetTimes(frame);
+      for (int stage = 0; stage < psStages; stage++)
+         result->times[stage] += times[stage];
+
+      bifrostFrameFree(frame);
+   }
+
+   free(chroma_diffs);
+   blockDiffCoreFree(block_diff);
+   bifrostCoreFree(core);
+
+   return NULL;
+}
+
+
+// Returns the name of the first thing that differs, or NULL.
+static const char *compareResults(const Clip *clip, const Result *a, const Result *b, int blocks) {
+   int frames = clip->frames;
+   size_t line_size = (size_t)clip->width_uv * clip->bytes_per_sample;
+
+   if (memcmp(a->diffs, b->diffs, frames * blocks * sizeof(int)))
+      return "luma differences";
+
+   if (memcmp(a->decisions, b->decisions, frames * blocks))
+      return "decisions";
+
+   // The padding at the end of the lines isn't written.
+   for (int n = 0; n < frames; n++) {
+      for (int y = 0; y < clip->height_uv; y++) {
+         ptrdiff_t offset = (n * clip->height_uv + y) * clip->stride[1];
+
+         if (memcmp(a->dst_u + offset, b->dst_u + offset, line_size) ||
+             memcmp(a->dst_v + offset, b->dst_v + offset, line_size))
+            return "chroma";
+      }
+   }
+
+   if (a->rainbow_pixels != b->rainbow_pixels)
+      return "rainbow pixel counts";
+
+   return NULL;
+}
+
+
+// Megapixels of luma per second.
+static double speed(const Clip *clip, int64_t nanoseconds) {
+   if (nanoseconds <= 0)
+      return 0.0;
+
+   return (double)clip->format.width * clip->format.height * clip->frames / nanoseconds * 1000.0;
+}
+
+
+static void printHeader(void) {
+   printf("%-34s %-9s", "", "");
+   for (size_t i = 0; i < sizeof(printed_stages) / sizeof(printed_stages[0]); i++)
+      printf(" %11s", profile_stage_names[printed_stages[i]]);
+   printf(" %11s\n", "Total");
+}
+
+
+static void printSpeed(const Clip *clip, const char *description, int opt, int threads, const Result *result) {
+   char name[32];
+   snprintf(name, sizeof(name), "opt=%d t=%d", opt, threads);
+
+   printf("%-34s %-9s", description, name);
+
+   // The stages that weren't used print a dash.
+   for (size_t i = 0; i < sizeof(printed_stages) / sizeof(printed_stages[0]); i++) {
+      int64_t time = result->times[printed_stages[i]];
+
+      if (time)
+         printf(" %11.1f", speed(clip, time));
+      else
+         printf(" %11s", "-");
+   }
+
+   printf(" %11.1f\n", speed(clip, result->block_diff_time + result->frame_time));
+}
+
+
+int main(int argc, char **argv) {
+   // Not a multiple of 16, so that there are partial blocks.
+   int width = 644;
+   int height = 364;
+   int frames = 10;
+
+   if (argc == 4) {
+      width = atoi(argv[1]);
+      height = atoi(argv[2]);
+      frames = atoi(argv[3]);
+   } else if (argc != 1) {
+      fprintf(stderr, "Usage: bifrost_check [width height frames]\n");
+      return 1;
+   }
+
+   if (width < 64 || height < 64 || frames < 1 || width % 4 || height % 4) {
+      fprintf(stderr, "bifrost_check: width and height must be multiples of 4 and at least 64, and frames at least 1.\n");
+      return 1;
+   }
+
+   printf("Speed in megapixels per second, %dx%d, %d frames.\n\n", width, height, frames);
+   printHeader();
+
+   int failures = 0;
+
+   for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+      const Case *c = &cases[i];
+
+      static const char *const subsampling_names[2][2] = { { "4:4:4", "4:4:0" }, { "4:2:2", "4:2:0" } };
+
+      char description[64];
+      snprintf(description, sizeof(description), "%s %2d bit %2dx%-2d %s",
+               subsampling_names[c->subsampling_w][c->subsampling_h], c->bits_per_sample,
+               c->block_width, c->block_height, c->name);
+
+      Clip clip;
+      makeClip(&clip, c, width, height, frames);
+
+      int blocks_x = (width + c->block_width - 1) / c->block_width;
+      int blocks_y = (height / (c->interlaced ? 2 : 1) + c->block_height - 1) / c->block_height;
+      int blocks = (c->interlaced ? 2 : 1) * blocks_x * blocks_y;
+
+      Result reference;
+      const char *error = runCase(&clip, c, 1, 1, &reference);
+      if (error) {
+         printf("%s: %s\n", description, error);
+         failures++;
+         freeClip(&clip);
+         continue;
+      }
+
+      for (int opt = 1; opt <= 3; opt++) {
+         int selected = opt;
+         if (bifrostSelectOptLevel(&selected)) {
+            printf("%-34s opt=%d     skipped, not supported\n", description, opt);
+            continue;
+         }
+
+         for (int threads = 1; threads <= CHECK_THREADS; threads += CHECK_THREADS - 1) {
+            Result result;
+            error = runCase(&clip, c, opt, threads, &result);
+
+            const char *difference = error ? NULL : compareResults(&clip, &reference, &result, blocks);
+
+            if (error) {
+               printf("%-34s opt=%d t=%d failed: %s\n", description, opt, threads, error);
+               failures++;
+            } else if (difference) {
+               printf("%-34s opt=%d t=%d FAILED: the %s differ from opt=1 t=1\n", description, opt, threads, difference);
+               failures++;
+            } else {
+               printSpeed(&clip, description, opt, threads, &result);
+            }
+
+            freeResult(&result);
+         }
+      }
+
+      freeResult(&reference);
+      freeClip(&clip);
+   }
+
+   if (failures)
+      printf("\n%d checks failed.\n", failures);
+   else
+      printf("\nEvery code path gives the same output.\n");
+
+   return !!failures;
+}
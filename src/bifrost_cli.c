@@ -0,0 +1,675 @@
+// bifrost: removes rainbows from a Y4M stream, without VapourSynth.
+//
+// Usage: bifrost [options] < input.y4m > output.y4m
+//
+// The frames are read into a ring of buffers, processed by several worker
+// threads at the same time, and written in order as soon as they are done,
+// so only a few frames are in memory at any time.
+
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "bifrost_core.h"
+#include "bifrost_profile.h"
+
+
+#define MAX_LINE 4096
+
+
+static const char usage[] =
+   "Usage: bifrost [options] < input.y4m > output.y4m\n"
+   "\n"
+   "Options, with the same meaning as the parameters of the VapourSynth filter:\n"
+   "  --luma-thresh <float>    default 10.0\n"
+   "  --variation <int>        default 5\n"
+   "  --conservative-mask\n"
+   "  --interlaced <0|1>       default from the input, or 1\n"
+   "  --tff <0|1>              default from the input, or 1\n"
+   "  --blockx <int>           default 4\n"
+   "  --blocky <int>           default 4\n"
+   "  --decimation <int>       default 1\n"
+   "  --spatial                smooth the blocks that move too much\n"
+   "  --spatial-thresh <float> default 8.0\n"
+   "  --opt <0-3>              default 0\n"
+   "  --linear\n"
+   "  --roi <x,y,w,h>          process only this rectangle, can be given several times\n"
+   "  --threads <int>          frames processed at the same time, default the number of CPUs\n"
+   "  --profile                print the time spent in every stage\n";
+
+
+typedef struct {
+   BifrostFormat format;
+   int interlaced; // -1 if the stream doesn't say
+   int tff;
+
+   size_t plane_size[3]; // in bytes
+   ptrdiff_t stride[3];
+
+   char header[MAX_LINE];
+} Y4MInfo;
+
+
+// Reads one line, without the newline. Returns 0 at the end of the stream,
+// or if the line is too long.
+static int readLine(FILE *file, char *line) {
+   int length = 0;
+
+   while (1) {
+      int c = getc(file);
+
+      if (c == EOF)
+         return 0;
+      if (c == '\n')
+         break;
+      if (length == MAX_LINE - 1)
+         return 0;
+
+      line[length++] = c;
+   }
+
+   line[length] = 0;
+
+   return 1;
+}
+
+
+// Returns an error message if the colourspace isn't supported.
+static const char *parseColourspace(const char *c, BifrostFormat *format) {
+   static const struct {
+      const char *name;
+      int subsampling_w;
+      int subsampling_h;
+   } subsamplings[] = {
+      { "420", 1, 1 },
+      { "422", 1, 0 },
+      { "444", 0, 0 },
+      { "411", 2, 0 }
+   };
+
+   for (size_t i = 0; i < sizeof(subsamplings) / sizeof(subsamplings[0]); i++) {
+      if (strncmp(c, subsamplings[i].name, 3))
+         continue;
+
+      format->subsampling_w = subsamplings[i].subsampling_w;
+      format->subsampling_h = subsamplings[i].subsampling_h;
+      format->bits_per_sample = 8;
+
+      // 420jpeg, 420mpeg2, and 420paldv only differ in the chroma siting.
+      if (c[3] == 'p' && c[4] >= '0' && c[4] <= '9')
+         format->bits_per_sample = atoi(c + 4);
+      else if (c[3] && strcmp(c + 3, "jpeg") && strcmp(c + 3, "mpeg2") && strcmp(c + 3, "paldv"))
+         break;
+
+      if (format->bits_per_sample < 8 || format->bits_per_sample > 16)
+         return "bifrost: Only 8 to 16 bit samples are supported.";
+
+      return NULL;
+   }
+
+   return "bifrost: Only YUV 4:2:0, 4:2:2, 4:4:4, and 4:1:1 are supported.";
+}
+
+
+static const char *readY4MHeader(FILE *file, Y4MInfo *info) {
+   if (!readLine(file, info->header) || strncmp(info->header, "YUV4MPEG2 ", 10))
+      return "bifrost: The input isn't a YUV4MPEG2 stream.";
+
+   info->format.width = 0;
+   info->format.height = 0;
+   info->interlaced = -1;
+   info->tff = 1;
+
+   const char *error = parseColourspace("420", &info->format);
+
+   char tokens[MAX_LINE];
+   strcpy(tokens, info->header + 10);
+
+   for (char *token = strtok(tokens, " "); token; token = strtok(NULL, " ")) {
+      if (token[0] == 'W') {
+         info->format.width = atoi(token + 1);
+      } else if (token[0] == 'H') {
+         info->format.height = atoi(token + 1);
+      } else if (token[0] == 'C') {
+         error = parseColourspace(token + 1, &info->format);
+      } else if (token[0] == 'I') {
+         if (token[1] == 'p') {
+            info->interlaced = 0;
+         } else if (token[1] == 't' || token[1] == 'b') {
+            info->interlaced = 1;
+            info->tff = token[1] == 't';
+         }
+      }
+   }
+
+   if (error)
+      return error;
+
+   if (info->format.width <= 0 || info->format.height <= 0)
+      return "bifrost: The stream has no valid dimensions.";
+
+   int bytes_per_sample = info->format.bits_per_sample > 8 ? 2 : 1;
+
+   for (int plane = 0; plane < 3; plane++) {
+      int width = plane ? info->format.width >> info->format.subsampling_w : info->format.width;
+      int height = plane ? info->format.height >> info->format.subsampling_h : info->format.height;
+
+      info->stride[plane] = (ptrdiff_t)width * bytes_per_sample;
+      info->plane_size[plane] = info->stride[plane] * height;
+   }
+
+   return NULL;
+}
+
+
+// One frame of the ring.
+typedef struct {
+   uint8_t *planes[3];
+
+   // The luma differences of this frame and the next one, and in linear mode
+   // the chroma differences, computed by one of the workers.
+   int *diffs;
+   uint8_t *chroma_diffs;
+   int diffs_ready;
+
+   uint8_t *dst_u;
+   uint8_t *dst_v;
+   int chroma_source;
+   int done;
+} Slot;
+
+
+typedef struct {
+   Y4MInfo info;
+
+   BifrostCore *core;
+   BlockDiffCore *block_diff;
+   int linear;
+   ptrdiff_t diffs_stride;
+   ptrdiff_t chroma_diffs_stride;
+
+   BifrostProfile *profile; // NULL unless profiling is enabled
+   BifrostProfile *block_diff_profile;
+
+   pthread_mutex_t lock;
+   pthread_cond_t changed;
+
+   Slot *slots;
+   int ring_size;
+
+   // Frame n is in slot n % ring_size.
+   int frames_read;
+   int eof;
+   int next_job;
+   int frames_written;
+   int quit;
+} Stream;
+
+
+static Slot *getSlot(Stream *stream, int n) {
+   return &stream->slots[n % stream->ring_size];
+}
+
+
+// Computes the differences of frame n and the next one.
+static void computeDiffs(Stream *stream, int n, int num_frames) {
+   Slot *slot = getSlot(stream, n);
+   Slot *next = getSlot(stream, n + 1 < num_frames ? n + 1 : n);
+
+   ProfileTimes times = { 0 };
+
+   blockDiffCoreCompute(stream->block_diff, n, num_frames, slot->planes[0], next->planes[0], stream->info.stride[0],
+                        slot->diffs, stream->diffs_stride, stream->profile ? times : NULL);
+
+   if (stream->profile)
+      profileAddFrame(stream->block_diff_profile, times);
+
+   if (stream->linear)
+      bifrostCoreChromaDiff(stream->core, slot->planes[1], slot->planes[2], next->planes[1], next->planes[2], stream->info.stride[1],
+                            slot->chroma_diffs, stream->chroma_diffs_stride);
+
+   pthread_mutex_lock(&stream->lock);
+   slot->diffs_ready = 1;
+   pthread_cond_broadcast(&stream->changed);
+   pthread_mutex_unlock(&stream->lock);
+}
+
+
+static void processFrame(Stream *stream, int n, int num_frames) {
+#define min(a, b)  (((a) < (b)) ? (a) : (b))
+#define max(a, b)  (((a) > (b)) ? (a) : (b))
+
+   // Job n computes the differences of frame n+2, which need frame n+3.
+   // The first job also does those of frames 0 and 1.
+   for (int i = n ? n + 2 : 0; i <= n + 2 && i < num_frames; i++)
+      computeDiffs(stream, i, num_frames);
+
+   // The others come from the jobs before this one.
+   pthread_mutex_lock(&stream->lock);
+   for (int i = max(n - 2, 0); i <= min(n + 1, num_frames - 1); i++) {
+      while (!getSlot(stream, i)->diffs_ready)
+         pthread_cond_wait(&stream->changed, &stream->lock);
+   }
+   pthread_mutex_unlock(&stream->lock);
+
+   BifrostFrameInput input;
+
+   for (int i = 0; i < 5; i++) {
+      Slot *src = getSlot(stream, min(max(n - 2 + i, 0), num_frames - 1));
+
+      input.src_u[i] = src->planes[1];
+      input.src_v[i] = src->planes[2];
+      input.diffs[i] = src->diffs;
+
+      if (i < 4)
+         input.chroma_diffs[i] = stream->linear ? src->chroma_diffs : NULL;
+   }
+#undef min
+#undef max
+
+   input.stride_uv = stream->info.stride[1];
+   input.diffs_stride = stream->diffs_stride;
+   input.chroma_diffs_stride = stream->chroma_diffs_stride;
+   input.alt_u = NULL;
+   input.alt_v = NULL;
+   input.src_y = getSlot(stream, n)->planes[0];
+   input.stride_y = stream->info.stride[0];
+   input.mask = NULL;
+
+   Slot *slot = getSlot(stream, n);
+
+   BifrostFrame *frame = bifrostFrameCreate(stream->core, n, num_frames, &input);
+
+   slot->chroma_source = bifrostFrameAnalyse(frame);
+   if (slot->chroma_source == bcsProcessed)
+      bifrostFrameProcess(frame, slot->dst_u, slot->dst_v);
+
+   if (stream->profile)
+      profileAddFrame(stream->profile, bifrostFrameGetTimes(frame));
+
+   bifrostFrameFree(frame);
+
+   pthread_mutex_lock(&stream->lock);
+   slot->done = 1;
+   pthread_cond_broadcast(&stream->changed);
+   pthread_mutex_unlock(&stream->lock);
+}
+
+
+static void *workerThread(void *arg) {
+   Stream *stream = (Stream *)arg;
+
+   pthread_mutex_lock(&stream->lock);
+
+   while (1) {
+      // Frame n can be processed once frame n+3 is there, or the stream ended.
+      while (!stream->quit && !(stream->next_job + 3 < stream->frames_read || (stream->eof && stream->next_job < stream->frames_read)))
+         pthread_cond_wait(&stream->changed, &stream->lock);
+
+      if (stream->quit)
+         break;
+
+      int n = stream->next_job++;
+      int num_frames = stream->frames_read;
+
+      pthread_mutex_unlock(&stream->lock);
+
+      processFrame(stream, n, num_frames);
+
+      pthread_mutex_lock(&stream->lock);
+   }
+
+   pthread_mutex_unlock(&stream->lock);
+
+   return NULL;
+}
+
+
+// Returns 0 at the end of the stream. Sets *error if it ends in the middle of a frame.
+static int readFrame(FILE *file, const Y4MInfo *info, Slot *slot, const char **error) {
+   char line[MAX_LINE];
+
+   if (!readLine(file, line))
+      return 0;
+
+   if (strncmp(line, "FRAME", 5)) {
+      *error = "bifrost: Expected a FRAME header.";
+      return 0;
+   }
+
+   for (int plane = 0; plane < 3; plane++) {
+      if (fread(slot->planes[plane], 1, info->plane_size[plane], file) != info->plane_size[plane]) {
+         *error = "bifrost: The last frame is incomplete.";
+         return 0;
+      }
+   }
+
+   return 1;
+}
+
+
+static int writeFrame(FILE *file, const Y4MInfo *info, const Slot *slot) {
+   const uint8_t *planes[3] = { slot->planes[0], slot->planes[1], slot->planes[2] };
+
+   if (slot->chroma_source == bcsProcessed) {
+      planes[1] = slot->dst_u;
+      planes[2] = slot->dst_v;
+   }
+
+   if (fputs("FRAME\n", file) == EOF)
+      return 0;
+
+   for (int plane = 0; plane < 3; plane++) {
+      if (fwrite(planes[plane], 1, info->plane_size[plane], file) != info->plane_size[plane])
+         return 0;
+   }
+
+   return 1;
+}
+
+
+// Reads and writes the frames, while the workers process them.
+static const char *runStream(Stream *stream, FILE *in, FILE *out) {
+   const char *error = NULL;
+
+   pthread_mutex_lock(&stream->lock);
+
+   while (!stream->eof || stream->frames_written < stream->frames_read) {
+      int n = stream->frames_written;
+      int can_write = n < stream->frames_read && getSlot(stream, n)->done;
+
+      // The slot of frame k can be reused once frame k+2 was written, as
+      // it's no longer needed by any job.
+      int can_read = !stream->eof && stream->frames_read < stream->frames_written + stream->ring_size - 2;
+
+      if (can_write) {
+         pthread_mutex_unlock(&stream->lock);
+
+         int written = writeFrame(out, &stream->info, getSlot(stream, n));
+
+         pthread_mutex_lock(&stream->lock);
+
+         if (!written) {
+            error = "bifrost: Failed to write the output.";
+            break;
+         }
+
+         stream->frames_written++;
+      } else if (can_read) {
+         int k = stream->frames_read;
+
+         Slot *slot = getSlot(stream, k);
+         slot->diffs_ready = 0;
+         slot->done = 0;
+
+         pthread_mutex_unlock(&stream->lock);
+
+         int got_frame = readFrame(in, &stream->info, slot, &error);
+
+         pthread_mutex_lock(&stream->lock);
+
+         if (got_frame)
+            stream->frames_read++;
+         else
+            stream->eof = 1;
+
+         pthread_cond_broadcast(&stream->changed);
+
+         if (error)
+            break;
+      } else {
+         pthread_cond_wait(&stream->changed, &stream->lock);
+      }
+   }
+
+   stream->quit = 1;
+   pthread_cond_broadcast(&stream->changed);
+
+   pthread_mutex_unlock(&stream->lock);
+
+   return error;
+}
+
+
+static int cpuCount(void) {
+#if defined(_WIN32)
+   SYSTEM_INFO info;
+   GetSystemInfo(&info);
+   return info.dwNumberOfProcessors;
+#else
+   long count = sysconf(_SC_NPROCESSORS_ONLN);
+   return count > 0 ? count : 1;
+#endif
+}
+
+
+static void printProfile(BifrostProfile *profile, const char *filter_name, int first_stage, int last_stage) {
+   ProfileTimes times;
+   int frames = profileTotals(profile, times);
+
+   fprintf(stderr, "%s: %d frames.", filter_name, frames);
+
+   for (int i = first_stage; i <= last_stage; i++)
+      fprintf(stderr, " %s: %.3f s.", profile_stage_names[i], times[i] / 1e9);
+
+   fprintf(stderr, "\n");
+}
+
+
+int main(int argc, char **argv) {
+#if defined(_WIN32)
+   _setmode(_fileno(stdin), _O_BINARY);
+   _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+   BifrostParams params;
+   bifrostDefaultParams(&params);
+
+   int interlaced = -1;
+   int tff = -1;
+   int linear = 0;
+   int threads = cpuCount();
+
+   int *roi = NULL;
+   int roi_count = 0;
+
+   for (int i = 1; i < argc; i++) {
+      const char *option = argv[i];
+      const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+      if (!strcmp(option, "--conservative-mask")) {
+         params.conservative_mask = 1;
+      } else if (!strcmp(option, "--linear")) {
+         linear = 1;
+      } else if (!strcmp(option, "--spatial")) {
+         params.spatial = 1;
+      } else if (!strcmp(option, "--profile")) {
+         params.profile = 1;
+      } else if (value && !strcmp(option, "--luma-thresh")) {
+         params.luma_thresh = atof(value);
+         i++;
+      } else if (value && !strcmp(option, "--variation")) {
+         params.variation = atoi(value);
+         i++;
+      } else if (value && !strcmp(option, "--interlaced")) {
+         interlaced = !!atoi(value);
+         i++;
+      } else if (value && !strcmp(option, "--tff")) {
+         tff = !!atoi(value);
+         i++;
+      } else if (value && !strcmp(option, "--blockx")) {
+         params.block_width = atoi(value);
+         i++;
+      } else if (value && !strcmp(option, "--blocky")) {
+         params.block_height = atoi(value);
+         i++;
+      } else if (value && !strcmp(option, "--decimation")) {
+         params.decimation = atoi(value);
+         i++;
+      } else if (value && !strcmp(option, "--spatial-thresh")) {
+         params.spatial_thresh = atof(value);
+         i++;
+      } else if (value && !strcmp(option, "--opt")) {
+         params.opt = atoi(value);
+         i++;
+      } else if (value && !strcmp(option, "--roi")) {
+         roi = realloc(roi, 4 * (roi_count + 1) * sizeof(int));
+
+         int *rect = roi + 4 * roi_count++;
+         if (sscanf(value, "%d,%d,%d,%d", &rect[0], &rect[1], &rect[2], &rect[3]) != 4) {
+            fprintf(stderr, "bifrost: --roi needs x,y,width,height.\n");
+            free(roi);
+            return 1;
+         }
+         i++;
+      } else if (value && !strcmp(option, "--threads")) {
+         threads = atoi(value);
+         i++;
+      } else {
+         fputs(usage, stderr);
+         free(roi);
+         return !!strcmp(option, "--help");
+      }
+   }
+
+   params.roi = roi;
+   params.roi_count = roi_count;
+
+   if (threads < 1) {
+      fprintf(stderr, "bifrost: threads must be at least 1.\n");
+      free(roi);
+      return 1;
+   }
+
+   Stream stream;
+   memset(&stream, 0, sizeof(stream));
+
+   const char *error = readY4MHeader(stdin, &stream.info);
+   if (error) {
+      fprintf(stderr, "%s\n", error);
+      free(roi);
+      return 1;
+   }
+
+   // The stream's field order is used unless it's overridden.
+   params.interlaced = interlaced >= 0 ? interlaced : (stream.info.interlaced >= 0 ? stream.info.interlaced : params.interlaced);
+   params.tff = tff >= 0 ? tff : stream.info.tff;
+
+   // The frames are processed in parallel, so each of them uses a single thread.
+   params.threads = 1;
+
+   stream.core = bifrostCoreCreate(&params, &stream.info.format, &error);
+   if (stream.core)
+      stream.block_diff = blockDiffCoreCreate(&params, &stream.info.format, &error);
+
+   // The cores keep their own copy of the region.
+   free(roi);
+
+   if (!stream.block_diff) {
+      fprintf(stderr, "%s\n", error);
+      bifrostCoreFree(stream.core);
+      return 1;
+   }
+
+   int blocks_x, blocks_y;
+   bifrostCoreGetBlocks(stream.core, &blocks_x, &blocks_y);
+
+   int fields = params.interlaced ? 2 : 1;
+
+   stream.linear = linear;
+   stream.diffs_stride = blocks_x;
+   stream.chroma_diffs_stride = stream.info.format.width >> stream.info.format.subsampling_w;
+
+   stream.profile = params.profile ? profileCreate() : NULL;
+   stream.block_diff_profile = params.profile ? profileCreate() : NULL;
+
+   // Up to threads frames are processed while the two before them and the
+   // three after them are needed too.
+   stream.ring_size = threads + 6;
+   stream.slots = calloc(stream.ring_size, sizeof(Slot));
+
+   for (int i = 0; i < stream.ring_size; i++) {
+      Slot *slot = &stream.slots[i];
+
+      for (int plane = 0; plane < 3; plane++)
+         slot->planes[plane] = malloc(stream.info.plane_size[plane]);
+
+      slot->diffs = malloc(fields * blocks_x * blocks_y * sizeof(int) + 1);
+      slot->chroma_diffs = linear ? malloc(stream.info.plane_size[1] / (stream.info.format.bits_per_sample > 8 ? 2 : 1)) : NULL;
+      slot->dst_u = malloc(stream.info.plane_size[1]);
+      slot->dst_v = malloc(stream.info.plane_size[2]);
+   }
+
+   pthread_mutex_init(&stream.lock, NULL);
+   pthread_cond_init(&stream.changed, NULL);
+
+   static char out_buffer[1 << 20];
+   setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+
+   printf("%s\n", stream.info.header);
+
+   pthread_t *workers = malloc(threads * sizeof(pthread_t));
+   int started = 0;
+
+   for ( ; started < threads; started++) {
+      if (pthread_create(&workers[started], NULL, workerThread, &stream))
+         break;
+   }
+
+   if (started)
+      error = runStream(&stream, stdin, stdout);
+   else
+      error = "bifrost: Failed to start the worker threads.";
+
+   for (int i = 0; i < started; i++)
+      pthread_join(workers[i], NULL);
+
+   if (fflush(stdout) && !error)
+      error = "bifrost: Failed to write the output.";
+
+   if (error)
+      fprintf(stderr, "%s\n", error);
+
+   if (stream.profile) {
+      printProfile(stream.profile, "Bifrost", psClassify, psCopy);
+      printProfile(stream.block_diff_profile, "BlockDiff", psBlockDiff, psBlockDiff);
+   }
+
+   free(workers);
+
+   for (int i = 0; i < stream.ring_size; i++) {
+      Slot *slot = &stream.slots[i];
+
+      for (int plane = 0; plane < 3; plane++)
+         free(slot->planes[plane]);
+
+      free(slot->diffs);
+      free(slot->chroma_diffs);
+      free(slot->dst_u);
+      free(slot->dst_v);
+   }
+   free(stream.slots);
+
+   pthread_cond_destroy(&stream.changed);
+   pthread_mutex_destroy(&stream.lock);
+
+   profileFree(stream.profile);
+   profileFree(stream.block_diff_profile);
+   blockDiffCoreFree(stream.block_diff);
+   bifrostCoreFree(stream.core);
+
+   return !!error;
+}
@@ -0,0 +1,2099 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bifrost.h"
+#include "bifrost_core.h"
+#include "bifrost_profile.h"
+#include "bifrost_threads.h"
+
+
+struct BifrostCore {
+   float luma_thresh;
+   int variation;
+   int conservative_mask;
+   int tff;
+   int stats;
+   int block_width;
+   int block_height;
+   int block_width_uv;
+   int block_height_uv;
+   int blocks_x;
+   int blocks_y;
+   int last_block_width; // of the luma, smaller than block_width when the width isn't divisible by it
+   int last_block_height; // the same for the last row of blocks of each picture
+   int width_uv;
+   int height_uv;
+   int picture_height_uv; // height_uv of one field in interlaced mode
+
+   float relativeframediff;
+   int fields; // 2 in interlaced mode, 1 otherwise
+
+   // One bit per chroma column, like a row of a rainbow mask. has_left_neighbor
+   // and has_right_neighbor are set for every column that isn't the first or
+   // the last column of a block, respectively. The last column of the picture
+   // has no right neighbor.
+   uint8_t *has_left_neighbor;
+   uint8_t *has_right_neighbor;
+   ptrdiff_t mask_stride; // in bytes, enough for a row of the picture
+
+   // One byte per block of every picture, nonzero inside the roi. NULL without a roi.
+   uint8_t *region;
+
+   int bytes_per_sample;
+
+   // Spans of blocks narrower than simd_width are processed with the C functions.
+   MakeRainbowMaskFunction makeRainbowMask;
+   ApplyRainbowMaskFunction applyRainbowMask;
+   MakeRainbowMaskFunction makeRainbowMaskNarrow;
+   ApplyRainbowMaskFunction applyRainbowMaskNarrow;
+   MakeRainbowMaskFromDiffsFunction makeRainbowMaskFromDiffs;
+   int simd_width;
+
+   // Handles a multiple of classify_width blocks. The rest are done with classifyRow_c.
+   ClassifyRowFunction classifyRow;
+   int classify_width;
+
+   ChromaDiffFunction chromaDiff;
+
+   SpatialFilterFunction spatialFilter; // NULL unless the moving blocks are smoothed
+   int spatial_thresh;
+   int subsampling_w;
+   int subsampling_h;
+
+   BifrostThreadPool *pool; // NULL when every frame is processed by a single thread
+   int bands; // per picture
+   int chunk_blocks; // blocks of a row processed at a time
+
+   int profile;
+};
+
+
+static inline int maskBit(const uint8_t *mask, int x) {
+   return (mask[x >> 3] >> (x & 7)) & 1;
+}
+
+
+static inline void applyBlockRainbowMask(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                                         const uint8_t *srcc_u, const uint8_t *srcc_v,
+                                         const uint8_t *srcn_u, const uint8_t *srcn_v,
+                                         const uint8_t *mask, int mask_x, uint8_t *restrict dst_u, uint8_t *restrict dst_v,
+                                         int block_width_uv, int block_height_uv, ptrdiff_t stride_uv, ptrdiff_t mask_stride,
+                                         int blenddirection) {
+
+   for (int y = 0; y < block_height_uv; y++) {
+      if (blenddirection == bdNext) {
+         for (int x = 0; x < block_width_uv; x++) {
+            if (maskBit(mask, mask_x + x)) {
+               dst_u[x] = (srcc_u[x]+srcn_u[x]+1) >> 1;
+               dst_v[x] = (srcc_v[x]+srcn_v[x]+1) >> 1;
+            } else {
+               dst_u[x] = srcc_u[x];
+               dst_v[x] = srcc_v[x];
+            }
+         }
+      } else if (blenddirection == bdPrev) {
+         for (int x = 0; x < block_width_uv; x++) {
+            if (maskBit(mask, mask_x + x)) {
+               dst_u[x] = (srcc_u[x]+srcp_u[x]+1) >> 1;
+               dst_v[x] = (srcc_v[x]+srcp_v[x]+1) >> 1;
+            } else {
+               dst_u[x] = srcc_u[x];
+               dst_v[x] = srcc_v[x];
+            }
+         }
+      } else if (blenddirection == bdBoth) {
+         for (int x = 0; x < block_width_uv; x++) {
+            if (maskBit(mask, mask_x + x)) {
+               dst_u[x] = (2*srcc_u[x]+srcp_u[x]+srcn_u[x]+3) >> 2;
+               dst_v[x] = (2*srcc_v[x]+srcp_v[x]+srcn_v[x]+3) >> 2;
+            } else {
+               dst_u[x] = srcc_u[x];
+               dst_v[x] = srcc_v[x];
+            }
+         }
+      }
+
+      srcp_u += stride_uv;
+      srcp_v += stride_uv;
+
+      srcc_u += stride_uv;
+      srcc_v += stride_uv;
+
+      srcn_u += stride_uv;
+      srcn_v += stride_uv;
+
+      mask += mask_stride;
+
+      dst_u += stride_uv;
+      dst_v += stride_uv;
+   }
+}
+
+
+// Whether the chroma of the current frame is smaller or greater than that of
+// both neighbouring frames by more than variation.
+static inline int isRainbow(int up, int uc, int un, int vp, int vc, int vn, int variation) {
+   int ucup = uc-up;
+   int ucun = uc-un;
+
+   int vcvp = vc-vp;
+   int vcvn = vc-vn;
+
+   return (((( ucup+variation) & ( ucun+variation))
+          | ((-ucup+variation) & (-ucun+variation))
+          | (( vcvp+variation) & ( vcvn+variation))
+          | ((-vcvp+variation) & (-vcvn+variation))) < 0);
+}
+
+
+static void makeBlockRainbowMask(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                                 const uint8_t *srcc_u, const uint8_t *srcc_v,
+                                 const uint8_t *srcn_u, const uint8_t *srcn_v,
+                                 uint8_t *mask, int mask_x, int block_width_uv, int block_height_uv,
+                                 ptrdiff_t stride_uv, ptrdiff_t mask_stride, int variation) {
+
+   for (int y = 0; y < block_height_uv; y++) {
+      // The bits are written 64 at a time.
+      for (int i = 0; i < block_width_uv; i += 64) {
+         int count = block_width_uv - i < 64 ? block_width_uv - i : 64;
+         uint64_t bits = 0;
+
+         for (int x = 0; x < count; x++)
+            bits |= (uint64_t)isRainbow(srcp_u[i + x], srcc_u[i + x], srcn_u[i + x],
+                                        srcp_v[i + x], srcc_v[i + x], srcn_v[i + x], variation) << x;
+
+         storeMaskBits(mask, mask_x + i, bits, count);
+      }
+
+      srcp_u += stride_uv;
+      srcp_v += stride_uv;
+
+      srcc_u += stride_uv;
+      srcc_v += stride_uv;
+
+      srcn_u += stride_uv;
+      srcn_v += stride_uv;
+
+      mask += mask_stride;
+   }
+}
+
+
+static void copyChromaBlock(uint8_t *restrict dst_u, uint8_t *restrict dst_v,
+                      const uint8_t *src_u, const uint8_t *src_v,
+                      int block_width_uv, int block_height_uv, ptrdiff_t stride_uv) {
+
+   for (int y = 0; y < block_height_uv; y++) {
+      memcpy(dst_u, src_u, block_width_uv);
+      memcpy(dst_v, src_v, block_width_uv);
+
+      dst_u += stride_uv;
+      dst_v += stride_uv;
+      src_u += stride_uv;
+      src_v += stride_uv;
+   }
+}
+
+
+// The mask is computed independently for each pixel, so any width works.
+static void makeRainbowMaskRow_c(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                                 const uint8_t *srcc_u, const uint8_t *srcc_v,
+                                 const uint8_t *srcn_u, const uint8_t *srcn_v,
+                                 uint8_t *mask, int mask_x, int width, int height,
+                                 ptrdiff_t stride_uv, ptrdiff_t mask_stride, int variation) {
+
+   makeBlockRainbowMask(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, mask, mask_x, width, height, stride_uv, mask_stride, variation);
+}
+
+
+// The mask is processed 64 samples at a time. Word i of a row holds the
+// samples 64 * i to 64 * i + 63, and the last one is followed by another word.
+static inline uint64_t loadMaskWord(const uint8_t *row, int i) {
+   return loadMask64(row + 8 * i);
+}
+
+
+// The bits of word i of a row that are the samples x to x + width - 1.
+static inline uint64_t spanWordBits(int i, int x, int width) {
+   uint64_t bits = ~(uint64_t)0;
+
+   if (i == x >> 6)
+      bits <<= x & 63;
+   if (i == (x + width - 1) >> 6 && (x + width) & 63)
+      bits &= ~(uint64_t)0 >> (64 - ((x + width) & 63));
+
+   return bits;
+}
+
+
+// Stores the bits of value that are set in written.
+static inline void storeMaskWord(uint8_t *row, int i, uint64_t value, uint64_t written) {
+   storeMask64(row + 8 * i, (loadMaskWord(row, i) & ~written) | (value & written));
+}
+
+
+// Keeps the marked samples of word i of a row of the raw mask that have a
+// marked neighbor in the same block. The neighbors of the edges of the word
+// come from the words around it.
+static inline uint64_t denoiseWord(const uint8_t *row, int i, uint64_t has_left_neighbor, uint64_t has_right_neighbor) {
+   uint64_t center = loadMaskWord(row, i);
+   uint64_t left = (center << 1) | (i > 0 ? loadMaskWord(row, i - 1) >> 63 : 0);
+   uint64_t right = (center >> 1) | (loadMaskWord(row, i + 1) << 63);
+
+   return center & ((left & has_left_neighbor) | (right & has_right_neighbor));
+}
+
+
+// Denoises and expands the raw mask of the samples x to x + width - 1 of the
+// rows of raw_mask, into mask. The first and the last line of the span are the
+// edges of the blocks. The columns around the span are the edges of other
+// blocks, so they don't change the result and aren't written.
+static void processRainbowMask(const uint8_t *raw_mask, uint8_t *mask,
+                               const uint8_t *has_left_neighbor, const uint8_t *has_right_neighbor,
+                               int x, int width, int height, ptrdiff_t mask_stride, int conservative_mask) {
+
+   for (int i = x >> 6; i <= (x + width - 1) >> 6; i++) {
+      uint64_t written = spanWordBits(i, x, width);
+
+      uint64_t left_valid = loadMaskWord(has_left_neighbor, i);
+      uint64_t right_valid = loadMaskWord(has_right_neighbor, i);
+
+      // The rows are denoised one ahead of the row being expanded, so every
+      // row of the mask is written once.
+      uint64_t above = 0;
+      uint64_t center = denoiseWord(raw_mask, i, left_valid, right_valid);
+
+      for (int y = 0; y < height; y++) {
+         uint64_t below = 0;
+         if (y < height - 1)
+            below = denoiseWord(raw_mask + (y + 1) * mask_stride, i, left_valid, right_valid);
+
+         uint64_t result = center;
+
+         //expand mask vertically
+         if (!conservative_mask) {
+            if (y == 0)
+               result |= below;
+            else if (y == height - 1)
+               result |= above;
+            else
+               result |= above & below;
+         }
+
+         storeMaskWord(mask + y * mask_stride, i, result, written);
+
+         above = center;
+         center = below;
+      }
+   }
+}
+
+
+static void applyRainbowMaskRow_c(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                                  const uint8_t *srcc_u, const uint8_t *srcc_v,
+                                  const uint8_t *srcn_u, const uint8_t *srcn_v,
+                                  const uint8_t *mask, int mask_x, uint8_t *dst_u, uint8_t *dst_v, const uint8_t *directions,
+                                  int width, int block_width_uv, int height, ptrdiff_t stride_uv, ptrdiff_t mask_stride) {
+
+   for (int x = 0; x < width; x += block_width_uv) {
+      int w = width - x < block_width_uv ? width - x : block_width_uv;
+      applyBlockRainbowMask(srcp_u + x, srcp_v + x,
+                            srcc_u + x, srcc_v + x,
+                            srcn_u + x, srcn_v + x,
+                            mask, mask_x + x, dst_u + x, dst_v + x,
+                            w, height, stride_uv, mask_stride, directions[x]);
+   }
+}
+
+
+// Versions of applyRainbowMaskRow_c for the most common block sizes, which the
+// compiler can unroll because the size is known. Spans with a partial block at
+// the right or bottom edge go to the generic version.
+#define SPECIALIZED_BLOCK_FUNCTIONS(w, h) \
+static void applyRainbowMaskRow_##w##x##h##_c(const uint8_t *srcp_u, const uint8_t *srcp_v, \
+                                           const uint8_t *srcc_u, const uint8_t *srcc_v, \
+                                           const uint8_t *srcn_u, const uint8_t *srcn_v, \
+                                           const uint8_t *mask, int mask_x, uint8_t *dst_u, uint8_t *dst_v, const uint8_t *directions, \
+                                           int width, int block_width_uv, int height, ptrdiff_t stride_uv, ptrdiff_t mask_stride) { \
+   if (width % w || height != h) { \
+      applyRainbowMaskRow_c(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, mask, mask_x, dst_u, dst_v, directions, \
+                            width, block_width_uv, height, stride_uv, mask_stride); \
+      return; \
+   } \
+   for (int x = 0; x < width; x += w) \
+      applyBlockRainbowMask(srcp_u + x, srcp_v + x, srcc_u + x, srcc_v + x, srcn_u + x, srcn_v + x, \
+                            mask, mask_x + x, dst_u + x, dst_v + x, w, h, stride_uv, mask_stride, directions[x]); \
+}
+
+SPECIALIZED_BLOCK_FUNCTIONS(2, 2)
+SPECIALIZED_BLOCK_FUNCTIONS(4, 4)
+SPECIALIZED_BLOCK_FUNCTIONS(8, 8)
+
+
+// Looked up with the chroma block size. Only for 8 bit samples.
+static const struct {
+   int block_width_uv;
+   int block_height_uv;
+   ApplyRainbowMaskFunction applyRainbowMask;
+} specialized_block_functions[] = {
+   { 2, 2, applyRainbowMaskRow_2x2_c },
+   { 4, 4, applyRainbowMaskRow_4x4_c },
+   { 8, 8, applyRainbowMaskRow_8x8_c }
+};
+
+
+static void chromaDiff_c(const uint8_t *src1_u, const uint8_t *src1_v,
+                         const uint8_t *src2_u, const uint8_t *src2_v,
+                         uint8_t *diffs, int width, int height, ptrdiff_t stride_uv, ptrdiff_t diffs_stride, int variation) {
+
+   for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+         int du = src1_u[x] - src2_u[x];
+         int dv = src1_v[x] - src2_v[x];
+
+         diffs[x] = ( du > variation ? 0x21 : 0)
+                  | (-du > variation ? 0x12 : 0)
+                  | ( dv > variation ? 0x84 : 0)
+                  | (-dv > variation ? 0x48 : 0);
+      }
+
+      src1_u += stride_uv;
+      src1_v += stride_uv;
+
+      src2_u += stride_uv;
+      src2_v += stride_uv;
+
+      diffs += diffs_stride;
+   }
+}
+
+
+static void makeRainbowMaskFromDiffsRow_c(const uint8_t *diffsp, const uint8_t *diffsc, uint8_t *mask, int mask_x,
+                                          int width, int height, ptrdiff_t diffs_stride, ptrdiff_t mask_stride) {
+
+   for (int y = 0; y < height; y++) {
+      // The bits are written 64 at a time.
+      for (int i = 0; i < width; i += 64) {
+         int count = width - i < 64 ? width - i : 64;
+         uint64_t bits = 0;
+
+         for (int x = 0; x < count; x++)
+            bits |= (uint64_t)((diffsp[i + x] & (diffsc[i + x] >> 4)) != 0) << x;
+
+         storeMaskBits(mask, mask_x + i, bits, count);
+      }
+
+      diffsp += diffs_stride;
+      diffsc += diffs_stride;
+
+      mask += mask_stride;
+   }
+}
+
+
+// The sample itself is always part of the average, so count is at least 1.
+#define SPATIAL_FILTER(name, type) \
+static void name(const uint8_t *src_u8, const uint8_t *src_v8, const uint8_t *src_y8, \
+                 uint8_t *dst_u8, uint8_t *dst_v8, int x, int y, int width, int height, \
+                 int width_uv, int height_uv, ptrdiff_t stride_uv, ptrdiff_t stride_y, \
+                 int subsampling_w, int subsampling_h, int thresh) { \
+   const type *src_u = (const type *)src_u8; \
+   const type *src_v = (const type *)src_v8; \
+   const type *src_y = (const type *)src_y8; \
+   type *dst_u = (type *)dst_u8; \
+   type *dst_v = (type *)dst_v8; \
+\
+   for (int j = y; j < y + height; j++) { \
+      int top = j > 0 ? j - 1 : j; \
+      int bottom = j < height_uv - 1 ? j + 1 : j; \
+\
+      for (int i = x; i < x + width; i++) { \
+         int left = i > 0 ? i - 1 : i; \
+         int right = i < width_uv - 1 ? i + 1 : i; \
+\
+         int luma = src_y[(j << subsampling_h) * stride_y + (i << subsampling_w)]; \
+         int sum_u = 0, sum_v = 0, count = 0; \
+\
+         for (int b = top; b <= bottom; b++) { \
+            for (int a = left; a <= right; a++) { \
+               if (abs(src_y[(b << subsampling_h) * stride_y + (a << subsampling_w)] - luma) <= thresh) { \
+                  sum_u += src_u[b * stride_uv + a]; \
+                  sum_v += src_v[b * stride_uv + a]; \
+                  count++; \
+               } \
+            } \
+         } \
+\
+         dst_u[j * stride_uv + i] = (sum_u + count / 2) / count; \
+         dst_v[j * stride_uv + i] = (sum_v + count / 2) / count; \
+      } \
+   } \
+}
+
+SPATIAL_FILTER(spatialFilter_c, uint8_t)
+SPATIAL_FILTER(spatialFilter16_c, uint16_t)
+
+
+static int blockLumaDiff(const uint8_t *src1_y, const uint8_t *src2_y, int block_width, int block_height, ptrdiff_t stride_y) {
+   int diff = 0;
+
+   for (int y = 0; y < block_height; y++) {
+      for (int x = 0; x < block_width; x++) {
+         diff += abs(src1_y[x] - src2_y[x]);
+      }
+
+      src1_y += stride_y;
+      src2_y += stride_y;
+   }
+
+   return diff;
+}
+
+
+static void blockLumaDiffRow_c(const uint8_t *src1_y, const uint8_t *src2_y, int *diffs,
+                               int blocks_x, int block_width, int block_height, ptrdiff_t stride_y) {
+
+   for (int x = 0; x < blocks_x; x++) {
+      diffs[x] = blockLumaDiff(src1_y + block_width*x, src2_y + block_width*x, block_width, block_height, stride_y);
+   }
+}
+
+
+// The same for 9 to 16 bit samples.
+static void makeRainbowMaskRow16_c(const uint8_t *srcp_u8, const uint8_t *srcp_v8,
+                                   const uint8_t *srcc_u8, const uint8_t *srcc_v8,
+                                   const uint8_t *srcn_u8, const uint8_t *srcn_v8,
+                                   uint8_t *mask, int mask_x, int width, int height,
+                                   ptrdiff_t stride_uv, ptrdiff_t mask_stride, int variation) {
+
+   const uint16_t *srcp_u = (const uint16_t *)srcp_u8;
+   const uint16_t *srcp_v = (const uint16_t *)srcp_v8;
+   const uint16_t *srcc_u = (const uint16_t *)srcc_u8;
+   const uint16_t *srcc_v = (const uint16_t *)srcc_v8;
+   const uint16_t *srcn_u = (const uint16_t *)srcn_u8;
+   const uint16_t *srcn_v = (const uint16_t *)srcn_v8;
+
+   for (int y = 0; y < height; y++) {
+      // The bits are written 64 at a time.
+      for (int i = 0; i < width; i += 64) {
+         int count = width - i < 64 ? width - i : 64;
+         uint64_t bits = 0;
+
+         for (int x = 0; x < count; x++)
+            bits |= (uint64_t)isRainbow(srcp_u[i + x], srcc_u[i + x], srcn_u[i + x],
+                                        srcp_v[i + x], srcc_v[i + x], srcn_v[i + x], variation) << x;
+
+         storeMaskBits(mask, mask_x + i, bits, count);
+      }
+
+      srcp_u += stride_uv;
+      srcp_v += stride_uv;
+
+      srcc_u += stride_uv;
+      srcc_v += stride_uv;
+
+      srcn_u += stride_uv;
+      srcn_v += stride_uv;
+
+      mask += mask_stride;
+   }
+}
+
+
+static void applyRainbowMaskRow16_c(const uint8_t *srcp_u8, const uint8_t *srcp_v8,
+                                    const uint8_t *srcc_u8, const uint8_t *srcc_v8,
+                                    const uint8_t *srcn_u8, const uint8_t *srcn_v8,
+                                    const uint8_t *mask, int mask_x, uint8_t *dst_u8, uint8_t *dst_v8, const uint8_t *directions,
+                                    int width, int block_width_uv, int height, ptrdiff_t stride_uv, ptrdiff_t mask_stride) {
+
+   const uint16_t *srcp_u = (const uint16_t *)srcp_u8;
+   const uint16_t *srcp_v = (const uint16_t *)srcp_v8;
+   const uint16_t *srcc_u = (const uint16_t *)srcc_u8;
+   const uint16_t *srcc_v = (const uint16_t *)srcc_v8;
+   const uint16_t *srcn_u = (const uint16_t *)srcn_u8;
+   const uint16_t *srcn_v = (const uint16_t *)srcn_v8;
+   uint16_t *dst_u = (uint16_t *)dst_u8;
+   uint16_t *dst_v = (uint16_t *)dst_v8;
+
+   for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+         if (!maskBit(mask, mask_x + x)) {
+            dst_u[x] = srcc_u[x];
+            dst_v[x] = srcc_v[x];
+         } else if (directions[x] == bdNext) {
+            dst_u[x] = (srcc_u[x]+srcn_u[x]+1) >> 1;
+            dst_v[x] = (srcc_v[x]+srcn_v[x]+1) >> 1;
+         } else if (directions[x] == bdPrev) {
+            dst_u[x] = (srcc_u[x]+srcp_u[x]+1) >> 1;
+            dst_v[x] = (srcc_v[x]+srcp_v[x]+1) >> 1;
+         } else {
+            dst_u[x] = (2*srcc_u[x]+srcp_u[x]+srcn_u[x]+3) >> 2;
+            dst_v[x] = (2*srcc_v[x]+srcp_v[x]+srcn_v[x]+3) >> 2;
+         }
+      }
+
+      srcp_u += stride_uv;
+      srcp_v += stride_uv;
+
+      srcc_u += stride_uv;
+      srcc_v += stride_uv;
+
+      srcn_u += stride_uv;
+      srcn_v += stride_uv;
+
+      mask += mask_stride;
+
+      dst_u += stride_uv;
+      dst_v += stride_uv;
+   }
+}
+
+
+static void chromaDiff16_c(const uint8_t *src1_u8, const uint8_t *src1_v8,
+                           const uint8_t *src2_u8, const uint8_t *src2_v8,
+                           uint8_t *diffs, int width, int height, ptrdiff_t stride_uv, ptrdiff_t diffs_stride, int variation) {
+
+   const uint16_t *src1_u = (const uint16_t *)src1_u8;
+   const uint16_t *src1_v = (const uint16_t *)src1_v8;
+   const uint16_t *src2_u = (const uint16_t *)src2_u8;
+   const uint16_t *src2_v = (const uint16_t *)src2_v8;
+
+   for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+         int du = src1_u[x] - src2_u[x];
+         int dv = src1_v[x] - src2_v[x];
+
+         diffs[x] = ( du > variation ? 0x21 : 0)
+                  | (-du > variation ? 0x12 : 0)
+                  | ( dv > variation ? 0x84 : 0)
+                  | (-dv > variation ? 0x48 : 0);
+      }
+
+      src1_u += stride_uv;
+      src1_v += stride_uv;
+
+      src2_u += stride_uv;
+      src2_v += stride_uv;
+
+      diffs += diffs_stride;
+   }
+}
+
+
+static void blockLumaDiffRow16_c(const uint8_t *src1_y8, const uint8_t *src2_y8, int *diffs,
+                                 int blocks_x, int block_width, int block_height, ptrdiff_t stride_y) {
+
+   const uint16_t *src1_y = (const uint16_t *)src1_y8;
+   const uint16_t *src2_y = (const uint16_t *)src2_y8;
+
+   for (int x = 0; x < blocks_x; x++) {
+      int diff = 0;
+
+      for (int y = 0; y < block_height; y++) {
+         for (int i = block_width*x; i < block_width*(x + 1); i++)
+            diff += abs(src1_y[y*stride_y + i] - src2_y[y*stride_y + i]);
+      }
+
+      diffs[x] = diff;
+   }
+}
+
+
+const char *bifrostSelectOptLevel(int *opt) {
+   if (*opt < optAuto || *opt > optAVX2)
+      return "Bifrost: opt must be between 0 and 3.";
+
+#if defined(BIFROST_X86)
+   __builtin_cpu_init();
+
+   int has_sse2 = __builtin_cpu_supports("sse2");
+   int has_avx2 = __builtin_cpu_supports("avx2");
+
+   if (*opt == optAuto)
+      *opt = has_avx2 ? optAVX2 : (has_sse2 ? optSSE2 : optC);
+   else if (*opt == optSSE2 && !has_sse2)
+      return "Bifrost: opt=2 requires a CPU with SSE2.";
+   else if (*opt == optAVX2 && !has_avx2)
+      return "Bifrost: opt=3 requires a CPU with AVX2.";
+#else
+   if (*opt == optAuto)
+      *opt = optC;
+   else if (*opt != optC)
+      return "Bifrost: opt=2 and opt=3 are only available on x86 CPUs.";
+#endif
+
+   return NULL;
+}
+
+
+// Pointers to everything needed to process one picture, i.e. one frame,
+// or one field of a frame in interlaced mode.
+typedef struct {
+   // The chroma of srcpp, srcp, srcc, srcn, and srcnn, in this order.
+   // The mask of a block is made from the three frames starting at its MaskSource.
+   const uint8_t *src_u[5];
+   const uint8_t *src_v[5];
+
+   const int *srcpp_diffs;
+   const int *srcp_diffs;
+   const int *srcc_diffs;
+   const int *srcn_diffs;
+
+   ptrdiff_t diffs_stride; // in blocks
+
+   // The chroma differences of srcpp and srcp, srcp and srcc, srcc and srcn,
+   // and srcn and srcnn, in linear mode. NULL where the two pictures aren't
+   // consecutive pictures of the same field, i.e. at the ends of the clip.
+   const uint8_t *chroma_diffs[4];
+   ptrdiff_t chroma_diffs_stride;
+
+   const uint8_t *altsrcc_u;
+   const uint8_t *altsrcc_v;
+
+   // The luma of srcc, used by the spatial filter.
+   const uint8_t *srcc_y;
+   ptrdiff_t stride_y; // in samples
+
+   uint8_t *dst_u;
+   uint8_t *dst_v;
+
+   ptrdiff_t stride_uv;
+
+   // The MaskSource and BlendDirection of every block.
+   uint8_t *sources;
+   uint8_t *directions;
+
+   // One byte per block, nonzero for the blocks that are processed. NULL when all of them are.
+   const uint8_t *region;
+} BifrostPicture;
+
+
+// The first chroma column of block x, and the first chroma line of row y of
+// blocks of a picture. The blocks of the last column and row are smaller when
+// the picture isn't divisible by the block size, so blocks_x and blocks_y give
+// the size of the picture.
+static inline int blockColumn(const BifrostCore *d, int x) {
+   int column = x * d->block_width_uv;
+   return column < d->width_uv ? column : d->width_uv;
+}
+
+
+static inline int blockLine(const BifrostCore *d, int y) {
+   int line = y * d->block_height_uv;
+   return line < d->picture_height_uv ? line : d->picture_height_uv;
+}
+
+
+// Whether a block moves too much in both directions, or in one direction
+// twice in a row, to be processed.
+static inline int blockNeedsAltClip(float ldprevprev, float ldprev, float ldnext, float ldnextnext, float luma_thresh) {
+   int prev_moves = ldprev > luma_thresh;
+   int next_moves = ldnext > luma_thresh;
+
+   return (next_moves & (prev_moves | (ldprevprev > luma_thresh))) |
+          (prev_moves & (ldnextnext > luma_thresh));
+}
+
+
+static int classifyRow_c(const int *srcpp_diffs, const int *srcp_diffs, const int *srcc_diffs, const int *srcn_diffs,
+                         uint8_t *sources, uint8_t *directions, int blocks_x, float luma_thresh, float relativeframediff, int *static_blocks) {
+
+   int alt_blocks = 0;
+
+   for (int x = 0; x < blocks_x; x++) {
+      float ldprev = srcp_diffs[x];
+      float ldnext = srcc_diffs[x];
+
+      if (blockNeedsAltClip(srcpp_diffs[x], ldprev, ldnext, srcn_diffs[x], luma_thresh)) {
+         sources[x] = msAltClip;
+         directions[x] = bdBoth;
+         alt_blocks++;
+         continue;
+      }
+
+      //determine direction to blend in
+      if (ldprev > ldnext*relativeframediff) {
+         directions[x] = bdNext;
+      } else if (ldnext > ldprev*relativeframediff) {
+         directions[x] = bdPrev;
+      } else {
+         directions[x] = bdBoth;
+      }
+
+      //generate mask from correct side of scenechange
+      if (ldnext > luma_thresh) {
+         sources[x] = msPrev;
+      } else if (ldprev > luma_thresh) {
+         sources[x] = msNext;
+      } else {
+         sources[x] = msCurrent;
+         (*static_blocks)++;
+      }
+   }
+
+   return alt_blocks;
+}
+
+
+// Whether any block moves too much to be processed.
+static int pictureNeedsAltClip(const BifrostCore *d, const BifrostPicture *pic) {
+   for (int y = 0; y < d->blocks_y; y++) {
+      ptrdiff_t row = y * pic->diffs_stride;
+
+      int alt_blocks = 0;
+
+      for (int x = 0; x < d->blocks_x; x++) {
+         if (pic->region && !pic->region[y * d->blocks_x + x])
+            continue;
+
+         alt_blocks += blockNeedsAltClip(pic->srcpp_diffs[row + x], pic->srcp_diffs[row + x],
+                                         pic->srcc_diffs[row + x], pic->srcn_diffs[row + x], d->luma_thresh);
+      }
+
+      if (alt_blocks)
+         return 1;
+   }
+
+   return 0;
+}
+
+
+// Fills in the MaskSource and BlendDirection of every block. Returns the
+// number of blocks copied from altclip.
+static int classifyPicture(const BifrostCore *d, const BifrostPicture *pic, int *static_blocks) {
+   uint8_t *sources = pic->sources;
+   uint8_t *directions = pic->directions;
+
+   int blocks_x = d->blocks_x;
+   int simd_blocks = blocks_x - blocks_x % d->classify_width;
+
+   int alt_blocks = 0;
+
+   for (int y = 0; y < d->blocks_y; y++) {
+      ptrdiff_t row = y * pic->diffs_stride;
+
+      alt_blocks += d->classifyRow(pic->srcpp_diffs + row, pic->srcp_diffs + row, pic->srcc_diffs + row, pic->srcn_diffs + row,
+                                   sources, directions, simd_blocks, d->luma_thresh, d->relativeframediff, static_blocks);
+
+      alt_blocks += classifyRow_c(pic->srcpp_diffs + row + simd_blocks, pic->srcp_diffs + row + simd_blocks,
+                                  pic->srcc_diffs + row + simd_blocks, pic->srcn_diffs + row + simd_blocks,
+                                  sources + simd_blocks, directions + simd_blocks, blocks_x - simd_blocks,
+                                  d->luma_thresh, d->relativeframediff, static_blocks);
+
+      sources += blocks_x;
+      directions += blocks_x;
+   }
+
+   // The blocks outside the region are left alone, whatever their motion.
+   if (pic->region) {
+      for (int i = 0; i < blocks_x * d->blocks_y; i++) {
+         if (pic->region[i])
+            continue;
+
+         alt_blocks -= pic->sources[i] == msAltClip;
+         *static_blocks -= pic->sources[i] == msCurrent;
+
+         pic->sources[i] = msSkip;
+         pic->directions[i] = bdBoth;
+      }
+   }
+
+   return alt_blocks;
+}
+
+
+static int anyNonZero(const uint8_t *p, int width, int height, ptrdiff_t stride) {
+   for (int y = 0; y < height; y++) {
+      uint64_t any = 0;
+
+      int x = 0;
+      for ( ; x + 8 <= width; x += 8) {
+         uint64_t word;
+         memcpy(&word, p + x, 8);
+         any |= word;
+      }
+
+      for ( ; x < width; x++)
+         any |= p[x];
+
+      if (any)
+         return 1;
+
+      p += stride;
+   }
+
+   return 0;
+}
+
+
+// Whether any sample x to x + width - 1 of the rows of a mask is set.
+static int anyMaskBits(const uint8_t *mask, int x, int width, int height, ptrdiff_t mask_stride) {
+   for (int y = 0; y < height; y++) {
+      uint64_t any = 0;
+
+      for (int i = x >> 6; i <= (x + width - 1) >> 6; i++)
+         any |= loadMaskWord(mask, i) & spanWordBits(i, x, width);
+
+      if (any)
+         return 1;
+
+      mask += mask_stride;
+   }
+
+   return 0;
+}
+
+
+static int countMaskBits(const uint8_t *mask, int x, int width, int height, ptrdiff_t mask_stride) {
+   int count = 0;
+
+   for (int y = 0; y < height; y++) {
+      for (int i = x >> 6; i <= (x + width - 1) >> 6; i++)
+         count += __builtin_popcountll(loadMaskWord(mask, i) & spanWordBits(i, x, width));
+
+      mask += mask_stride;
+   }
+
+   return count;
+}
+
+
+
+
+// Makes the raw rainbow mask of width samples of one row of blocks, starting at
+// offset, from the three pictures starting at MaskSource s. The differences
+// computed by ChromaDiff are used when available.
+static void makeSpanMask(const BifrostCore *d, int s, const uint8_t **src_u, const uint8_t **src_v, const uint8_t **chroma_diffs,
+                         int offset, int width, int height, uint8_t *raw_mask, ptrdiff_t stride_uv, ptrdiff_t chroma_diffs_stride) {
+
+   if (chroma_diffs[s] && chroma_diffs[s + 1]) {
+      MakeRainbowMaskFromDiffsFunction makeRainbowMaskFromDiffs = width >= d->simd_width ? d->makeRainbowMaskFromDiffs : makeRainbowMaskFromDiffsRow_c;
+      makeRainbowMaskFromDiffs(chroma_diffs[s] + offset, chroma_diffs[s + 1] + offset, raw_mask, offset,
+                               width, height, chroma_diffs_stride, d->mask_stride);
+      return;
+   }
+
+   int src_offset = offset * d->bytes_per_sample;
+
+   MakeRainbowMaskFunction makeRainbowMask = width >= d->simd_width ? d->makeRainbowMask : d->makeRainbowMaskNarrow;
+   makeRainbowMask(src_u[s] + src_offset,     src_v[s] + src_offset,
+                   src_u[s + 1] + src_offset, src_v[s + 1] + src_offset,
+                   src_u[s + 2] + src_offset, src_v[s + 2] + src_offset,
+                   raw_mask, offset, width, height, stride_uv, d->mask_stride, d->variation);
+}
+
+
+// Makes the raw rainbow mask of the blocks first_block to last_block - 1 in row
+// y that aren't copied from altclip or outside the region.
+// raw_mask holds one row of blocks.
+static void makeRowRawMask(const BifrostCore *d, const BifrostPicture *pic, int y, int first_block, int last_block,
+                           uint8_t *raw_mask, int all_static, int64_t *times) {
+
+   ptrdiff_t stride_uv = pic->stride_uv;
+
+   int block_height_uv = d->block_height_uv;
+   int height = blockLine(d, y + 1) - blockLine(d, y);
+
+   int bytes_per_sample = d->bytes_per_sample;
+
+   const uint8_t *src_u[5];
+   const uint8_t *src_v[5];
+   for (int i = 0; i < 5; i++) {
+      src_u[i] = pic->src_u[i] + y * block_height_uv * stride_uv * bytes_per_sample;
+      src_v[i] = pic->src_v[i] + y * block_height_uv * stride_uv * bytes_per_sample;
+   }
+
+   const uint8_t *chroma_diffs[4];
+   for (int i = 0; i < 4; i++)
+      chroma_diffs[i] = pic->chroma_diffs[i] ? pic->chroma_diffs[i] + y * block_height_uv * pic->chroma_diffs_stride : NULL;
+
+   const uint8_t *sources = pic->sources + y * d->blocks_x;
+
+   int64_t lap = profileStart(times);
+
+   // When every block is static the mask is made from the same frames
+   // everywhere, so the whole range is done in one go.
+   if (all_static) {
+      makeSpanMask(d, msCurrent, src_u, src_v, chroma_diffs, blockColumn(d, first_block), blockColumn(d, last_block) - blockColumn(d, first_block),
+                   height, raw_mask, stride_uv, pic->chroma_diffs_stride);
+
+      profileLap(times, psMakeMask, &lap);
+      return;
+   }
+
+   // Adjacent blocks whose masks come from the same frames are processed together.
+   int x = first_block;
+   while (x < last_block) {
+      if (sources[x] >= msAltClip) {
+         x++;
+         continue;
+      }
+
+      int part_start = x;
+
+      while (x < last_block && sources[x] == sources[part_start])
+         x++;
+
+      makeSpanMask(d, sources[part_start], src_u, src_v, chroma_diffs, blockColumn(d, part_start),
+                   blockColumn(d, x) - blockColumn(d, part_start), height, raw_mask, stride_uv, pic->chroma_diffs_stride);
+   }
+
+   profileLap(times, psMakeMask, &lap);
+}
+
+
+// Makes the processed rainbow mask of the blocks first_block to last_block - 1
+// in row y that aren't copied from altclip or outside the region, from their
+// raw mask. raw_mask and mask hold one row of blocks.
+// Returns 1 if the mask has any rainbow pixels.
+static int processRowMask(const BifrostCore *d, const BifrostPicture *pic, int y, int first_block, int last_block,
+                          const uint8_t *raw_mask, uint8_t *mask, int64_t *times) {
+
+   int height = blockLine(d, y + 1) - blockLine(d, y);
+
+   const uint8_t *sources = pic->sources + y * d->blocks_x;
+
+   int64_t lap = profileStart(times);
+
+   int has_rainbow = 0;
+
+   int x = first_block;
+   while (x < last_block) {
+      if (sources[x] >= msAltClip) {
+         x++;
+         continue;
+      }
+
+      int span_start = x;
+
+      while (x < last_block && sources[x] < msAltClip)
+         x++;
+
+      int offset = blockColumn(d, span_start);
+      int width = blockColumn(d, x) - offset;
+
+      //denoise and expand mask
+      processRainbowMask(raw_mask, mask, d->has_left_neighbor, d->has_right_neighbor,
+                         offset, width, height, d->mask_stride, d->conservative_mask);
+
+      has_rainbow = has_rainbow || anyMaskBits(mask, offset, width, height, d->mask_stride);
+   }
+
+   profileLap(times, psProcessMask, &lap);
+
+   return has_rainbow;
+}
+
+
+// Makes the raw and the processed rainbow mask of the blocks first_block to
+// last_block - 1 in row y, see processRowMask.
+static int makeRowMask(const BifrostCore *d, const BifrostPicture *pic, int y, int first_block, int last_block,
+                       uint8_t *raw_mask, uint8_t *mask, int all_static, int64_t *times) {
+
+   makeRowRawMask(d, pic, y, first_block, last_block, raw_mask, all_static, times);
+
+   return processRowMask(d, pic, y, first_block, last_block, raw_mask, mask, times);
+}
+
+
+// Returns the first row of blocks with rainbow pixels, or blocks_y if there is none.
+static int findFirstRainbowRow(const BifrostCore *d, const BifrostPicture *pic, uint8_t *raw_mask, uint8_t *mask,
+                               int all_static, int64_t *times) {
+
+   for (int y = 0; y < d->blocks_y; y++) {
+      if (makeRowMask(d, pic, y, 0, d->blocks_x, raw_mask, mask, all_static, times))
+         return y;
+   }
+
+   return d->blocks_y;
+}
+
+
+static void prefetchLines(const uint8_t *p, size_t width, int height, ptrdiff_t stride) {
+   for (int y = 0; y < height; y++) {
+      for (size_t x = 0; x < width; x += 64)
+         __builtin_prefetch(p + x);
+      __builtin_prefetch(p + width - 1);
+
+      p += stride;
+   }
+}
+
+
+// Asks for the blocks first_block to last_block - 1 of row y to be brought
+// into the cache, but only from the planes their masks and copies read.
+static void prefetchBlocks(const BifrostCore *d, const BifrostPicture *pic, int y, int first_block, int last_block) {
+   const uint8_t *sources = pic->sources + y * d->blocks_x;
+
+   int uses_src[5] = { 0 };
+   int uses_diffs[4] = { 0 };
+   int uses_alt = 0;
+
+   for (int x = first_block; x < last_block; x++) {
+      int s = sources[x];
+
+      if (s == msAltClip && !d->spatialFilter) {
+         uses_alt = 1;
+      } else if (s == msAltClip || s == msSkip) {
+         uses_src[2] = 1;
+      } else {
+         // The blend always reads the frames n - 1 to n + 1, whichever
+         // frames the mask is made from.
+         uses_src[1] = uses_src[2] = uses_src[3] = 1;
+
+         if (pic->chroma_diffs[s] && pic->chroma_diffs[s + 1])
+            uses_diffs[s] = uses_diffs[s + 1] = 1;
+         else
+            uses_src[s] = uses_src[s + 2] = 1;
+      }
+   }
+
+   int bytes_per_sample = d->bytes_per_sample;
+   int block_height_uv = blockLine(d, y + 1) - blockLine(d, y);
+
+   ptrdiff_t stride = pic->stride_uv * bytes_per_sample;
+   ptrdiff_t offset = y * d->block_height_uv * stride + blockColumn(d, first_block) * bytes_per_sample;
+   size_t width = (size_t)(blockColumn(d, last_block) - blockColumn(d, first_block)) * bytes_per_sample;
+
+   for (int i = 0; i < 5; i++) {
+      if (uses_src[i]) {
+         prefetchLines(pic->src_u[i] + offset, width, block_height_uv, stride);
+         prefetchLines(pic->src_v[i] + offset, width, block_height_uv, stride);
+      }
+   }
+
+   for (int i = 0; i < 4; i++) {
+      if (uses_diffs[i])
+         prefetchLines(pic->chroma_diffs[i] + y * d->block_height_uv * pic->chroma_diffs_stride + blockColumn(d, first_block),
+                       width / bytes_per_sample, block_height_uv, pic->chroma_diffs_stride);
+   }
+
+   if (uses_alt) {
+      prefetchLines(pic->altsrcc_u + offset, width, block_height_uv, stride);
+      prefetchLines(pic->altsrcc_v + offset, width, block_height_uv, stride);
+   }
+}
+
+
+// Rows of blocks are processed d->chunk_blocks blocks at a time, so that the
+// mask is still in the cache when it's applied. While one chunk is processed
+// the next one is prefetched.
+// Chunks without rainbow pixels, and blocks outside the region, are copied from srcc.
+// The blocks that move too much are copied from altclip, or smoothed by d->spatialFilter.
+// column_directions holds one row of blocks.
+// Returns the number of rainbow pixels when d->stats is set, 0 otherwise.
+static int64_t processBlockRows(const BifrostCore *d, const BifrostPicture *pic, int first_row, int last_row,
+                             uint8_t *raw_mask, uint8_t *mask, uint8_t *column_directions, int all_static, int64_t *times) {
+
+   ptrdiff_t stride_uv = pic->stride_uv;
+
+   int block_width_uv = d->block_width_uv;
+   int block_height_uv = d->block_height_uv;
+
+   int blocks_x = d->blocks_x;
+   int chunk_blocks = d->chunk_blocks;
+
+   int bytes_per_sample = d->bytes_per_sample;
+
+   int64_t rainbow_pixels = 0;
+
+   for (int y = first_row; y < last_row; y++) {
+      ptrdiff_t row_offset = y * block_height_uv * stride_uv;
+      int height = blockLine(d, y + 1) - blockLine(d, y);
+
+      const uint8_t *sources = pic->sources + y * blocks_x;
+      const uint8_t *directions = pic->directions + y * blocks_x;
+
+      for (int chunk_start = 0; chunk_start < blocks_x; chunk_start += chunk_blocks) {
+         int chunk_end = chunk_start + chunk_blocks < blocks_x ? chunk_start + chunk_blocks : blocks_x;
+
+         if (chunk_end < blocks_x)
+            prefetchBlocks(d, pic, y, chunk_end, chunk_end + chunk_blocks < blocks_x ? chunk_end + chunk_blocks : blocks_x);
+         else if (y + 1 < last_row)
+            prefetchBlocks(d, pic, y + 1, 0, chunk_blocks < blocks_x ? chunk_blocks : blocks_x);
+
+         int has_rainbow = makeRowMask(d, pic, y, chunk_start, chunk_end, raw_mask, mask, all_static, times);
+
+         int64_t lap = profileStart(times);
+
+         if (has_rainbow) {
+            for (int x = chunk_start; x < chunk_end; x++)
+               memset(column_directions + blockColumn(d, x), directions[x], blockColumn(d, x + 1) - blockColumn(d, x));
+         }
+
+         // Spans of blocks that are all copied from altclip, all outside the region, or all processed.
+#define SPAN_KIND(source) ((source) >= msAltClip ? (source) : msCurrent)
+
+         int x = chunk_start;
+         while (x < chunk_end) {
+            int span_start = x;
+            int kind = SPAN_KIND(sources[x]);
+
+            while (x < chunk_end && SPAN_KIND(sources[x]) == kind)
+               x++;
+
+            ptrdiff_t offset = (row_offset + blockColumn(d, span_start)) * bytes_per_sample;
+            int width = blockColumn(d, x) - blockColumn(d, span_start);
+
+            if (kind == msAltClip && d->spatialFilter) {
+               d->spatialFilter(pic->src_u[2], pic->src_v[2], pic->srcc_y, pic->dst_u, pic->dst_v,
+                                blockColumn(d, span_start), blockLine(d, y), width, height, d->width_uv, d->picture_height_uv,
+                                stride_uv, pic->stride_y, d->subsampling_w, d->subsampling_h, d->spatial_thresh);
+
+               profileLap(times, psSpatial, &lap);
+            } else if (kind == msAltClip) {
+               copyChromaBlock(pic->dst_u + offset, pic->dst_v + offset,
+                               pic->altsrcc_u + offset, pic->altsrcc_v + offset,
+                               width * bytes_per_sample, height, stride_uv * bytes_per_sample);
+
+               profileLap(times, psCopy, &lap);
+            } else if (kind == msSkip || !has_rainbow) {
+               copyChromaBlock(pic->dst_u + offset, pic->dst_v + offset,
+                               pic->src_u[2] + offset, pic->src_v[2] + offset,
+                               width * bytes_per_sample, height, stride_uv * bytes_per_sample);
+
+               profileLap(times, psCopy, &lap);
+            } else {
+               int mask_offset = blockColumn(d, span_start);
+
+               ApplyRainbowMaskFunction applyRainbowMask = width >= d->simd_width ? d->applyRainbowMask : d->applyRainbowMaskNarrow;
+               applyRainbowMask(pic->src_u[1] + offset, pic->src_v[1] + offset,
+                                pic->src_u[2] + offset, pic->src_v[2] + offset,
+                                pic->src_u[3] + offset, pic->src_v[3] + offset,
+                                mask, mask_offset, pic->dst_u + offset, pic->dst_v + offset,
+                                column_directions + mask_offset, width, block_width_uv, height, stride_uv, d->mask_stride);
+
+               if (d->stats)
+                  rainbow_pixels += countMaskBits(mask, mask_offset, width, height, d->mask_stride);
+
+               profileLap(times, psBlend, &lap);
+            }
+         }
+#undef SPAN_KIND
+      }
+   }
+
+   return rainbow_pixels;
+}
+
+
+// In interlaced mode frame n holds pictures 2*n (the first field) and 2*n+1.
+// Returns the row of the frame where the picture starts.
+static int pictureRow(int picture, int fields, int tff) {
+   if (fields == 1)
+      return 0;
+
+   return (picture & 1) ^ !tff;
+}
+
+
+// Returns a map of the blocks of every picture that overlap any of the
+// rectangles in roi, laid out like the decisions, or NULL without a roi.
+// Sets *error if a rectangle is empty.
+static uint8_t *makeRegion(const int *roi, int roi_count, int blocks_x, int blocks_y, int block_width, int block_height,
+                           int fields, int tff, const char **error) {
+   if (!roi)
+      return NULL;
+
+   for (int i = 0; i < roi_count; i++) {
+      if (roi[4*i + 2] <= 0 || roi[4*i + 3] <= 0) {
+         *error = "Bifrost: The rectangles in roi must have a positive width and height.";
+         return NULL;
+      }
+   }
+
+   uint8_t *region = calloc(fields * blocks_x * blocks_y, 1);
+
+   for (int field = 0; field < fields; field++) {
+      // Line l of the picture is line l * fields + row of the frame.
+      int row = pictureRow(field, fields, tff);
+
+      for (int i = 0; i < roi_count; i++) {
+         const int *rect = roi + 4*i;
+
+         int left = rect[0] > 0 ? rect[0] : 0;
+         int top = rect[1] > 0 ? rect[1] : 0;
+         int right = rect[0] + rect[2];
+         int bottom = rect[1] + rect[3];
+
+         if (right <= left || bottom <= top)
+            continue;
+
+         int first_line = (top - row + fields - 1) / fields;
+         int last_line = (bottom - row + fields - 1) / fields;
+
+         int first_y = first_line / block_height;
+         int last_y = (last_line + block_height - 1) / block_height;
+         int first_x = left / block_width;
+         int last_x = (right + block_width - 1) / block_width;
+
+         if (last_y > blocks_y)
+            last_y = blocks_y;
+         if (last_x > blocks_x)
+            last_x = blocks_x;
+
+         for (int y = first_y; y < last_y && first_line < last_line; y++) {
+            for (int x = first_x; x < last_x; x++)
+               region[(field * blocks_y + y) * blocks_x + x] = 1;
+         }
+      }
+   }
+
+   return region;
+}
+
+
+// Bands are at least this many lines tall, so that small frames aren't split
+// into pieces too small to make up for the synchronisation.
+#define MIN_BAND_HEIGHT 64
+
+static int bandCount(int threads, int picture_height) {
+   int bands = picture_height / MIN_BAND_HEIGHT;
+
+   if (bands > threads)
+      bands = threads;
+   if (bands < 1)
+      bands = 1;
+
+   return bands;
+}
+
+
+// A chunk's inputs, masks and output should fit in this many bytes, half of a
+// typical L1 data cache.
+#define CHUNK_SIZE 16384
+
+static int chunkBlocks(int block_width_uv, int block_height_uv, int bytes_per_sample) {
+   // Six input planes and two output planes, raw_mask, mask and column_directions.
+   int block_size = (8 * bytes_per_sample + 3) * block_width_uv * block_height_uv;
+
+   int blocks = CHUNK_SIZE / block_size;
+
+   return blocks > 1 ? blocks : 1;
+}
+
+
+typedef struct {
+   const BifrostCore *d;
+   const BifrostPicture *pics;
+   const int *first_rows;
+   int all_static;
+
+   // Every band gets its own mask_size bytes of raw_mask and mask, and
+   // row_size bytes of column_directions.
+   uint8_t *scratch;
+   size_t mask_size;
+   size_t row_size;
+
+   int64_t *rainbow_pixels; // per band
+   int64_t *times; // psStages per band, NULL unless profiling is enabled
+} BifrostBandJob;
+
+
+// The rows of each picture that are left after its first rainbow are split into d->bands bands.
+static void processBand(void *job_data, int band) {
+   const BifrostBandJob *job = (const BifrostBandJob *)job_data;
+   const BifrostCore *d = job->d;
+
+   int field = band / d->bands;
+   int first_row = job->first_rows[field];
+   int rows = d->blocks_y - first_row;
+
+   band %= d->bands;
+
+   uint8_t *raw_mask = job->scratch + (field * d->bands + band) * (2 * job->mask_size + job->row_size);
+   uint8_t *mask = raw_mask + job->mask_size;
+   uint8_t *column_directions = mask + job->mask_size;
+
+   int64_t *times = job->times ? job->times + (field * d->bands + band) * psStages : NULL;
+
+   job->rainbow_pixels[field * d->bands + band] =
+         processBlockRows(d, &job->pics[field], first_row + rows * band / d->bands, first_row + rows * (band + 1) / d->bands,
+                          raw_mask, mask, column_directions, job->all_static, times);
+}
+
+
+
+void bifrostDefaultParams(BifrostParams *params) {
+   params->luma_thresh = 10.0f;
+   params->variation = 5;
+   params->conservative_mask = 0;
+   params->interlaced = 1;
+   params->tff = 1;
+   params->block_width = 4;
+   params->block_height = 4;
+   params->decimation = 1;
+   params->spatial = 0;
+   params->spatial_thresh = 8.0f;
+   params->opt = optAuto;
+   params->threads = 1;
+   params->roi = NULL;
+   params->roi_count = 0;
+   params->stats = 0;
+   params->profile = 0;
+}
+
+
+BifrostCore *bifrostCoreCreate(const BifrostParams *params, const BifrostFormat *format, const char **error) {
+   BifrostCore d;
+
+   d.fields = params->interlaced ? 2 : 1;
+   d.tff = !!params->tff;
+   d.relativeframediff = 1.2f;
+   d.conservative_mask = !!params->conservative_mask;
+   d.stats = !!params->stats;
+   d.profile = !!params->profile;
+   d.block_width = params->block_width;
+   d.block_height = params->block_height;
+
+   int opt = params->opt;
+
+   *error = bifrostSelectOptLevel(&opt);
+   if (*error)
+      return NULL;
+
+   if (format->bits_per_sample < 8 || format->bits_per_sample > 16) {
+      *error = "Bifrost: Only 8 to 16 bit integer YUV allowed.";
+      return NULL;
+   }
+
+   d.bytes_per_sample = format->bits_per_sample > 8 ? 2 : 1;
+
+   // The thresholds are given on the 8 bit scale.
+   d.luma_thresh = params->luma_thresh * d.block_width * d.block_height * (1 << (format->bits_per_sample - 8));
+   d.variation = params->variation;
+   if (d.variation > 255)
+      d.variation = 255;
+   if (d.variation > 0)
+      d.variation = d.variation << (format->bits_per_sample - 8);
+
+   if (d.fields == 2 && format->height % (2 << format->subsampling_h)) {
+      *error = "Bifrost: In interlaced mode the clip's height must be divisible by twice the vertical chroma subsampling factor.";
+      return NULL;
+   }
+
+   if (d.block_width % (1 << format->subsampling_w) ||
+       d.block_height % (1 << format->subsampling_h)) {
+      *error = "Bifrost: The requested block size is incompatible with the clip's subsampling.";
+      return NULL;
+   }
+
+   d.block_width_uv = d.block_width >> format->subsampling_w;
+   d.block_height_uv = d.block_height >> format->subsampling_h;
+
+   if (d.block_width_uv < 2 || d.block_height_uv < 2) {
+      *error = "Bifrost: The requested block size is too small.";
+      return NULL;
+   }
+
+   // The blocks of the last column and row are smaller if the picture isn't divisible by the block size.
+   d.blocks_x = (format->width + d.block_width - 1) / d.block_width;
+   d.blocks_y = (format->height / d.fields + d.block_height - 1) / d.block_height;
+   d.last_block_width = format->width - (d.blocks_x - 1) * d.block_width;
+   d.last_block_height = format->height / d.fields - (d.blocks_y - 1) * d.block_height;
+
+   if (params->spatial_thresh < 0) {
+      *error = "Bifrost: spatial_thresh must not be negative.";
+      return NULL;
+   }
+
+   d.region = makeRegion(params->roi, params->roi_count, d.blocks_x, d.blocks_y, d.block_width, d.block_height, d.fields, d.tff, error);
+   if (*error)
+      return NULL;
+
+   d.width_uv = format->width >> format->subsampling_w;
+   d.height_uv = format->height >> format->subsampling_h;
+   d.picture_height_uv = d.height_uv / d.fields;
+   d.subsampling_w = format->subsampling_w;
+   d.subsampling_h = format->subsampling_h;
+
+   int high_bitdepth = d.bytes_per_sample == 2;
+
+   d.makeRainbowMaskNarrow = high_bitdepth ? makeRainbowMaskRow16_c : makeRainbowMaskRow_c;
+   d.applyRainbowMaskNarrow = high_bitdepth ? applyRainbowMaskRow16_c : applyRainbowMaskRow_c;
+
+   for (size_t i = 0; i < sizeof(specialized_block_functions) / sizeof(specialized_block_functions[0]); i++) {
+      if (!high_bitdepth &&
+          specialized_block_functions[i].block_width_uv == d.block_width_uv &&
+          specialized_block_functions[i].block_height_uv == d.block_height_uv)
+         d.applyRainbowMaskNarrow = specialized_block_functions[i].applyRainbowMask;
+   }
+
+   d.makeRainbowMask = d.makeRainbowMaskNarrow;
+   d.applyRainbowMask = d.applyRainbowMaskNarrow;
+   d.makeRainbowMaskFromDiffs = makeRainbowMaskFromDiffsRow_c;
+   d.simd_width = 0;
+   d.classifyRow = classifyRow_c;
+   d.classify_width = 1;
+   d.chromaDiff = high_bitdepth ? chromaDiff16_c : chromaDiff_c;
+   d.spatialFilter = params->spatial ? (high_bitdepth ? spatialFilter16_c : spatialFilter_c) : NULL;
+   d.spatial_thresh = (int)(params->spatial_thresh * (1 << (format->bits_per_sample - 8)));
+#if defined(BIFROST_X86)
+   if (opt == optSSE2) {
+      d.makeRainbowMask = high_bitdepth ? makeRainbowMaskRow16_sse2 : makeRainbowMaskRow_sse2;
+      d.applyRainbowMask = high_bitdepth ? applyRainbowMaskRow16_sse2 : applyRainbowMaskRow_sse2;
+      d.makeRainbowMaskFromDiffs = makeRainbowMaskFromDiffsRow_sse2;
+      d.simd_width = 16;
+      d.classifyRow = classifyRow_sse2;
+      d.classify_width = 4;
+      d.chromaDiff = high_bitdepth ? chromaDiff16_sse2 : chromaDiff_sse2;
+   } else if (opt == optAVX2) {
+      d.makeRainbowMask = high_bitdepth ? makeRainbowMaskRow16_avx2 : makeRainbowMaskRow_avx2;
+      d.applyRainbowMask = high_bitdepth ? applyRainbowMaskRow16_avx2 : applyRainbowMaskRow_avx2;
+      d.makeRainbowMaskFromDiffs = makeRainbowMaskFromDiffsRow_avx2;
+      d.simd_width = 16;
+      d.classifyRow = classifyRow_avx2;
+      d.classify_width = 8;
+      d.chromaDiff = high_bitdepth ? chromaDiff16_avx2 : chromaDiff_avx2;
+   }
+
+   if (d.variation < 0)
+      d.makeRainbowMask = d.makeRainbowMaskNarrow;
+
+   if (d.variation < 0 || d.width_uv < 16)
+      d.chromaDiff = high_bitdepth ? chromaDiff16_c : chromaDiff_c;
+#endif
+
+   // Whole words, and one more word.
+   d.mask_stride = ((d.width_uv + 63) / 64 + 1) * 8;
+
+   d.has_left_neighbor = calloc(d.mask_stride, 1);
+   d.has_right_neighbor = calloc(d.mask_stride, 1);
+
+   for (int x = 0; x < d.width_uv; x++) {
+      d.has_left_neighbor[x >> 3] |= (x % d.block_width_uv ? 1 : 0) << (x & 7);
+      d.has_right_neighbor[x >> 3] |= ((x + 1) % d.block_width_uv && x + 1 < d.width_uv ? 1 : 0) << (x & 7);
+   }
+
+   int threads = params->threads;
+
+   d.bands = bandCount(threads, d.blocks_y * d.block_height);
+   d.chunk_blocks = chunkBlocks(d.block_width_uv, d.block_height_uv, d.bytes_per_sample);
+   d.pool = threadPoolCreate(threads < d.fields * d.bands ? threads : d.fields * d.bands);
+
+   BifrostCore *core = malloc(sizeof(d));
+   *core = d;
+
+   return core;
+}
+
+
+void bifrostCoreFree(BifrostCore *core) {
+   if (!core)
+      return;
+
+   threadPoolFree(core->pool);
+   free(core->has_left_neighbor);
+   free(core->has_right_neighbor);
+   free(core->region);
+   free(core);
+}
+
+
+void bifrostCoreGetBlocks(const BifrostCore *core, int *blocks_x, int *blocks_y) {
+   *blocks_x = core->blocks_x;
+   *blocks_y = core->blocks_y;
+}
+
+
+void bifrostCoreChromaDiff(const BifrostCore *core, const uint8_t *src1_u, const uint8_t *src1_v,
+                           const uint8_t *src2_u, const uint8_t *src2_v, ptrdiff_t stride_uv,
+                           uint8_t *diffs, ptrdiff_t diffs_stride) {
+
+   core->chromaDiff(src1_u, src1_v, src2_u, src2_v, diffs, core->width_uv, core->height_uv,
+                    stride_uv / core->bytes_per_sample, diffs_stride, core->variation);
+}
+
+
+struct BifrostFrame {
+   const BifrostCore *core;
+   int n;
+
+   BifrostPicture pics[2];
+
+   // Frame n of altclip, or of the source when there is no altclip.
+   const uint8_t *alt_u;
+   const uint8_t *alt_v;
+   int has_altclip;
+
+   ptrdiff_t stride_uv; // of the frame, in bytes
+
+   // The MaskSource and BlendDirection of every block of every picture.
+   uint8_t *decisions;
+
+   // The roi and the mask combined, laid out like the decisions. NULL when every block is processed.
+   uint8_t *region;
+
+   int alt_blocks;
+   int static_blocks;
+
+   // The rows before the first rainbow of each picture are copied from srcc.
+   int first_rows[2];
+
+   // The rainbow mask of one row of blocks before and after processing, and
+   // the scratch row of processBlockRows, for each band of each picture.
+   uint8_t *scratch;
+   size_t mask_size;
+   size_t row_size;
+
+   int64_t *rainbow_pixels; // per band
+   int64_t *band_times; // psStages per band, NULL unless profiling is enabled
+
+   ProfileTimes times;
+};
+
+
+// Removes from region the blocks where the mask is zero everywhere.
+static void applyMaskToRegion(const BifrostCore *d, const uint8_t *mask, ptrdiff_t mask_stride, int mask_bytes_per_sample, uint8_t *region) {
+   int fields = d->fields;
+   ptrdiff_t stride = mask_stride * fields;
+
+   for (int field = 0; field < fields; field++) {
+      const uint8_t *field_mask = mask + pictureRow(field, fields, d->tff) * mask_stride;
+
+      for (int y = 0; y < d->blocks_y; y++) {
+         int height = y < d->blocks_y - 1 ? d->block_height : d->last_block_height;
+
+         for (int x = 0; x < d->blocks_x; x++) {
+            uint8_t *block = region + (field * d->blocks_y + y) * d->blocks_x + x;
+            int width = x < d->blocks_x - 1 ? d->block_width : d->last_block_width;
+
+            if (*block && !anyNonZero(field_mask + y * d->block_height * stride + x * d->block_width * mask_bytes_per_sample,
+                                      width * mask_bytes_per_sample, height, stride))
+               *block = 0;
+         }
+      }
+   }
+}
+
+
+BifrostFrame *bifrostFrameCreate(const BifrostCore *core, int n, int num_frames, const BifrostFrameInput *input) {
+   const BifrostCore *d = core;
+
+#define min(a, b)  (((a) < (b)) ? (a) : (b))
+#define max(a, b)  (((a) > (b)) ? (a) : (b))
+
+   BifrostFrame *frame = calloc(1, sizeof(BifrostFrame));
+   frame->core = core;
+   frame->n = n;
+   frame->stride_uv = input->stride_uv;
+
+   int fields = d->fields;
+   int last_picture = num_frames * fields - 1;
+   ptrdiff_t stride_uv = input->stride_uv;
+   ptrdiff_t diffs_stride = input->diffs_stride;
+
+   for (int field = 0; field < fields; field++) {
+      BifrostPicture *pic = &frame->pics[field];
+
+      int current = n * fields + field;
+      int pictures[5] = {
+         max(current - 2*fields, 0),
+         max(current - fields, 0),
+         current,
+         min(current + fields, last_picture),
+         min(current + 2*fields, last_picture)
+      };
+
+      const int *diffs[5];
+
+      for (int i = 0; i < 5; i++) {
+         int src = pictures[i] / fields - n + 2;
+         ptrdiff_t offset = pictureRow(pictures[i], fields, d->tff) * stride_uv;
+
+         pic->src_u[i] = input->src_u[src] + offset;
+         pic->src_v[i] = input->src_v[src] + offset;
+
+         // The rows of the second field follow those of the first.
+         diffs[i] = input->diffs[src] + (pictures[i] % fields) * d->blocks_y * diffs_stride;
+      }
+
+      pic->srcpp_diffs = diffs[0];
+      pic->srcp_diffs = diffs[1];
+      pic->srcc_diffs = diffs[2];
+      pic->srcn_diffs = diffs[3];
+      pic->diffs_stride = diffs_stride;
+
+      for (int i = 0; i < 4; i++) {
+         pic->chroma_diffs[i] = NULL;
+
+         if (input->chroma_diffs[0] && pictures[i + 1] == pictures[i] + fields) {
+            pic->chroma_diffs[i] = input->chroma_diffs[pictures[i] / fields - n + 2] + pictureRow(pictures[i], fields, d->tff) * input->chroma_diffs_stride;
+            pic->chroma_diffs_stride = input->chroma_diffs_stride * fields;
+         }
+      }
+
+      pic->stride_uv = stride_uv / d->bytes_per_sample * fields;
+
+      pic->srcc_y = input->src_y ? input->src_y + pictureRow(current, fields, d->tff) * input->stride_y : NULL;
+      pic->stride_y = input->stride_y / d->bytes_per_sample * fields;
+   }
+#undef min
+#undef max
+
+   if (d->region || input->mask) {
+      int blocks = d->blocks_x * d->blocks_y;
+
+      frame->region = malloc(fields * blocks);
+
+      if (d->region)
+         memcpy(frame->region, d->region, fields * blocks);
+      else
+         memset(frame->region, 1, fields * blocks);
+
+      if (input->mask)
+         applyMaskToRegion(d, input->mask, input->mask_stride, input->mask_bytes_per_sample, frame->region);
+
+      for (int field = 0; field < fields; field++)
+         frame->pics[field].region = frame->region + field * blocks;
+   }
+
+   frame->has_altclip = input->alt_u != NULL;
+   frame->alt_u = frame->has_altclip ? input->alt_u : input->src_u[2];
+   frame->alt_v = frame->has_altclip ? input->alt_v : input->src_v[2];
+
+   return frame;
+}
+
+
+void bifrostFrameFree(BifrostFrame *frame) {
+   if (!frame)
+      return;
+
+   free(frame->band_times);
+   free(frame->rainbow_pixels);
+   free(frame->scratch);
+   free(frame->decisions);
+   free(frame->region);
+   free(frame);
+}
+
+
+int bifrostFrameNeedsAltClip(const BifrostFrame *frame) {
+   for (int field = 0; field < frame->core->fields; field++) {
+      if (pictureNeedsAltClip(frame->core, &frame->pics[field]))
+         return 1;
+   }
+
+   return 0;
+}
+
+
+int bifrostFrameAnalyse(BifrostFrame *frame) {
+   const BifrostCore *d = frame->core;
+
+   int fields = d->fields;
+   int blocks = d->blocks_x * d->blocks_y;
+
+   int64_t *times = d->profile ? frame->times : NULL;
+
+   int64_t lap = profileStart(times);
+
+   frame->decisions = malloc(2 * blocks * fields);
+
+   for (int field = 0; field < fields; field++) {
+      frame->pics[field].sources = frame->decisions + 2 * blocks * field;
+      frame->pics[field].directions = frame->pics[field].sources + blocks;
+
+      frame->alt_blocks += classifyPicture(d, &frame->pics[field], &frame->static_blocks);
+   }
+
+   profileLap(times, psClassify, &lap);
+
+   frame->mask_size = d->mask_stride * d->block_height_uv;
+   frame->row_size = d->blocks_x * d->block_width_uv;
+   // The words of the masks around a span are read, so they must be initialised.
+   frame->scratch = calloc(fields * d->bands, 2 * frame->mask_size + frame->row_size);
+
+   frame->rainbow_pixels = calloc(fields * d->bands, sizeof(int64_t));
+   frame->band_times = d->profile ? calloc(fields * d->bands, sizeof(ProfileTimes)) : NULL;
+
+   // When every block is copied from altclip, or no block has rainbows,
+   // the output simply uses the chroma of that frame.
+   if (frame->alt_blocks == blocks * fields && !d->spatialFilter)
+      return frame->has_altclip ? bcsAltClip : bcsSource;
+
+   if (frame->alt_blocks)
+      return bcsProcessed;
+
+   int all_static = frame->static_blocks == blocks * fields;
+
+   uint8_t *raw_mask = frame->scratch;
+   uint8_t *mask = frame->scratch + frame->mask_size;
+
+   int chroma_source = bcsSource;
+
+   for (int field = 0; field < fields && chroma_source == bcsSource; field++) {
+      frame->first_rows[field] = findFirstRainbowRow(d, &frame->pics[field], raw_mask, mask, all_static, times);
+
+      if (frame->first_rows[field] < d->blocks_y)
+         chroma_source = bcsProcessed;
+   }
+
+   return chroma_source;
+}
+
+
+void bifrostFrameProcess(BifrostFrame *frame, uint8_t *dst_u, uint8_t *dst_v) {
+   const BifrostCore *d = frame->core;
+
+   int fields = d->fields;
+   int blocks = d->blocks_x * d->blocks_y;
+   ptrdiff_t stride_uv = frame->stride_uv;
+
+   int64_t *times = d->profile ? frame->times : NULL;
+
+   int64_t lap = profileStart(times);
+
+   for (int field = 0; field < fields; field++) {
+      BifrostPicture *pic = &frame->pics[field];
+
+      ptrdiff_t offset = pictureRow(frame->n * fields + field, fields, d->tff) * stride_uv;
+
+      pic->altsrcc_u = frame->alt_u + offset;
+      pic->altsrcc_v = frame->alt_v + offset;
+
+      pic->dst_u = dst_u + offset;
+      pic->dst_v = dst_v + offset;
+
+      copyChromaBlock(pic->dst_u, pic->dst_v, pic->src_u[2], pic->src_v[2],
+                      d->width_uv * d->bytes_per_sample, blockLine(d, frame->first_rows[field]), stride_uv * fields);
+   }
+
+   profileLap(times, psCopy, &lap);
+
+   int all_static = frame->static_blocks == blocks * fields;
+
+   BifrostBandJob job = { d, frame->pics, frame->first_rows, all_static, frame->scratch, frame->mask_size, frame->row_size,
+                          frame->rainbow_pixels, frame->band_times };
+
+   threadPoolRun(d->pool, processBand, &job, fields * d->bands);
+
+   // The bands run in parallel, so their times add up to more than the time the frame took.
+   if (d->profile) {
+      for (int i = 0; i < fields * d->bands * psStages; i++)
+         times[i % psStages] += frame->band_times[i];
+   }
+}
+
+
+void bifrostFrameGetStats(const BifrostFrame *frame, BifrostFrameStats *stats) {
+   const BifrostCore *d = frame->core;
+
+   int blocks = d->blocks_x * d->blocks_y;
+   int direction_blocks[3] = { 0, 0, 0 };
+
+   stats->static_blocks = 0;
+   stats->alt_blocks = 0;
+   stats->outside_blocks = 0;
+
+   for (int field = 0; field < d->fields; field++) {
+      for (int i = 0; i < blocks; i++) {
+         int source = frame->pics[field].sources[i];
+
+         stats->static_blocks += source == msCurrent;
+         stats->alt_blocks += source == msAltClip;
+         stats->outside_blocks += source == msSkip;
+         if (source < msAltClip)
+            direction_blocks[frame->pics[field].directions[i]]++;
+      }
+   }
+
+   stats->blend_next_blocks = direction_blocks[bdNext];
+   stats->blend_prev_blocks = direction_blocks[bdPrev];
+   stats->blend_both_blocks = direction_blocks[bdBoth];
+
+   stats->rainbow_pixels = 0;
+   for (int i = 0; i < d->fields * d->bands; i++)
+      stats->rainbow_pixels += frame->rainbow_pixels[i];
+}
+
+
+void bifrostFrameGetDecisions(const BifrostFrame *frame, uint8_t *decisions) {
+   const BifrostCore *d = frame->core;
+
+   int blocks = d->blocks_x * d->blocks_y;
+
+   for (int field = 0; field < d->fields; field++) {
+      for (int i = 0; i < blocks; i++) {
+         int source = frame->pics[field].sources[i];
+
+         if (source == msSkip)
+            decisions[field * blocks + i] = 15;
+         else
+            decisions[field * blocks + i] = source == msAltClip ? source : source | (frame->pics[field].directions[i] << 2);
+      }
+   }
+}
+
+
+const int64_t *bifrostFrameGetTimes(const BifrostFrame *frame) {
+   return frame->core->profile ? frame->times : NULL;
+}
+
+
+struct BlockDiffCore {
+   int tff;
+   int block_width;
+   int block_height;
+   int blocks_x;
+   int blocks_y;
+   int last_block_width; // smaller than block_width when the width isn't divisible by it
+   int last_block_height; // the same for the last row of blocks of each picture
+   int decimation; // only every decimation-th line is compared
+   int fields; // 2 in interlaced mode, 1 otherwise
+   int bytes_per_sample;
+
+   BlockLumaDiffRowFunction blockLumaDiffRow;
+   BlockLumaDiffRowFunction blockLumaDiffEdge; // for the last block of a row, when it's narrower
+
+   uint8_t *region; // NULL without a roi
+
+   BifrostThreadPool *pool;
+   int bands; // per picture
+};
+
+
+BlockDiffCore *blockDiffCoreCreate(const BifrostParams *params, const BifrostFormat *format, const char **error) {
+   BlockDiffCore d;
+
+   d.fields = params->interlaced ? 2 : 1;
+   d.tff = !!params->tff;
+   d.block_width = params->block_width;
+   d.block_height = params->block_height;
+   d.decimation = params->decimation;
+
+   int opt = params->opt;
+
+   *error = bifrostSelectOptLevel(&opt);
+   if (*error)
+      return NULL;
+
+   if (format->bits_per_sample < 8 || format->bits_per_sample > 16) {
+      *error = "Bifrost: Only 8 to 16 bit integer YUV allowed.";
+      return NULL;
+   }
+
+   if (d.block_width <= 0 || d.block_height <= 0) {
+      *error = "Bifrost: The requested block size is too small.";
+      return NULL;
+   }
+
+   if (d.decimation < 1 || d.decimation > d.block_height) {
+      *error = "Bifrost: decimation must be between 1 and the block height.";
+      return NULL;
+   }
+
+   if (d.fields == 2 && format->height % 2) {
+      *error = "Bifrost: In interlaced mode the clip's height must be even.";
+      return NULL;
+   }
+
+   d.bytes_per_sample = format->bits_per_sample > 8 ? 2 : 1;
+
+   d.blocks_x = (format->width + d.block_width - 1) / d.block_width;
+   d.blocks_y = (format->height / d.fields + d.block_height - 1) / d.block_height;
+   d.last_block_width = format->width - (d.blocks_x - 1) * d.block_width;
+   d.last_block_height = format->height / d.fields - (d.blocks_y - 1) * d.block_height;
+
+   int high_bitdepth = d.bytes_per_sample == 2;
+
+   d.blockLumaDiffRow = high_bitdepth ? blockLumaDiffRow16_c : blockLumaDiffRow_c;
+   d.blockLumaDiffEdge = d.blockLumaDiffRow;
+#if defined(BIFROST_X86)
+   if (d.block_width % 4 == 0) {
+      if (opt == optSSE2)
+         d.blockLumaDiffRow = high_bitdepth ? blockLumaDiffRow16_sse2 : blockLumaDiffRow_sse2;
+      else if (opt == optAVX2)
+         d.blockLumaDiffRow = high_bitdepth ? blockLumaDiffRow16_avx2 : blockLumaDiffRow_avx2;
+   }
+#endif
+
+   d.region = makeRegion(params->roi, params->roi_count, d.blocks_x, d.blocks_y, d.block_width, d.block_height, d.fields, d.tff, error);
+   if (*error)
+      return NULL;
+
+   int threads = params->threads;
+
+   d.bands = bandCount(threads, d.blocks_y * d.block_height);
+   d.pool = threadPoolCreate(threads < d.fields * d.bands ? threads : d.fields * d.bands);
+
+   BlockDiffCore *bd = malloc(sizeof(d));
+   *bd = d;
+
+   return bd;
+}
+
+
+void blockDiffCoreFree(BlockDiffCore *bd) {
+   if (!bd)
+      return;
+
+   threadPoolFree(bd->pool);
+   free(bd->region);
+   free(bd);
+}
+
+
+void blockDiffCoreGetBlocks(const BlockDiffCore *bd, int *blocks_x, int *blocks_y) {
+   *blocks_x = bd->blocks_x;
+   *blocks_y = bd->blocks_y;
+}
+
+
+typedef struct {
+   const BlockDiffCore *d;
+
+   // The luma of each picture and of the one after it.
+   const uint8_t *srcc_y[2];
+   const uint8_t *srcn_y[2];
+   ptrdiff_t stride_y; // of a picture, in bytes
+
+   // In interlaced mode the differences of the first field are followed by those of the second field.
+   int *diffs;
+   ptrdiff_t diffs_stride; // in ints
+
+   int64_t *times; // psStages per band, NULL unless profiling is enabled
+} BlockDiffBandJob;
+
+
+// Computes the differences of the blocks first_block to last_block - 1 of a row
+// of blocks that is height lines tall. The blocks of the last column and row
+// are smaller when the picture isn't divisible by the block size, and their
+// differences are scaled to the area of a whole block, so that the same
+// luma_thresh works for every block. With decimation the lines that are
+// skipped count as if they were the same as the ones that are compared.
+static void blockDiffSpan(const BlockDiffCore *d, const uint8_t *srcc_y, const uint8_t *srcn_y, int *diffs,
+                          int first_block, int last_block, int height, ptrdiff_t stride_y) {
+   int whole_blocks = last_block - first_block;
+   int has_edge = last_block == d->blocks_x && d->last_block_width < d->block_width;
+
+   whole_blocks -= has_edge;
+
+   ptrdiff_t offset = first_block * d->block_width * d->bytes_per_sample;
+   ptrdiff_t stride = stride_y / d->bytes_per_sample * d->decimation;
+   int lines = (height + d->decimation - 1) / d->decimation;
+
+   d->blockLumaDiffRow(srcc_y + offset, srcn_y + offset, diffs + first_block, whole_blocks, d->block_width, lines, stride);
+
+   if (has_edge) {
+      offset = (last_block - 1) * d->block_width * d->bytes_per_sample;
+
+      d->blockLumaDiffEdge(srcc_y + offset, srcn_y + offset, diffs + last_block - 1, 1, d->last_block_width, lines, stride);
+   }
+
+   // The whole blocks only need to be multiplied, which gives the same
+   // result as the division below, when the lines compared divide their height.
+   int first_divided = first_block;
+
+   if (height == d->block_height && d->block_height % lines == 0) {
+      int factor = d->block_height / lines;
+
+      first_divided = last_block - has_edge;
+
+      if (factor > 1) {
+         for (int x = first_block; x < first_divided; x++)
+            diffs[x] *= factor;
+      }
+   }
+
+   int64_t block_area = d->block_width * d->block_height;
+
+   for (int x = first_divided; x < last_block; x++) {
+      int64_t area = (x < d->blocks_x - 1 ? d->block_width : d->last_block_width) * lines;
+
+      diffs[x] = (int)((diffs[x] * block_area + area / 2) / area);
+   }
+}
+
+
+static void blockDiffBand(void *job_data, int band) {
+   const BlockDiffBandJob *job = (const BlockDiffBandJob *)job_data;
+   const BlockDiffCore *d = job->d;
+
+   int field = band / d->bands;
+   band %= d->bands;
+
+   int blocks_x = d->blocks_x;
+   int block_height = d->block_height;
+   ptrdiff_t stride_y = job->stride_y;
+
+   int first_row = d->blocks_y * band / d->bands;
+   int last_row = d->blocks_y * (band + 1) / d->bands;
+
+   const uint8_t *srcc_y = job->srcc_y[field] + first_row * block_height * stride_y;
+   const uint8_t *srcn_y = job->srcn_y[field] + first_row * block_height * stride_y;
+
+   int *field_diffs = job->diffs + field * d->blocks_y * job->diffs_stride;
+
+   int64_t *times = job->times ? job->times + (field * d->bands + band) * psStages : NULL;
+   int64_t lap = profileStart(times);
+
+   const uint8_t *region = d->region ? d->region + field * d->blocks_y * blocks_x : NULL;
+
+   for (int y = first_row; y < last_row; y++) {
+      int *diffs = field_diffs + y * job->diffs_stride;
+      int height = y < d->blocks_y - 1 ? block_height : d->last_block_height;
+
+      if (!region) {
+         blockDiffSpan(d, srcc_y, srcn_y, diffs, 0, blocks_x, height, stride_y);
+      } else {
+         // Only the spans of blocks inside the region are compared.
+         const uint8_t *row_region = region + y * blocks_x;
+
+         int x = 0;
+         while (x < blocks_x) {
+            int span_start = x;
+            int inside = row_region[x];
+
+            while (x < blocks_x && row_region[x] == inside)
+               x++;
+
+            if (inside)
+               blockDiffSpan(d, srcc_y, srcn_y, diffs, span_start, x, height, stride_y);
+            else
+               memset(diffs + span_start, 0, (x - span_start) * sizeof(int));
+         }
+      }
+
+      srcc_y += block_height * stride_y;
+      srcn_y += block_height * stride_y;
+   }
+
+   profileLap(times, psBlockDiff, &lap);
+}
+
+
+void blockDiffCoreCompute(const BlockDiffCore *bd, int n, int num_frames, const uint8_t *src_y, const uint8_t *next_y, ptrdiff_t stride_y,
+                          int *diffs, ptrdiff_t diffs_stride, int64_t *times) {
+   const BlockDiffCore *d = bd;
+
+   int fields = d->fields;
+   int last_picture = num_frames * fields - 1;
+   const uint8_t *srcs[2] = { src_y, next_y };
+
+   BlockDiffBandJob job;
+   job.d = d;
+   job.stride_y = stride_y * fields;
+   job.diffs = diffs;
+   job.diffs_stride = diffs_stride;
+   job.times = times ? calloc(fields * d->bands, sizeof(ProfileTimes)) : NULL;
+
+   for (int field = 0; field < fields; field++) {
+      int current = n * fields + field;
+      int next = current + fields < last_picture ? current + fields : last_picture;
+
+      job.srcc_y[field] = srcs[current / fields - n] + pictureRow(current, fields, d->tff) * stride_y;
+      job.srcn_y[field] = srcs[next / fields - n] + pictureRow(next, fields, d->tff) * stride_y;
+   }
+
+   threadPoolRun(d->pool, blockDiffBand, &job, fields * d->bands);
+
+   if (times) {
+      for (int i = 0; i < fields * d->bands * psStages; i++)
+         times[i % psStages] += job.times[i];
+
+      free(job.times);
+   }
+}
@@ -0,0 +1,196 @@
+#ifndef BIFROST_CORE_H
+#define BIFROST_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// The part of Bifrost that doesn't depend on VapourSynth. It works on plane
+// pointers, so it can be used by any program that has the frames in memory.
+//
+// Strides are in bytes. Samples of more than 8 bits take two bytes, in the
+// machine's byte order.
+
+
+typedef struct {
+   int width;
+   int height;
+   int subsampling_w; // log2 of the horizontal chroma subsampling factor
+   int subsampling_h;
+   int bits_per_sample; // 8 to 16
+} BifrostFormat;
+
+
+typedef struct {
+   float luma_thresh; // on the 8 bit scale
+   int variation; // on the 8 bit scale
+   int conservative_mask;
+   int interlaced;
+   int tff;
+   int block_width;
+   int block_height;
+
+   // The luma differences of each block are computed from every decimation-th
+   // line of it, and scaled to the whole block. 1 to compare every line.
+   int decimation;
+
+   // Smooth the chroma of the blocks that move too much, guided by the luma,
+   // instead of copying them from altclip. spatial_thresh is the largest luma
+   // difference between samples that are averaged, on the 8 bit scale.
+   int spatial;
+   float spatial_thresh;
+
+   int opt; // 0 for the best the CPU supports, 1 for C, 2 for SSE2, 3 for AVX2
+   int threads; // at least 1
+
+   // Only the blocks that overlap these rectangles are processed. roi holds
+   // the x, y, width and height of each of them, in pixels of the frame.
+   // NULL to process the whole frame.
+   const int *roi;
+   int roi_count;
+
+   int stats; // count the rainbow pixels
+   int profile; // measure the time spent in every stage
+} BifrostParams;
+
+// The defaults of the VapourSynth filter.
+void bifrostDefaultParams(BifrostParams *params);
+
+
+// Resolves opt=0 to the best instruction set the CPU supports.
+// Returns an error message if the requested one can't be used.
+const char *bifrostSelectOptLevel(int *opt);
+
+
+// Computes the luma differences of every block, which Bifrost bases its
+// decisions on. Only the block size, decimation, interlaced, tff, roi, opt,
+// threads and profile are used from the parameters. The differences of the
+// blocks outside the roi are 0. When the picture isn't divisible by the block
+// size, the blocks of the last column and row are smaller, and their
+// differences are scaled to the area of a whole block.
+typedef struct BlockDiffCore BlockDiffCore;
+
+// Returns NULL and sets *error if the parameters can't be used with the format.
+BlockDiffCore *blockDiffCoreCreate(const BifrostParams *params, const BifrostFormat *format, const char **error);
+
+void blockDiffCoreFree(BlockDiffCore *bd);
+
+void blockDiffCoreGetBlocks(const BlockDiffCore *bd, int *blocks_x, int *blocks_y);
+
+// Computes the differences between the pictures of frame n and the following
+// ones. src_y is the luma of frame n, and next_y that of frame n + 1, or of
+// frame n again if it's the last one.
+// diffs_stride is in ints. In interlaced mode the blocks_y rows of the first
+// field are followed by those of the second field.
+// times is NULL, or gets the time spent added to it, see bifrost_profile.h.
+// Can be called from several threads at the same time.
+void blockDiffCoreCompute(const BlockDiffCore *bd, int n, int num_frames, const uint8_t *src_y, const uint8_t *next_y, ptrdiff_t stride_y,
+                          int *diffs, ptrdiff_t diffs_stride, int64_t *times);
+
+
+// Removes the rainbows from the chroma of one frame at a time.
+typedef struct BifrostCore BifrostCore;
+
+// Returns NULL and sets *error if the parameters can't be used with the format.
+BifrostCore *bifrostCoreCreate(const BifrostParams *params, const BifrostFormat *format, const char **error);
+
+void bifrostCoreFree(BifrostCore *core);
+
+// The size of the grid of blocks of one picture. In interlaced mode there are two pictures per frame.
+void bifrostCoreGetBlocks(const BifrostCore *core, int *blocks_x, int *blocks_y);
+
+// Linear mode: computes the chroma differences of a frame and the next one,
+// which bifrostFrameCreate can use instead of comparing the frames itself.
+// diffs has one byte per chroma sample.
+void bifrostCoreChromaDiff(const BifrostCore *core, const uint8_t *src1_u, const uint8_t *src1_v,
+                           const uint8_t *src2_u, const uint8_t *src2_v, ptrdiff_t stride_uv,
+                           uint8_t *diffs, ptrdiff_t diffs_stride);
+
+
+// Everything frame n is made from. The frames before the first one and after
+// the last one are replaced with the first and the last one, respectively.
+typedef struct {
+   // The chroma of frames n-2 to n+2.
+   const uint8_t *src_u[5];
+   const uint8_t *src_v[5];
+   ptrdiff_t stride_uv;
+
+   // The differences computed by blockDiffCoreCompute for frames n-2 to n+2.
+   const int *diffs[5];
+   ptrdiff_t diffs_stride; // in ints
+
+   // The differences computed by bifrostCoreChromaDiff for frames n-2 to n+1,
+   // or NULL to compare the frames directly.
+   const uint8_t *chroma_diffs[4];
+   ptrdiff_t chroma_diffs_stride;
+
+   // The chroma of frame n of altclip, which has the same stride as the
+   // source. NULL when there is no altclip, in which case the blocks that move
+   // too much are copied from the source. Not used with spatial.
+   const uint8_t *alt_u;
+   const uint8_t *alt_v;
+
+   // The luma of frame n, only used with spatial.
+   const uint8_t *src_y;
+   ptrdiff_t stride_y;
+
+   // A plane the size of the luma of frame n, or NULL. Blocks where it's zero
+   // everywhere keep their chroma, as if they were outside the roi.
+   const uint8_t *mask;
+   ptrdiff_t mask_stride;
+   int mask_bytes_per_sample;
+} BifrostFrameInput;
+
+
+// Where the chroma of the output comes from.
+enum BifrostChromaSource {
+   bcsProcessed, // bifrostFrameProcess has to be called
+   bcsSource,    // the chroma of frame n is unchanged
+   bcsAltClip    // every block is copied from altclip, and spatial is off
+};
+
+
+typedef struct BifrostFrame BifrostFrame;
+
+// The pointers in input must stay valid until the frame is freed.
+// Can be called from several threads at the same time, for different frames.
+BifrostFrame *bifrostFrameCreate(const BifrostCore *core, int n, int num_frames, const BifrostFrameInput *input);
+
+void bifrostFrameFree(BifrostFrame *frame);
+
+// Whether any block may be copied from altclip. Lets altclip be requested
+// only when it's needed, after which the frame is created again with it.
+int bifrostFrameNeedsAltClip(const BifrostFrame *frame);
+
+// Decides what happens to every block. Returns a BifrostChromaSource.
+int bifrostFrameAnalyse(BifrostFrame *frame);
+
+// Writes the chroma of the output, when bifrostFrameAnalyse returned
+// bcsProcessed. dst_u and dst_v have the same stride as the source.
+void bifrostFrameProcess(BifrostFrame *frame, uint8_t *dst_u, uint8_t *dst_v);
+
+
+typedef struct {
+   int static_blocks;
+   int blend_next_blocks;
+   int blend_prev_blocks;
+   int blend_both_blocks;
+   int alt_blocks;
+   int outside_blocks; // outside the roi or the mask
+   int64_t rainbow_pixels; // only counted when the stats parameter is set
+} BifrostFrameStats;
+
+// Only valid after bifrostFrameAnalyse and, if needed, bifrostFrameProcess.
+void bifrostFrameGetStats(const BifrostFrame *frame, BifrostFrameStats *stats);
+
+// Writes one byte per block of every picture: the MaskSource in the low two
+// bits, and the BlendDirection shifted left by two for blocks that aren't
+// copied from altclip. Blocks outside the roi or the mask get 15.
+// In interlaced mode the second field follows the first.
+void bifrostFrameGetDecisions(const BifrostFrame *frame, uint8_t *decisions);
+
+// The time spent in every stage, or NULL unless profiling is enabled.
+const int64_t *bifrostFrameGetTimes(const BifrostFrame *frame);
+
+
+#endif // BIFROST_CORE_H
@@ -0,0 +1,386 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#if defined(__APPLE__)
+#define _DARWIN_C_SOURCE // for flock
+#endif
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "bifrost_diffcache.h"
+
+
+#define CACHE_MAGIC "BifrostD"
+#define CACHE_VERSION 3
+#define CACHE_MAX_KEY_SIZE 16
+
+// The file starts with the header, followed at FLAGS_OFFSET by one byte per
+// frame which is set once the frame's data is complete, followed by the data
+// of every frame, starting at a multiple of 64 bytes.
+typedef struct {
+   char magic[8];
+   uint32_t version;
+   uint32_t key_size;
+   int32_t key[CACHE_MAX_KEY_SIZE];
+   uint32_t frames;
+   uint32_t reserved;
+   uint64_t frame_size;
+   uint64_t fingerprint; // of the clip's contents, see diffCacheFingerprint
+} CacheHeader;
+
+#define FLAGS_OFFSET 128
+
+
+struct BifrostDiffCache {
+   uint8_t *map;
+   size_t map_size;
+
+   uint8_t *flags;
+   uint8_t *data;
+   size_t frame_size;
+
+   pthread_mutex_t lock;
+
+#if defined(_WIN32)
+   HANDLE file;
+   HANDLE mapping;
+#else
+   int fd;
+#endif
+};
+
+
+#if defined(_WIN32)
+// Windows locks byte ranges, and stops other processes from reading or
+// writing a locked range, so a single byte far past the end of the file is
+// locked instead of the file. flags is 0 for a shared lock, or
+// LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY. Returns 0 on success.
+static int lockFile(HANDLE file, DWORD flags) {
+   OVERLAPPED overlapped;
+   memset(&overlapped, 0, sizeof(overlapped));
+   overlapped.Offset = 0xffffffff;
+   overlapped.OffsetHigh = 0x7fffffff;
+
+   return !LockFileEx(file, flags, 0, 1, 0, &overlapped);
+}
+
+
+static int unlockFile(HANDLE file) {
+   OVERLAPPED overlapped;
+   memset(&overlapped, 0, sizeof(overlapped));
+   overlapped.Offset = 0xffffffff;
+   overlapped.OffsetHigh = 0x7fffffff;
+
+   return !UnlockFileEx(file, 0, 1, 0, &overlapped);
+}
+
+
+static int fileSize(HANDLE file, uint64_t *size) {
+   LARGE_INTEGER file_size;
+   if (!GetFileSizeEx(file, &file_size))
+      return -1;
+
+   *size = (uint64_t)file_size.QuadPart;
+
+   return 0;
+}
+
+
+// Whether the file has the given size and starts with the header.
+static int fileMatches(HANDLE file, size_t size, const CacheHeader *header) {
+   uint64_t file_size;
+   if (fileSize(file, &file_size) || file_size != size)
+      return 0;
+
+   CacheHeader file_header;
+   DWORD bytes_read;
+   OVERLAPPED overlapped;
+   memset(&overlapped, 0, sizeof(overlapped));
+
+   if (!ReadFile(file, &file_header, sizeof(file_header), &bytes_read, &overlapped) || bytes_read != sizeof(file_header))
+      return 0;
+
+   return !memcmp(&file_header, header, sizeof(file_header));
+}
+
+
+// Empties the file and gives it the given size and header. NTFS allocates
+// the whole size right away, so a full disk is reported here.
+static int resetFile(HANDLE file, size_t size, const CacheHeader *header) {
+   LARGE_INTEGER position;
+   position.QuadPart = 0;
+
+   if (!SetFilePointerEx(file, position, NULL, FILE_BEGIN) || !SetEndOfFile(file))
+      return -1;
+
+   position.QuadPart = size;
+
+   if (!SetFilePointerEx(file, position, NULL, FILE_BEGIN) || !SetEndOfFile(file))
+      return -1;
+
+   DWORD bytes_written;
+   OVERLAPPED overlapped;
+   memset(&overlapped, 0, sizeof(overlapped));
+
+   if (!WriteFile(file, header, sizeof(CacheHeader), &bytes_written, &overlapped) || bytes_written != sizeof(CacheHeader))
+      return -1;
+
+   return 0;
+}
+#else
+// Retries when interrupted by a signal. Returns 0 on success.
+static int lockFile(int fd, int operation) {
+   int ret;
+
+   do {
+      ret = flock(fd, operation);
+   } while (ret && errno == EINTR);
+
+   return ret;
+}
+
+
+// Whether the file has the given size and starts with the header.
+static int fileMatches(int fd, size_t size, const CacheHeader *header) {
+   struct stat st;
+   if (fstat(fd, &st) || (uint64_t)st.st_size != size)
+      return 0;
+
+   CacheHeader file_header;
+   if (pread(fd, &file_header, sizeof(file_header), 0) != (ssize_t)sizeof(file_header))
+      return 0;
+
+   return !memcmp(&file_header, header, sizeof(file_header));
+}
+
+
+// Empties the file and gives it the given size and header. The blocks are
+// allocated right away: writing to a hole of a mapped file on a full disk
+// would kill the process with SIGBUS.
+static int resetFile(int fd, size_t size, const CacheHeader *header) {
+   if (ftruncate(fd, 0))
+      return -1;
+
+#if defined(__APPLE__)
+   fstore_t store = { F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)size, 0 };
+   int allocated = fcntl(fd, F_PREALLOCATE, &store) != -1 && !ftruncate(fd, size);
+#else
+   int allocated = !posix_fallocate(fd, 0, size);
+#endif
+
+   if (!allocated)
+      return -1;
+
+   if (pwrite(fd, header, sizeof(CacheHeader), 0) != (ssize_t)sizeof(CacheHeader))
+      return -1;
+
+   return 0;
+}
+#endif
+
+
+// Maps a file of the given size, which starts with the header. If it doesn't
+// match, it's emptied first. Returns an error message, or NULL.
+static const char *mapFile(BifrostDiffCache *cache, const char *path, size_t size, const CacheHeader *header) {
+   int reset;
+
+   // Every user of the file, in this process or another one, holds a shared
+   // lock on it for as long as it's mapped, and it's only started over under
+   // an exclusive lock, i.e. when nobody else uses it. Turning the exclusive
+   // lock back into a shared one isn't atomic, so the header is checked again
+   // once the shared lock is held.
+#if defined(_WIN32)
+   cache->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (cache->file == INVALID_HANDLE_VALUE)
+      return "Bifrost: Failed to open the cache file.";
+
+   int locked = !lockFile(cache->file, 0);
+
+   reset = !fileMatches(cache->file, size, header);
+
+   if (reset) {
+      const char *error = NULL;
+      uint64_t file_size;
+
+      if (!locked && (fileSize(cache->file, &file_size) || file_size))
+         error = "Bifrost: The cache file was made for another clip or with other parameters, and it can't be locked to start it over.";
+      else if (locked && (unlockFile(cache->file) || lockFile(cache->file, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY)))
+         error = "Bifrost: The cache file was made for another clip or with other parameters, and it's in use.";
+      else if (resetFile(cache->file, size, header))
+         error = "Bifrost: Failed to start the cache file over. The disk may be full.";
+      else if (locked && (unlockFile(cache->file) || lockFile(cache->file, 0)))
+         error = "Bifrost: Failed to start the cache file over.";
+      else if (!fileMatches(cache->file, size, header))
+         error = "Bifrost: The cache file was started over by another process at the same time.";
+
+      if (error) {
+         CloseHandle(cache->file);
+         return error;
+      }
+   }
+
+   cache->mapping = CreateFileMappingA(cache->file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+   if (!cache->mapping) {
+      CloseHandle(cache->file);
+      return "Bifrost: Failed to open the cache file.";
+   }
+
+   cache->map = MapViewOfFile(cache->mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+   if (!cache->map) {
+      CloseHandle(cache->mapping);
+      CloseHandle(cache->file);
+      return "Bifrost: Failed to open the cache file.";
+   }
+#else
+   cache->fd = open(path, O_RDWR | O_CREAT, 0644);
+   if (cache->fd == -1)
+      return "Bifrost: Failed to open the cache file.";
+
+   // Some file systems can't lock files, in which case the file can still be
+   // used, but it's only ever set up when it's new.
+   int locked = !lockFile(cache->fd, LOCK_SH);
+
+   reset = !fileMatches(cache->fd, size, header);
+
+   if (reset) {
+      const char *error = NULL;
+      struct stat st;
+
+      if (!locked && (fstat(cache->fd, &st) || st.st_size))
+         error = "Bifrost: The cache file was made for another clip or with other parameters, and it can't be locked to start it over.";
+      else if (locked && lockFile(cache->fd, LOCK_EX | LOCK_NB))
+         error = "Bifrost: The cache file was made for another clip or with other parameters, and it's in use.";
+      else if (resetFile(cache->fd, size, header))
+         error = "Bifrost: Failed to start the cache file over. The disk may be full.";
+      else if (locked && lockFile(cache->fd, LOCK_SH))
+         error = "Bifrost: Failed to start the cache file over.";
+      else if (!fileMatches(cache->fd, size, header))
+         error = "Bifrost: The cache file was started over by another process at the same time.";
+
+      if (error) {
+         close(cache->fd);
+         return error;
+      }
+   }
+
+   void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+   if (map == MAP_FAILED) {
+      close(cache->fd);
+      return "Bifrost: Failed to open the cache file.";
+   }
+
+   cache->map = map;
+#endif
+
+   cache->map_size = size;
+
+   return NULL;
+}
+
+
+static void unmapFile(BifrostDiffCache *cache) {
+#if defined(_WIN32)
+   UnmapViewOfFile(cache->map);
+   CloseHandle(cache->mapping);
+   CloseHandle(cache->file);
+#else
+   munmap(cache->map, cache->map_size);
+   close(cache->fd);
+#endif
+}
+
+
+uint64_t diffCacheFingerprint(uint64_t hash, const uint8_t *plane, ptrdiff_t stride, size_t width, int height) {
+   // 64 bit FNV-1a.
+   for (int y = 0; y < height; y++) {
+      for (size_t x = 0; x < width; x++)
+         hash = (hash ^ plane[x]) * UINT64_C(1099511628211);
+
+      plane += stride;
+   }
+
+   return hash;
+}
+
+
+BifrostDiffCache *diffCacheOpen(const char *path, const int32_t *key, int key_size, int frames, size_t frame_size,
+                                uint64_t fingerprint, const char **error) {
+   if (key_size > CACHE_MAX_KEY_SIZE) {
+      *error = "Bifrost: Too many parameters in the cache key.";
+      return NULL;
+   }
+
+   CacheHeader header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+   header.version = CACHE_VERSION;
+   header.key_size = key_size;
+   memcpy(header.key, key, key_size * sizeof(int32_t));
+   header.frames = frames;
+   header.frame_size = frame_size;
+   header.fingerprint = fingerprint;
+
+   size_t data_offset = (FLAGS_OFFSET + frames + 63) & ~(size_t)63;
+   size_t size = data_offset + frames * frame_size;
+
+   BifrostDiffCache *cache = malloc(sizeof(BifrostDiffCache));
+
+   *error = mapFile(cache, path, size, &header);
+   if (*error) {
+      free(cache);
+      return NULL;
+   }
+
+   cache->flags = cache->map + FLAGS_OFFSET;
+   cache->data = cache->map + data_offset;
+   cache->frame_size = frame_size;
+
+   pthread_mutex_init(&cache->lock, NULL);
+
+   return cache;
+}
+
+
+void diffCacheClose(BifrostDiffCache *cache) {
+   if (!cache)
+      return;
+
+   unmapFile(cache);
+   pthread_mutex_destroy(&cache->lock);
+   free(cache);
+}
+
+
+const void *diffCacheGet(const BifrostDiffCache *cache, int n) {
+   if (!__atomic_load_n(&cache->flags[n], __ATOMIC_ACQUIRE))
+      return NULL;
+
+   return cache->data + n * cache->frame_size;
+}
+
+
+void diffCachePut(BifrostDiffCache *cache, int n, const void *data) {
+   pthread_mutex_lock(&cache->lock);
+
+   // The flag is only set once the data is complete, so readers that don't
+   // take the lock never see a partially written frame.
+   if (!cache->flags[n]) {
+      memcpy(cache->data + n * cache->frame_size, data, cache->frame_size);
+      __atomic_store_n(&cache->flags[n], 1, __ATOMIC_RELEASE);
+   }
+
+   pthread_mutex_unlock(&cache->lock);
+}
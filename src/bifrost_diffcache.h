@@ -0,0 +1,38 @@
+#ifndef BIFROST_DIFFCACHE_H
+#define BIFROST_DIFFCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// A file that stores the luma differences of every frame of a clip, so they
+// only need to be computed once. It's memory-mapped, and frames are added to
+// it as they are computed.
+typedef struct BifrostDiffCache BifrostDiffCache;
+
+
+// A hash of some planes of a clip, which tells different clips apart. It
+// starts at DIFF_CACHE_FINGERPRINT_START, and every plane is added with
+// diffCacheFingerprint.
+#define DIFF_CACHE_FINGERPRINT_START UINT64_C(14695981039346656037)
+
+uint64_t diffCacheFingerprint(uint64_t hash, const uint8_t *plane, ptrdiff_t stride, size_t width, int height);
+
+// key describes everything the differences depend on, and fingerprint the
+// clip they're computed from. If the file exists but was made with a
+// different key, fingerprint, number of frames or frame size, it's started
+// over, unless another process is using it. Returns NULL and sets *error if
+// the file can't be used.
+BifrostDiffCache *diffCacheOpen(const char *path, const int32_t *key, int key_size, int frames, size_t frame_size,
+                                uint64_t fingerprint, const char **error);
+
+void diffCacheClose(BifrostDiffCache *cache);
+
+// Returns NULL if frame n isn't in the file yet.
+const void *diffCacheGet(const BifrostDiffCache *cache, int n);
+
+// Can be called from several threads at the same time.
+void diffCachePut(BifrostDiffCache *cache, int n, const void *data);
+
+
+#endif // BIFROST_DIFFCACHE_H
@@ -0,0 +1,858 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vapoursynth/VapourSynth4.h>
+#include <vapoursynth/VSHelper4.h>
+
+#include "bifrost_mockvs.h"
+
+
+typedef struct {
+   char *key;
+   int type; // a VSPropertyType
+   int size;
+
+   int64_t *ints;
+   double *floats;
+   char **data;
+   int *data_sizes;
+   VSNode **nodes;
+} MapEntry;
+
+
+struct VSMap {
+   MapEntry *entries;
+   int size;
+   char *error;
+};
+
+
+struct VSFrame {
+   VSVideoFormat format;
+   int width[3];
+   int height[3];
+   ptrdiff_t stride[3];
+   uint8_t *data[3];
+
+   VSMap props;
+   int refs;
+};
+
+
+struct VSNode {
+   char name[32];
+   VSVideoInfo vi;
+   VSFilterGetFrame getFrame;
+   VSFilterFree free;
+   void *instance;
+
+   int refs;
+   int frames_made;
+};
+
+
+typedef struct {
+   VSNode *node;
+   int n;
+   const VSFrame *frame;
+} FrameRequest;
+
+
+struct VSFrameContext {
+   FrameRequest *requests;
+   int num_requests;
+   char *error; // set by the filter or by a request that failed
+};
+
+
+typedef struct {
+   const char *name;
+   VSPublicFunction function;
+   void *data;
+} PluginFunction;
+
+
+struct VSPlugin {
+   const char *id;
+   PluginFunction functions[8];
+   int num_functions;
+};
+
+
+struct VSCore {
+   VSPlugin bifrost;
+};
+
+
+static VSCore mock_core;
+static int frames_alive;
+static int nodes_alive;
+static const VSAPI mock_api;
+
+
+static char *duplicateString(const char *s) {
+   char *copy = malloc(strlen(s) + 1);
+   strcpy(copy, s);
+
+   return copy;
+}
+
+
+// Maps
+
+
+static MapEntry *findEntry(const VSMap *map, const char *key) {
+   for (int i = 0; i < map->size; i++)
+      if (!strcmp(map->entries[i].key, key))
+         return &map->entries[i];
+
+   return NULL;
+}
+
+
+static void VS_CC freeNode(VSNode *node);
+
+
+static void clearEntry(MapEntry *entry) {
+   for (int i = 0; i < entry->size; i++) {
+      if (entry->data)
+         free(entry->data[i]);
+      if (entry->nodes)
+         freeNode(entry->nodes[i]);
+   }
+
+   free(entry->ints);
+   free(entry->floats);
+   free(entry->data);
+   free(entry->data_sizes);
+   free(entry->nodes);
+
+   entry->ints = NULL;
+   entry->floats = NULL;
+   entry->data = NULL;
+   entry->data_sizes = NULL;
+   entry->nodes = NULL;
+   entry->size = 0;
+}
+
+
+// Returns the entry of key with room for one more element, emptied unless
+// the element is appended to elements of the same type.
+static MapEntry *growEntry(VSMap *map, const char *key, int type, int append) {
+   MapEntry *entry = findEntry(map, key);
+
+   if (!entry) {
+      map->entries = realloc(map->entries, (map->size + 1) * sizeof(MapEntry));
+      entry = &map->entries[map->size++];
+      memset(entry, 0, sizeof(MapEntry));
+      entry->key = duplicateString(key);
+   } else if (append != maAppend || entry->type != type) {
+      clearEntry(entry);
+   }
+
+   entry->type = type;
+
+   int size = entry->size + 1;
+
+   switch (type) {
+   case ptInt:
+      entry->ints = realloc(entry->ints, size * sizeof(int64_t));
+      break;
+   case ptFloat:
+      entry->floats = realloc(entry->floats, size * sizeof(double));
+      break;
+   case ptData:
+      entry->data = realloc(entry->data, size * sizeof(char *));
+      entry->data_sizes = realloc(entry->data_sizes, size * sizeof(int));
+      break;
+   case ptVideoNode:
+      entry->nodes = realloc(entry->nodes, size * sizeof(VSNode *));
+      break;
+   }
+
+   return entry;
+}
+
+
+static VSMap *VS_CC createMap(void) {
+   return calloc(1, sizeof(VSMap));
+}
+
+
+static void VS_CC clearMap(VSMap *map) {
+   for (int i = 0; i < map->size; i++) {
+      clearEntry(&map->entries[i]);
+      free(map->entries[i].key);
+   }
+
+   free(map->entries);
+   free(map->error);
+
+   map->entries = NULL;
+   map->size = 0;
+   map->error = NULL;
+}
+
+
+static void VS_CC freeMap(VSMap *map) {
+   if (!map)
+      return;
+
+   clearMap(map);
+   free(map);
+}
+
+
+static VSNode *VS_CC addNodeRef(VSNode *node);
+
+
+static void VS_CC copyMap(const VSMap *src, VSMap *dst) {
+   for (int i = 0; i < src->size; i++) {
+      const MapEntry *from = &src->entries[i];
+
+      for (int j = 0; j < from->size; j++) {
+         MapEntry *to = growEntry(dst, from->key, from->type, j ? maAppend : maReplace);
+
+         switch (from->type) {
+         case ptInt:
+            to->ints[j] = from->ints[j];
+            break;
+         case ptFloat:
+            to->floats[j] = from->floats[j];
+            break;
+         case ptData:
+            to->data[j] = malloc(from->data_sizes[j] + 1);
+            memcpy(to->data[j], from->data[j], from->data_sizes[j] + 1);
+            to->data_sizes[j] = from->data_sizes[j];
+            break;
+         case ptVideoNode:
+            to->nodes[j] = addNodeRef(from->nodes[j]);
+            break;
+         }
+
+         to->size++;
+      }
+   }
+}
+
+
+static void VS_CC mapSetError(VSMap *map, const char *message) {
+   clearMap(map);
+   map->error = duplicateString(message);
+}
+
+
+static const char *VS_CC mapGetError(const VSMap *map) {
+   return map->error;
+}
+
+
+static int VS_CC mapDeleteKey(VSMap *map, const char *key) {
+   MapEntry *entry = findEntry(map, key);
+   if (!entry)
+      return 0;
+
+   clearEntry(entry);
+   free(entry->key);
+   *entry = map->entries[--map->size];
+
+   return 1;
+}
+
+
+static int VS_CC mapNumElements(const VSMap *map, const char *key) {
+   const MapEntry *entry = findEntry(map, key);
+
+   return entry ? entry->size : -1;
+}
+
+
+// Returns the entry that holds element index of key, or NULL after setting *error.
+static const MapEntry *getElement(const VSMap *map, const char *key, int type, int index, int *error) {
+   const MapEntry *entry = findEntry(map, key);
+   int e = peSuccess;
+
+   if (!entry)
+      e = peUnset;
+   else if (entry->type != type)
+      e = peType;
+   else if (index < 0 || index >= entry->size)
+      e = peIndex;
+
+   if (error) {
+      *error = e;
+   } else if (e) {
+      fprintf(stderr, "mockvs: %s[%d] was read without checking for errors, and it can't be read.\n", key, index);
+      abort();
+   }
+
+   return e ? NULL : entry;
+}
+
+
+static int64_t VS_CC mapGetInt(const VSMap *map, const char *key, int index, int *error) {
+   const MapEntry *entry = getElement(map, key, ptInt, index, error);
+
+   return entry ? entry->ints[index] : 0;
+}
+
+
+static int VS_CC mapGetIntSaturated(const VSMap *map, const char *key, int index, int *error) {
+   int64_t value = mapGetInt(map, key, index, error);
+
+   return value > INT32_MAX ? INT32_MAX : (value < INT32_MIN ? INT32_MIN : (int)value);
+}
+
+
+static const int64_t *VS_CC mapGetIntArray(const VSMap *map, const char *key, int *error) {
+   const MapEntry *entry = getElement(map, key, ptInt, 0, error);
+
+   return entry ? entry->ints : NULL;
+}
+
+
+static int VS_CC mapSetInt(VSMap *map, const char *key, int64_t value, int append) {
+   MapEntry *entry = growEntry(map, key, ptInt, append);
+   entry->ints[entry->size++] = value;
+
+   return 0;
+}
+
+
+static int VS_CC mapSetIntArray(VSMap *map, const char *key, const int64_t *values, int size) {
+   for (int i = 0; i < size; i++)
+      mapSetInt(map, key, values[i], i ? maAppend : maReplace);
+
+   return 0;
+}
+
+
+static double VS_CC mapGetFloat(const VSMap *map, const char *key, int index, int *error) {
+   // Like VapourSynth, integers are converted.
+   const MapEntry *entry = findEntry(map, key);
+   if (entry && entry->type == ptInt)
+      return (double)mapGetInt(map, key, index, error);
+
+   entry = getElement(map, key, ptFloat, index, error);
+
+   return entry ? entry->floats[index] : 0.0;
+}
+
+
+static float VS_CC mapGetFloatSaturated(const VSMap *map, const char *key, int index, int *error) {
+   return (float)mapGetFloat(map, key, index, error);
+}
+
+
+static int VS_CC mapSetFloat(VSMap *map, const char *key, double value, int append) {
+   MapEntry *entry = growEntry(map, key, ptFloat, append);
+   entry->floats[entry->size++] = value;
+
+   return 0;
+}
+
+
+static const char *VS_CC mapGetData(const VSMap *map, const char *key, int index, int *error) {
+   const MapEntry *entry = getElement(map, key, ptData, index, error);
+
+   return entry ? entry->data[index] : NULL;
+}
+
+
+static int VS_CC mapGetDataSize(const VSMap *map, const char *key, int index, int *error) {
+   const MapEntry *entry = getElement(map, key, ptData, index, error);
+
+   return entry ? entry->data_sizes[index] : -1;
+}
+
+
+static int VS_CC mapSetData(VSMap *map, const char *key, const char *data, int size, int type, int append) {
+   if (size < 0)
+      size = (int)strlen(data);
+
+   MapEntry *entry = growEntry(map, key, ptData, append);
+
+   // Always terminated, like in VapourSynth.
+   entry->data[entry->size] = malloc(size + 1);
+   memcpy(entry->data[entry->size], data, size);
+   entry->data[entry->size][size] = 0;
+   entry->data_sizes[entry->size] = size;
+   entry->size++;
+
+   return 0;
+}
+
+
+static VSNode *VS_CC mapGetNode(const VSMap *map, const char *key, int index, int *error) {
+   const MapEntry *entry = getElement(map, key, ptVideoNode, index, error);
+
+   return entry ? addNodeRef(entry->nodes[index]) : NULL;
+}
+
+
+static int VS_CC mapConsumeNode(VSMap *map, const char *key, VSNode *node, int append) {
+   MapEntry *entry = growEntry(map, key, ptVideoNode, append);
+   entry->nodes[entry->size++] = node;
+
+   return 0;
+}
+
+
+static int VS_CC mapSetNode(VSMap *map, const char *key, VSNode *node, int append) {
+   return mapConsumeNode(map, key, addNodeRef(node), append);
+}
+
+
+// Frames
+
+
+static int VS_CC queryVideoFormat(VSVideoFormat *format, int colorFamily, int sampleType, int bitsPerSample,
+                                  int subSamplingW, int subSamplingH, VSCore *core) {
+   format->colorFamily = colorFamily;
+   format->sampleType = sampleType;
+   format->bitsPerSample = bitsPerSample;
+   format->bytesPerSample = bitsPerSample <= 8 ? 1 : (bitsPerSample <= 16 ? 2 : 4);
+   format->subSamplingW = colorFamily == cfGray ? 0 : subSamplingW;
+   format->subSamplingH = colorFamily == cfGray ? 0 : subSamplingH;
+   format->numPlanes = colorFamily == cfGray ? 1 : 3;
+
+   return 1;
+}
+
+
+static VSFrame *VS_CC newVideoFrame(const VSVideoFormat *format, int width, int height, const VSFrame *propSrc, VSCore *core) {
+   VSFrame *frame = calloc(1, sizeof(VSFrame));
+
+   frame->format = *format;
+   frame->refs = 1;
+   frames_alive++;
+
+   for (int plane = 0; plane < format->numPlanes; plane++) {
+      frame->width[plane] = plane ? width >> format->subSamplingW : width;
+      frame->height[plane] = plane ? height >> format->subSamplingH : height;
+
+      // Aligned like in VapourSynth, and filled with garbage, so that
+      // samples that are read before they're written show up.
+      frame->stride[plane] = ((ptrdiff_t)frame->width[plane] * format->bytesPerSample + 63) & ~(ptrdiff_t)63;
+      frame->data[plane] = vsh_aligned_malloc(frame->stride[plane] * frame->height[plane] + 64, 64);
+      memset(frame->data[plane], 0xcd, frame->stride[plane] * frame->height[plane] + 64);
+   }
+
+   if (propSrc)
+      copyMap(&propSrc->props, &frame->props);
+
+   return frame;
+}
+
+
+static VSFrame *VS_CC newVideoFrame2(const VSVideoFormat *format, int width, int height, const VSFrame **planeSrc,
+                                     const int *planes, const VSFrame *propSrc, VSCore *core) {
+   VSFrame *frame = newVideoFrame(format, width, height, propSrc, core);
+
+   for (int plane = 0; plane < format->numPlanes; plane++) {
+      const VSFrame *src = planeSrc[plane];
+
+      if (src)
+         vsh_bitblt(frame->data[plane], frame->stride[plane], src->data[planes[plane]], src->stride[planes[plane]],
+                    (size_t)frame->width[plane] * format->bytesPerSample, frame->height[plane]);
+   }
+
+   return frame;
+}
+
+
+static void VS_CC freeFrame(const VSFrame *f) {
+   VSFrame *frame = (VSFrame *)f;
+
+   if (!frame || --frame->refs)
+      return;
+
+   for (int plane = 0; plane < 3; plane++)
+      vsh_aligned_free(frame->data[plane]);
+
+   clearMap(&frame->props);
+   free(frame);
+   frames_alive--;
+}
+
+
+static const VSFrame *VS_CC addFrameRef(const VSFrame *f) {
+   ((VSFrame *)f)->refs++;
+
+   return f;
+}
+
+
+static VSFrame *VS_CC copyFrame(const VSFrame *f, VSCore *core) {
+   const VSFrame *planeSrc[3] = { f, f, f };
+   const int planes[3] = { 0, 1, 2 };
+
+   return newVideoFrame2(&f->format, f->width[0], f->height[0], planeSrc, planes, f, core);
+}
+
+
+static const VSMap *VS_CC getFramePropertiesRO(const VSFrame *f) {
+   return &f->props;
+}
+
+
+static VSMap *VS_CC getFramePropertiesRW(VSFrame *f) {
+   return &f->props;
+}
+
+
+static ptrdiff_t VS_CC getStride(const VSFrame *f, int plane) {
+   return f->stride[plane];
+}
+
+
+static const uint8_t *VS_CC getReadPtr(const VSFrame *f, int plane) {
+   return f->data[plane];
+}
+
+
+static uint8_t *VS_CC getWritePtr(VSFrame *f, int plane) {
+   return f->data[plane];
+}
+
+
+static const VSVideoFormat *VS_CC getVideoFrameFormat(const VSFrame *f) {
+   return &f->format;
+}
+
+
+static int VS_CC getFrameWidth(const VSFrame *f, int plane) {
+   return f->width[plane];
+}
+
+
+static int VS_CC getFrameHeight(const VSFrame *f, int plane) {
+   return f->height[plane];
+}
+
+
+// Nodes
+
+
+static VSNode *VS_CC createVideoFilter2(const char *name, const VSVideoInfo *vi, VSFilterGetFrame getFrame, VSFilterFree free,
+                                        int filterMode, const VSFilterDependency *dependencies, int numDeps, void *instanceData, VSCore *core) {
+   VSNode *node = calloc(1, sizeof(VSNode));
+
+   snprintf(node->name, sizeof(node->name), "%s", name);
+   node->vi = *vi;
+   node->getFrame = getFrame;
+   node->free = free;
+   node->instance = instanceData;
+   node->refs = 1;
+   nodes_alive++;
+
+   return node;
+}
+
+
+static void VS_CC createVideoFilter(VSMap *out, const char *name, const VSVideoInfo *vi, VSFilterGetFrame getFrame, VSFilterFree free,
+                                    int filterMode, const VSFilterDependency *dependencies, int numDeps, void *instanceData, VSCore *core) {
+   VSNode *node = createVideoFilter2(name, vi, getFrame, free, filterMode, dependencies, numDeps, instanceData, core);
+
+   mapConsumeNode(out, "clip", node, maAppend);
+}
+
+
+static void VS_CC freeNode(VSNode *node) {
+   if (!node || --node->refs)
+      return;
+
+   if (node->free)
+      node->free(node->instance, &mock_core, &mock_api);
+
+   free(node);
+   nodes_alive--;
+}
+
+
+static VSNode *VS_CC addNodeRef(VSNode *node) {
+   node->refs++;
+
+   return node;
+}
+
+
+static const VSVideoInfo *VS_CC getVideoInfo(VSNode *node) {
+   return &node->vi;
+}
+
+
+// Requesting and making frames
+
+
+static const VSFrame *makeFrame(VSNode *node, int n, char **error);
+
+
+static void VS_CC requestFrameFilter(int n, VSNode *node, VSFrameContext *frameCtx) {
+   if (n < 0 || n >= node->vi.numFrames) {
+      fprintf(stderr, "mockvs: frame %d of %s was requested, but it has %d frames.\n", n, node->name, node->vi.numFrames);
+      abort();
+   }
+
+   frameCtx->requests = realloc(frameCtx->requests, (frameCtx->num_requests + 1) * sizeof(FrameRequest));
+   frameCtx->requests[frameCtx->num_requests++] = (FrameRequest){ node, n, NULL };
+}
+
+
+static const VSFrame *VS_CC getFrameFilter(int n, VSNode *node, VSFrameContext *frameCtx) {
+   for (int i = 0; i < frameCtx->num_requests; i++) {
+      const FrameRequest *request = &frameCtx->requests[i];
+
+      if (request->node == node && request->n == n && request->frame)
+         return addFrameRef(request->frame);
+   }
+
+   fprintf(stderr, "mockvs: frame %d of %s was used without being requested.\n", n, node->name);
+   abort();
+}
+
+
+static void VS_CC setFilterError(const char *errorMessage, VSFrameContext *frameCtx) {
+   free(frameCtx->error);
+   frameCtx->error = duplicateString(errorMessage);
+}
+
+
+// Calls getFrame until the frame is made, making the frames it requests in
+// between. Returns NULL and sets *error, which must be freed, if it failed.
+static const VSFrame *makeFrame(VSNode *node, int n, char **error) {
+   VSFrameContext context = { NULL, 0, NULL };
+   void *frame_data = NULL;
+   int ready = 0;
+
+   node->frames_made++;
+
+   const VSFrame *frame = node->getFrame(n, arInitial, node->instance, &frame_data, &context, &mock_core, &mock_api);
+
+   while (!frame && !context.error) {
+      if (ready == context.num_requests) {
+         context.error = duplicateString("mockvs: The filter returned no frame and requested none.");
+         break;
+      }
+
+      // Requests made while these are made are handled in the next round.
+      int requested = context.num_requests;
+
+      for (int i = ready; i < requested && !context.error; i++)
+         context.requests[i].frame = makeFrame(context.requests[i].node, context.requests[i].n, &context.error);
+
+      ready = requested;
+
+      if (!context.error)
+         frame = node->getFrame(n, arAllFramesReady, node->instance, &frame_data, &context, &mock_core, &mock_api);
+   }
+
+   if (context.error) {
+      // The filter can free its frame data.
+      if (ready)
+         node->getFrame(n, arError, node->instance, &frame_data, &context, &mock_core, &mock_api);
+
+      freeFrame(frame);
+      frame = NULL;
+   }
+
+   for (int i = 0; i < context.num_requests; i++)
+      freeFrame(context.requests[i].frame);
+   free(context.requests);
+
+   *error = context.error;
+
+   return frame;
+}
+
+
+// Plugins
+
+
+static VSPlugin *VS_CC getPluginByID(const char *identifier, VSCore *core) {
+   return strcmp(identifier, core->bifrost.id) ? NULL : &core->bifrost;
+}
+
+
+static VSMap *VS_CC invoke(VSPlugin *plugin, const char *name, const VSMap *args) {
+   VSMap *out = createMap();
+
+   for (int i = 0; i < plugin->num_functions; i++) {
+      if (!strcmp(plugin->functions[i].name, name)) {
+         plugin->functions[i].function(args, out, plugin->functions[i].data, &mock_core, &mock_api);
+         return out;
+      }
+   }
+
+   mapSetError(out, "mockvs: No such function.");
+
+   return out;
+}
+
+
+static void VS_CC logMessage(int msgType, const char *msg, VSCore *core) {
+   fprintf(stderr, "%s\n", msg);
+}
+
+
+static int VS_CC configPlugin(const char *identifier, const char *pluginNamespace, const char *name, int pluginVersion,
+                              int apiVersion, int flags, VSPlugin *plugin) {
+   plugin->id = identifier;
+
+   return 1;
+}
+
+
+static int VS_CC registerFunction(const char *name, const char *args, const char *returnType, VSPublicFunction argsFunc,
+                                  void *functionData, VSPlugin *plugin) {
+   plugin->functions[plugin->num_functions++] = (PluginFunction){ name, argsFunc, functionData };
+
+   return 1;
+}
+
+
+static const VSAPI mock_api = {
+   .createVideoFilter = createVideoFilter,
+   .createVideoFilter2 = createVideoFilter2,
+   .freeNode = freeNode,
+   .addNodeRef = addNodeRef,
+   .getVideoInfo = getVideoInfo,
+   .newVideoFrame = newVideoFrame,
+   .newVideoFrame2 = newVideoFrame2,
+   .freeFrame = freeFrame,
+   .addFrameRef = addFrameRef,
+   .copyFrame = copyFrame,
+   .getFramePropertiesRO = getFramePropertiesRO,
+   .getFramePropertiesRW = getFramePropertiesRW,
+   .getStride = getStride,
+   .getReadPtr = getReadPtr,
+   .getWritePtr = getWritePtr,
+   .getVideoFrameFormat = getVideoFrameFormat,
+   .getFrameWidth = getFrameWidth,
+   .getFrameHeight = getFrameHeight,
+   .queryVideoFormat = queryVideoFormat,
+   .getFrameFilter = getFrameFilter,
+   .requestFrameFilter = requestFrameFilter,
+   .setFilterError = setFilterError,
+   .createMap = createMap,
+   .freeMap = freeMap,
+   .clearMap = clearMap,
+   .copyMap = copyMap,
+   .mapSetError = mapSetError,
+   .mapGetError = mapGetError,
+   .mapDeleteKey = mapDeleteKey,
+   .mapNumElements = mapNumElements,
+   .mapGetInt = mapGetInt,
+   .mapGetIntSaturated = mapGetIntSaturated,
+   .mapGetIntArray = mapGetIntArray,
+   .mapSetInt = mapSetInt,
+   .mapSetIntArray = mapSetIntArray,
+   .mapGetFloat = mapGetFloat,
+   .mapGetFloatSaturated = mapGetFloatSaturated,
+   .mapSetFloat = mapSetFloat,
+   .mapGetData = mapGetData,
+   .mapGetDataSize = mapGetDataSize,
+   .mapSetData = mapSetData,
+   .mapGetNode = mapGetNode,
+   .mapSetNode = mapSetNode,
+   .mapConsumeNode = mapConsumeNode,
+   .getPluginByID = getPluginByID,
+   .invoke = invoke,
+   .logMessage = logMessage,
+};
+
+
+static const VSPLUGINAPI mock_plugin_api = {
+   .configPlugin = configPlugin,
+   .registerFunction = registerFunction,
+};
+
+
+VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI *vspapi);
+
+
+const VSAPI *mockInit(void) {
+   memset(&mock_core, 0, sizeof(mock_core));
+
+   VapourSynthPluginInit2(&mock_core.bifrost, &mock_plugin_api);
+
+   return &mock_api;
+}
+
+
+VSCore *mockCore(void) {
+   return &mock_core;
+}
+
+
+VSPlugin *mockBifrostPlugin(void) {
+   return &mock_core.bifrost;
+}
+
+
+typedef struct {
+   const VSFrame **frames;
+   int num_frames;
+} ClipData;
+
+
+static const VSFrame *VS_CC clipGetFrame(int n, int activationReason, void *instanceData, void **frameData,
+                                         VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+   const ClipData *d = (const ClipData *)instanceData;
+
+   return activationReason == arInitial ? addFrameRef(d->frames[n]) : NULL;
+}
+
+
+static void VS_CC clipFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+   ClipData *d = (ClipData *)instanceData;
+
+   for (int i = 0; i < d->num_frames; i++)
+      freeFrame(d->frames[i]);
+
+   free(d->frames);
+   free(d);
+}
+
+
+VSNode *mockCreateClip(const VSVideoInfo *vi, const VSFrame **frames) {
+   ClipData *d = malloc(sizeof(ClipData));
+
+   d->num_frames = vi->numFrames;
+   d->frames = malloc(vi->numFrames * sizeof(VSFrame *));
+
+   for (int i = 0; i < vi->numFrames; i++)
+      d->frames[i] = addFrameRef(frames[i]);
+
+   return createVideoFilter2("Clip", vi, clipGetFrame, clipFree, fmParallel, NULL, 0, d, &mock_core);
+}
+
+
+const VSFrame *mockGetFrame(VSNode *node, int n, const char **error) {
+   static char *last_error = NULL;
+
+   free(last_error);
+   last_error = NULL;
+
+   const VSFrame *frame = makeFrame(node, n, &last_error);
+
+   *error = last_error;
+
+   return frame;
+}
+
+
+int mockFramesMade(VSNode *node) {
+   return node->frames_made;
+}
+
+
+int mockFramesAlive(void) {
+   return frames_alive;
+}
+
+
+int mockNodesAlive(void) {
+   return nodes_alive;
+}
@@ -0,0 +1,39 @@
+#ifndef BIFROST_MOCKVS_H
+#define BIFROST_MOCKVS_H
+
+#include <vapoursynth/VapourSynth4.h>
+
+
+// A small stand-in for the VapourSynth core, with just enough of the API for
+// the plugin. It lets the tests drive bifrost.c without a VapourSynth
+// installation that can load plugins.
+//
+// Frames are made synchronously, on the calling thread, and nothing is
+// cached: every request of a frame calls the getFrame function of its node
+// again. If a filter fails, or a frame it requested failed, the frame it was
+// making fails with the same error.
+
+
+// Makes the core and registers the plugin. Returns the API the plugin gets.
+const VSAPI *mockInit(void);
+
+VSCore *mockCore(void);
+
+VSPlugin *mockBifrostPlugin(void);
+
+// A clip whose frame n is a new reference to frames[n]. Takes a reference
+// to every frame.
+VSNode *mockCreateClip(const VSVideoInfo *vi, const VSFrame **frames);
+
+// Makes frame n of node. Returns NULL and sets *error if it failed.
+const VSFrame *mockGetFrame(VSNode *node, int n, const char **error);
+
+// How many times a frame was made by node, e.g. because another node requested it.
+int mockFramesMade(VSNode *node);
+
+// The frames and nodes that haven't been freed, to find missing and extra frees.
+int mockFramesAlive(void);
+int mockNodesAlive(void);
+
+
+#endif // BIFROST_MOCKVS_H
@@ -0,0 +1,90 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "bifrost_profile.h"
+
+
+const char *const profile_stage_names[psStages] = {
+   "Classify",
+   "MakeMask",
+   "ProcessMask",
+   "Blend",
+   "Spatial",
+   "Copy",
+   "BlockDiff"
+};
+
+
+int64_t profileClock(void) {
+#if defined(_WIN32)
+   LARGE_INTEGER frequency, counter;
+   QueryPerformanceFrequency(&frequency);
+   QueryPerformanceCounter(&counter);
+
+   return (int64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000 +
+          (int64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+struct BifrostProfile {
+   pthread_mutex_t lock;
+   int frames;
+   ProfileTimes times;
+};
+
+
+BifrostProfile *profileCreate(void) {
+   BifrostProfile *profile = calloc(1, sizeof(BifrostProfile));
+   pthread_mutex_init(&profile->lock, NULL);
+
+   return profile;
+}
+
+
+void profileFree(BifrostProfile *profile) {
+   if (!profile)
+      return;
+
+   pthread_mutex_destroy(&profile->lock);
+   free(profile);
+}
+
+
+void profileAddFrame(BifrostProfile *profile, const int64_t *times) {
+   pthread_mutex_lock(&profile->lock);
+
+   profile->frames++;
+   for (int i = 0; i < psStages; i++)
+      profile->times[i] += times[i];
+
+   pthread_mutex_unlock(&profile->lock);
+}
+
+
+int profileTotals(BifrostProfile *profile, int64_t *times) {
+   pthread_mutex_lock(&profile->lock);
+
+   int frames = profile->frames;
+   for (int i = 0; i < psStages; i++)
+      times[i] = profile->times[i];
+
+   pthread_mutex_unlock(&profile->lock);
+
+   return frames;
+}
@@ -0,0 +1,60 @@
+#ifndef BIFROST_PROFILE_H
+#define BIFROST_PROFILE_H
+
+#include <stdint.h>
+
+
+enum ProfileStage {
+   psClassify,    // deciding what happens to every block
+   psMakeMask,    // rainbow detection
+   psProcessMask, // denoising and expanding the rainbow mask
+   psBlend,
+   psSpatial,     // spatial smoothing of the blocks that move too much
+   psCopy,        // chroma copied from srcc or altclip
+   psBlockDiff,   // luma differences, in BlockDiff
+   psStages
+};
+
+
+// Used in the names of the frame properties and in the log messages.
+extern const char *const profile_stage_names[psStages];
+
+
+// Monotonic clock, in nanoseconds.
+int64_t profileClock(void);
+
+
+// Time spent in every stage, in nanoseconds. Profiling is disabled when the
+// pointer passed around is NULL, in which case these functions do nothing.
+typedef int64_t ProfileTimes[psStages];
+
+static inline int64_t profileStart(const int64_t *times) {
+   return times ? profileClock() : 0;
+}
+
+// Adds the time since *lap to the stage and starts the next lap.
+static inline void profileLap(int64_t *times, int stage, int64_t *lap) {
+   if (!times)
+      return;
+
+   int64_t now = profileClock();
+   times[stage] += now - *lap;
+   *lap = now;
+}
+
+
+// Totals of every frame produced by one filter instance.
+typedef struct BifrostProfile BifrostProfile;
+
+BifrostProfile *profileCreate(void);
+
+void profileFree(BifrostProfile *profile);
+
+// Can be called from several threads at the same time.
+void profileAddFrame(BifrostProfile *profile, const int64_t *times);
+
+// Returns the number of frames.
+int profileTotals(BifrostProfile *profile, int64_t *times);
+
+
+#endif // BIFROST_PROFILE_H
@@ -0,0 +1,343 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bifrost.h"
+#include "bifrost_reference.h"
+
+
+// The kernels below are those of Bifrost 3.0, unchanged. The rainbow mask is
+// made in dst_u, and denoised and expanded into dst_v.
+
+
+static void applyBlockRainbowMask(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                                  const uint8_t *srcc_u, const uint8_t *srcc_v,
+                                  const uint8_t *srcn_u, const uint8_t *srcn_v,
+                                  uint8_t *restrict dst_u, uint8_t *restrict dst_v,
+                                  int block_width_uv, int block_height_uv, ptrdiff_t stride_uv, int blenddirection) {
+
+   for (int y = 0; y < block_height_uv; y++) {
+      if (blenddirection == bdNext) {
+         for (int x = 0; x < block_width_uv; x++) {
+            if (dst_v[x]) {
+               dst_u[x] = (srcc_u[x]+srcn_u[x]+1) >> 1;
+               dst_v[x] = (srcc_v[x]+srcn_v[x]+1) >> 1;
+            } else {
+               dst_u[x] = srcc_u[x];
+               dst_v[x] = srcc_v[x];
+            }
+         }
+      } else if (blenddirection == bdPrev) {
+         for (int x = 0; x < block_width_uv; x++) {
+            if (dst_v[x]) {
+               dst_u[x] = (srcc_u[x]+srcp_u[x]+1) >> 1;
+               dst_v[x] = (srcc_v[x]+srcp_v[x]+1) >> 1;
+            } else {
+               dst_u[x] = srcc_u[x];
+               dst_v[x] = srcc_v[x];
+            }
+         }
+      } else if (blenddirection == bdBoth) {
+         for (int x = 0; x < block_width_uv; x++) {
+            if (dst_v[x]) {
+               dst_u[x] = (2*srcc_u[x]+srcp_u[x]+srcn_u[x]+3) >> 2;
+               dst_v[x] = (2*srcc_v[x]+srcp_v[x]+srcn_v[x]+3) >> 2;
+            } else {
+               dst_u[x] = srcc_u[x];
+               dst_v[x] = srcc_v[x];
+            }
+         }
+      }
+
+      srcp_u += stride_uv;
+      srcp_v += stride_uv;
+
+      srcc_u += stride_uv;
+      srcc_v += stride_uv;
+
+      srcn_u += stride_uv;
+      srcn_v += stride_uv;
+
+      dst_u += stride_uv;
+      dst_v += stride_uv;
+   }
+}
+
+
+static void processBlockRainbowMask(uint8_t *restrict dst_u, uint8_t *restrict dst_v,
+                                    int block_width_uv, int block_height_uv, ptrdiff_t stride_uv, int conservative_mask) {
+
+   // Maybe needed later.
+   uint8_t *tmp = dst_v;
+
+   //denoise mask, remove marked pixels with no horizontal marked neighbors
+   for (int y = 0; y < block_height_uv; y++) {
+      dst_v[0] = dst_u[0] && dst_u[1];
+      for (int x = 1; x < block_width_uv - 1; x++) {
+         dst_v[x] = dst_u[x] && (dst_u[x-1] || dst_u[x+1]);
+      }
+      dst_v[block_width_uv - 1] = dst_u[block_width_uv - 1] && dst_u[block_width_uv - 2];
+
+      dst_u += stride_uv;
+      dst_v += stride_uv;
+   }
+
+   //expand mask vertically
+   if (!conservative_mask) {
+      dst_v = tmp;
+
+      for (int x = 0; x < block_width_uv; x++) {
+         dst_v[x] = dst_v[x] || dst_v[x + stride_uv];
+      }
+
+      dst_v += stride_uv;
+
+      for (int y = 1; y < block_height_uv - 1; y++) {
+         for (int x = 0; x < block_width_uv; x++) {
+            dst_v[x] = dst_v[x] || (dst_v[x + stride_uv] && dst_v[x - stride_uv]);
+         }
+
+         dst_v += stride_uv;
+      }
+
+      for (int x = 0; x < block_width_uv; x++) {
+         dst_v[x] = dst_v[x] || dst_v[x - stride_uv];
+      }
+   }
+}
+
+
+static void makeBlockRainbowMask(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                                 const uint8_t *srcc_u, const uint8_t *srcc_v,
+                                 const uint8_t *srcn_u, const uint8_t *srcn_v,
+                                 uint8_t *restrict dst_u, uint8_t *restrict dst_v,
+                                 int block_width_uv, int block_height_uv, ptrdiff_t stride_uv, int variation) {
+
+   for (int y = 0; y < block_height_uv; y++) {
+      for (int x = 0; x < block_width_uv; x++) {
+         uint8_t up = srcp_u[x];
+         uint8_t uc = srcc_u[x];
+         uint8_t un = srcn_u[x];
+
+         uint8_t vp = srcp_v[x];
+         uint8_t vc = srcc_v[x];
+         uint8_t vn = srcn_v[x];
+
+         int ucup = uc-up;
+         int ucun = uc-un;
+
+         int vcvp = vc-vp;
+         int vcvn = vc-vn;
+
+         dst_u[x] = ((( ucup+variation) & ( ucun+variation)) < 0)
+                 || (((-ucup+variation) & (-ucun+variation)) < 0)
+                 || ((( vcvp+variation) & ( vcvn+variation)) < 0)
+                 || (((-vcvp+variation) & (-vcvn+variation)) < 0);
+      }
+
+      srcp_u += stride_uv;
+      srcp_v += stride_uv;
+
+      srcc_u += stride_uv;
+      srcc_v += stride_uv;
+
+      srcn_u += stride_uv;
+      srcn_v += stride_uv;
+
+      dst_u += stride_uv;
+      dst_v += stride_uv;
+   }
+}
+
+
+static void copyChromaBlock(uint8_t *restrict dst_u, uint8_t *restrict dst_v,
+                      const uint8_t *src_u, const uint8_t *src_v,
+                      int block_width_uv, int block_height_uv, ptrdiff_t stride_uv) {
+
+   for (int y = 0; y < block_height_uv; y++) {
+      memcpy(dst_u, src_u, block_width_uv);
+      memcpy(dst_v, src_v, block_width_uv);
+
+      dst_u += stride_uv;
+      dst_v += stride_uv;
+      src_u += stride_uv;
+      src_v += stride_uv;
+   }
+}
+
+
+static int blockLumaDiff(const uint8_t *src1_y, const uint8_t *src2_y, int block_width, int block_height, ptrdiff_t stride_y) {
+   int diff = 0;
+
+   for (int y = 0; y < block_height; y++) {
+      for (int x = 0; x < block_width; x++) {
+         diff += abs(src1_y[x] - src2_y[x]);
+      }
+
+      src1_y += stride_y;
+      src2_y += stride_y;
+   }
+
+   return diff;
+}
+
+
+void referenceBlockDiffs(const uint8_t *srcc_y, const uint8_t *srcn_y, ptrdiff_t stride_y,
+                         int blocks_x, int blocks_y, int block_width, int block_height, int *diffs) {
+
+   for (int y = 0; y < blocks_y; y++) {
+      for (int x = 0; x < blocks_x; x++) {
+         diffs[y*blocks_x+x] = blockLumaDiff(srcc_y + block_width*x, srcn_y + block_width*x, block_width, block_height, stride_y);
+      }
+
+      srcc_y += block_height * stride_y;
+      srcn_y += block_height * stride_y;
+   }
+}
+
+
+static int64_t countMarked(const uint8_t *mask, int block_width_uv, int block_height_uv, ptrdiff_t stride_uv) {
+   int64_t count = 0;
+
+   for (int y = 0; y < block_height_uv; y++)
+      for (int x = 0; x < block_width_uv; x++)
+         count += !!mask[y * stride_uv + x];
+
+   return count;
+}
+
+
+// The body of bifrostGetFrame of Bifrost 3.0, which also records what it decided.
+void referenceProcess(const ReferenceInput *input, uint8_t *dst_u, uint8_t *dst_v,
+                      int blocks_x, int blocks_y, int block_width_uv, int block_height_uv,
+                      float luma_thresh, int variation, int conservative_mask,
+                      uint8_t *decisions, int64_t *rainbow_pixels) {
+
+   const float relativeframediff = 1.2f;
+
+   const uint8_t *srcpp_u = input->src_u[0];
+   const uint8_t *srcpp_v = input->src_v[0];
+   const uint8_t *srcp_u = input->src_u[1];
+   const uint8_t *srcp_v = input->src_v[1];
+   const uint8_t *srcc_u = input->src_u[2];
+   const uint8_t *srcc_v = input->src_v[2];
+   const uint8_t *srcn_u = input->src_u[3];
+   const uint8_t *srcn_v = input->src_v[3];
+   const uint8_t *srcnn_u = input->src_u[4];
+   const uint8_t *srcnn_v = input->src_v[4];
+   const uint8_t *altsrcc_u = input->alt_u;
+   const uint8_t *altsrcc_v = input->alt_v;
+
+   const int *srcpp_diffs = input->diffs[0];
+   const int *srcp_diffs = input->diffs[1];
+   const int *srcc_diffs = input->diffs[2];
+   const int *srcn_diffs = input->diffs[3];
+
+   ptrdiff_t stride_uv = input->stride_uv;
+
+   *rainbow_pixels = 0;
+
+   for (int y = 0; y < blocks_y; y++) {
+      for (int x = 0; x < blocks_x; x++) {
+         int current_block = y*blocks_x + x;
+         float ldprev = srcp_diffs[current_block];
+         float ldnext = srcc_diffs[current_block];
+         float ldprevprev = 0.0f;
+         float ldnextnext = 0.0f;
+
+         //too much movement in both directions?
+         if (ldnext > luma_thresh && ldprev > luma_thresh) {
+            copyChromaBlock(dst_u + block_width_uv*x, dst_v + block_width_uv*x,
+                            altsrcc_u + block_width_uv*x, altsrcc_v + block_width_uv*x,
+                            block_width_uv, block_height_uv, stride_uv);
+            decisions[current_block] = msAltClip;
+            continue;
+         }
+
+         if (ldnext > luma_thresh) {
+            ldprevprev = srcpp_diffs[current_block];
+         } else if (ldprev > luma_thresh) {
+            ldnextnext = srcn_diffs[current_block];
+         }
+
+         //two consecutive frames in one direction to generate mask?
+         if ((ldnext > luma_thresh && ldprevprev > luma_thresh) ||
+             (ldprev > luma_thresh && ldnextnext > luma_thresh)) {
+            copyChromaBlock(dst_u + block_width_uv*x, dst_v + block_width_uv*x,
+                            altsrcc_u + block_width_uv*x, altsrcc_v + block_width_uv*x,
+                            block_width_uv, block_height_uv, stride_uv);
+            decisions[current_block] = msAltClip;
+            continue;
+         }
+
+         int source;
+
+         //generate mask from correct side of scenechange
+         if (ldnext > luma_thresh) {
+            makeBlockRainbowMask(srcpp_u + block_width_uv*x, srcpp_v + block_width_uv*x,
+                                  srcp_u + block_width_uv*x,  srcp_v + block_width_uv*x,
+                                  srcc_u + block_width_uv*x,  srcc_v + block_width_uv*x,
+                                   dst_u + block_width_uv*x,   dst_v + block_width_uv*x,
+                                 block_width_uv, block_height_uv, stride_uv, variation);
+            source = msPrev;
+         } else if (ldprev > luma_thresh) {
+            makeBlockRainbowMask( srcc_u + block_width_uv*x,  srcc_v + block_width_uv*x,
+                                  srcn_u + block_width_uv*x,  srcn_v + block_width_uv*x,
+                                 srcnn_u + block_width_uv*x, srcnn_v + block_width_uv*x,
+                                   dst_u + block_width_uv*x,   dst_v + block_width_uv*x,
+                                 block_width_uv, block_height_uv, stride_uv, variation);
+            source = msNext;
+         } else {
+            makeBlockRainbowMask(srcp_u + block_width_uv*x, srcp_v + block_width_uv*x,
+                                 srcc_u + block_width_uv*x, srcc_v + block_width_uv*x,
+                                 srcn_u + block_width_uv*x, srcn_v + block_width_uv*x,
+                                  dst_u + block_width_uv*x,  dst_v + block_width_uv*x,
+                                 block_width_uv, block_height_uv, stride_uv, variation);
+            source = msCurrent;
+         }
+
+         //denoise and expand mask
+         processBlockRainbowMask(dst_u + block_width_uv*x, dst_v + block_width_uv*x,
+                                 block_width_uv, block_height_uv, stride_uv, conservative_mask);
+
+         *rainbow_pixels += countMarked(dst_v + block_width_uv*x, block_width_uv, block_height_uv, stride_uv);
+
+         //determine direction to blend in
+         int direction;
+         if (ldprev > ldnext*relativeframediff) {
+            direction = bdNext;
+         } else if (ldnext > ldprev*relativeframediff) {
+            direction = bdPrev;
+         } else {
+            direction = bdBoth;
+         }
+         applyBlockRainbowMask(srcp_u + block_width_uv*x, srcp_v + block_width_uv*x,
+                               srcc_u + block_width_uv*x, srcc_v + block_width_uv*x,
+                               srcn_u + block_width_uv*x, srcn_v + block_width_uv*x,
+                                dst_u + block_width_uv*x,  dst_v + block_width_uv*x,
+                               block_width_uv, block_height_uv, stride_uv, direction);
+
+         decisions[current_block] = source | (direction << 2);
+      }
+
+      srcpp_u += block_height_uv * stride_uv;
+      srcpp_v += block_height_uv * stride_uv;
+
+      srcp_u += block_height_uv * stride_uv;
+      srcp_v += block_height_uv * stride_uv;
+
+      srcc_u += block_height_uv * stride_uv;
+      srcc_v += block_height_uv * stride_uv;
+
+      srcn_u += block_height_uv * stride_uv;
+      srcn_v += block_height_uv * stride_uv;
+
+      srcnn_u += block_height_uv * stride_uv;
+      srcnn_v += block_height_uv * stride_uv;
+
+      altsrcc_u += block_height_uv * stride_uv;
+      altsrcc_v += block_height_uv * stride_uv;
+
+      dst_u += block_height_uv * stride_uv;
+      dst_v += block_height_uv * stride_uv;
+   }
+}
@@ -0,0 +1,48 @@
+#ifndef BIFROST_REFERENCE_H
+#define BIFROST_REFERENCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// The scalar code of Bifrost 3.0, before any of the optimisations, kept as
+// the reference the tests compare the output with. It only handles 8 bit
+// clips and the blocks that fit entirely in the picture, without roi,
+// decimation or spatial. Interlaced clips are processed as the pictures
+// SeparateFields makes, by passing the first line of a field and twice the
+// stride.
+
+
+// Computes the luma difference of every whole block of a picture and the
+// next one. diffs gets blocks_x * blocks_y values, without any padding.
+void referenceBlockDiffs(const uint8_t *srcc_y, const uint8_t *srcn_y, ptrdiff_t stride_y,
+                         int blocks_x, int blocks_y, int block_width, int block_height, int *diffs);
+
+
+typedef struct {
+   // The chroma of pictures n-2 to n+2, clamped to the first and the last one.
+   const uint8_t *src_u[5];
+   const uint8_t *src_v[5];
+
+   // The differences computed by referenceBlockDiffs for pictures n-2 to n+1.
+   const int *diffs[4];
+
+   // The chroma of picture n of altclip, or that of the source.
+   const uint8_t *alt_u;
+   const uint8_t *alt_v;
+
+   ptrdiff_t stride_uv; // of every plane, including dst
+} ReferenceInput;
+
+
+// Writes the chroma of the whole blocks of picture n. luma_thresh is already
+// multiplied by the area of a block. decisions gets the same codes as the
+// BifrostDecisions frame property, and *rainbow_pixels the number of samples
+// the denoised and expanded masks mark.
+void referenceProcess(const ReferenceInput *input, uint8_t *dst_u, uint8_t *dst_v,
+                      int blocks_x, int blocks_y, int block_width_uv, int block_height_uv,
+                      float luma_thresh, int variation, int conservative_mask,
+                      uint8_t *decisions, int64_t *rainbow_pixels);
+
+
+#endif // BIFROST_REFERENCE_H
@@ -0,0 +1,662 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <emmintrin.h>
+
+#include "bifrost.h"
+
+
+// block_width must be a multiple of 4.
+void blockLumaDiffRow_sse2(const uint8_t *src1_y, const uint8_t *src2_y, int *diffs,
+                           int blocks_x, int block_width, int block_height, ptrdiff_t stride_y) {
+   int width = blocks_x * block_width;
+   int width_simd = width & ~15;
+
+   for (int x = 0; x < blocks_x; x++)
+      diffs[x] = 0;
+
+   if (block_width % 8 == 0) {
+      for (int x = 0; x < width_simd; x += 16) {
+         __m128i sum = _mm_setzero_si128();
+
+         for (int y = 0; y < block_height; y++) {
+            __m128i a = _mm_loadu_si128((const __m128i *)&src1_y[y * stride_y + x]);
+            __m128i b = _mm_loadu_si128((const __m128i *)&src2_y[y * stride_y + x]);
+            sum = _mm_add_epi64(sum, _mm_sad_epu8(a, b));
+         }
+
+         diffs[x / block_width] += _mm_cvtsi128_si32(sum);
+         diffs[(x + 8) / block_width] += _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+      }
+   } else {
+      const __m128i zero = _mm_setzero_si128();
+      const __m128i low_dwords = _mm_set_epi32(0, -1, 0, -1);
+
+      for (int x = 0; x < width_simd; x += 16) {
+         __m128i sum_low = _mm_setzero_si128();
+         __m128i sum_high = _mm_setzero_si128();
+
+         for (int y = 0; y < block_height; y++) {
+            __m128i a = _mm_loadu_si128((const __m128i *)&src1_y[y * stride_y + x]);
+            __m128i b = _mm_loadu_si128((const __m128i *)&src2_y[y * stride_y + x]);
+            __m128i absdiff = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+
+            // psadbw sums groups of 8 bytes, so mask out half of each group to get sums of 4 bytes.
+            sum_low = _mm_add_epi64(sum_low, _mm_sad_epu8(_mm_and_si128(absdiff, low_dwords), zero));
+            sum_high = _mm_add_epi64(sum_high, _mm_sad_epu8(_mm_andnot_si128(low_dwords, absdiff), zero));
+         }
+
+         int sums[4];
+         _mm_storeu_si128((__m128i *)sums, _mm_or_si128(sum_low, _mm_slli_epi64(sum_high, 32)));
+
+         for (int i = 0; i < 4; i++)
+            diffs[(x + 4 * i) / block_width] += sums[i];
+      }
+   }
+
+   for (int x = width_simd; x < width; x++) {
+      int diff = 0;
+
+      for (int y = 0; y < block_height; y++)
+         diff += abs(src1_y[y * stride_y + x] - src2_y[y * stride_y + x]);
+
+      diffs[x / block_width] += diff;
+   }
+}
+
+
+static inline __m128i select_si128(__m128i mask, __m128i a, __m128i b) {
+   return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+
+int classifyRow_sse2(const int *srcpp_diffs, const int *srcp_diffs, const int *srcc_diffs, const int *srcn_diffs,
+                     uint8_t *sources, uint8_t *directions, int blocks_x, float luma_thresh, float relativeframediff, int *static_blocks) {
+
+   const __m128 thresh = _mm_set1_ps(luma_thresh);
+   const __m128 relative = _mm_set1_ps(relativeframediff);
+   const __m128i one = _mm_set1_epi32(1);
+   const __m128i two = _mm_set1_epi32(2);
+
+   __m128i alt_count = _mm_setzero_si128();
+   __m128i static_count = _mm_setzero_si128();
+
+   for (int x = 0; x < blocks_x; x += 4) {
+      __m128 ldprevprev = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)&srcpp_diffs[x]));
+      __m128 ldprev = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)&srcp_diffs[x]));
+      __m128 ldnext = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)&srcc_diffs[x]));
+      __m128 ldnextnext = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)&srcn_diffs[x]));
+
+      __m128i prev_moves = _mm_castps_si128(_mm_cmpgt_ps(ldprev, thresh));
+      __m128i next_moves = _mm_castps_si128(_mm_cmpgt_ps(ldnext, thresh));
+
+      __m128i alt = _mm_or_si128(_mm_and_si128(next_moves, _mm_or_si128(prev_moves, _mm_castps_si128(_mm_cmpgt_ps(ldprevprev, thresh)))),
+                                 _mm_and_si128(prev_moves, _mm_castps_si128(_mm_cmpgt_ps(ldnextnext, thresh))));
+
+      __m128i blend_next = _mm_castps_si128(_mm_cmpgt_ps(ldprev, _mm_mul_ps(ldnext, relative)));
+      __m128i blend_prev = _mm_castps_si128(_mm_cmpgt_ps(ldnext, _mm_mul_ps(ldprev, relative)));
+
+      // msPrev if next_moves, otherwise msNext if prev_moves, otherwise msCurrent.
+      __m128i source = _mm_andnot_si128(next_moves, _mm_sub_epi32(one, prev_moves));
+      source = select_si128(alt, _mm_set1_epi32(msAltClip), source);
+
+      // bdNext if blend_next, otherwise bdPrev if blend_prev, otherwise bdBoth.
+      __m128i direction = _mm_andnot_si128(blend_next, _mm_add_epi32(two, blend_prev));
+      direction = select_si128(alt, _mm_set1_epi32(bdBoth), direction);
+
+      alt_count = _mm_sub_epi32(alt_count, alt);
+      static_count = _mm_add_epi32(static_count, _mm_andnot_si128(_mm_or_si128(alt, _mm_or_si128(prev_moves, next_moves)), one));
+
+      source = _mm_packs_epi16(_mm_packs_epi32(source, source), source);
+      direction = _mm_packs_epi16(_mm_packs_epi32(direction, direction), direction);
+
+      int packed = _mm_cvtsi128_si32(source);
+      memcpy(&sources[x], &packed, 4);
+      packed = _mm_cvtsi128_si32(direction);
+      memcpy(&directions[x], &packed, 4);
+   }
+
+   int counts[8];
+   _mm_storeu_si128((__m128i *)&counts[0], alt_count);
+   _mm_storeu_si128((__m128i *)&counts[4], static_count);
+
+   *static_blocks += counts[4] + counts[5] + counts[6] + counts[7];
+
+   return counts[0] + counts[1] + counts[2] + counts[3];
+}
+
+
+// Nonzero where c is smaller or greater than both p and n by more than variation.
+static inline __m128i rainbow_sse2(__m128i p, __m128i c, __m128i n, __m128i variation) {
+   __m128i below = _mm_subs_epu8(_mm_subs_epu8(_mm_min_epu8(p, n), c), variation);
+   __m128i above = _mm_subs_epu8(_mm_subs_epu8(c, _mm_max_epu8(p, n)), variation);
+
+   return _mm_or_si128(below, above);
+}
+
+
+// One bit for each of the 16 samples starting at x, set where there is a rainbow.
+static inline uint64_t rainbowBits_sse2(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                                        const uint8_t *srcc_u, const uint8_t *srcc_v,
+                                        const uint8_t *srcn_u, const uint8_t *srcn_v,
+                                        int x, __m128i variation) {
+
+   __m128i up = _mm_loadu_si128((const __m128i *)&srcp_u[x]);
+   __m128i uc = _mm_loadu_si128((const __m128i *)&srcc_u[x]);
+   __m128i un = _mm_loadu_si128((const __m128i *)&srcn_u[x]);
+
+   __m128i vp = _mm_loadu_si128((const __m128i *)&srcp_v[x]);
+   __m128i vc = _mm_loadu_si128((const __m128i *)&srcc_v[x]);
+   __m128i vn = _mm_loadu_si128((const __m128i *)&srcn_v[x]);
+
+   __m128i rainbow = _mm_or_si128(rainbow_sse2(up, uc, un, variation), rainbow_sse2(vp, vc, vn, variation));
+
+   // Adding 127 sets the top bit of the nonzero bytes.
+   return (uint16_t)_mm_movemask_epi8(_mm_adds_epu8(rainbow, _mm_set1_epi8(127)));
+}
+
+
+void makeRainbowMaskRow_sse2(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                             const uint8_t *srcc_u, const uint8_t *srcc_v,
+                             const uint8_t *srcn_u, const uint8_t *srcn_v,
+                             uint8_t *mask, int mask_x, int width, int height,
+                             ptrdiff_t stride_uv, ptrdiff_t mask_stride, int variation) {
+
+   const __m128i var = _mm_set1_epi8((char)(variation > 255 ? 255 : variation));
+
+   for (int y = 0; y < height; y++) {
+      int x = 0;
+
+      for ( ; x + 64 <= width; x += 64) {
+         uint64_t bits = rainbowBits_sse2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, x, var) |
+                         rainbowBits_sse2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, x + 16, var) << 16 |
+                         rainbowBits_sse2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, x + 32, var) << 32 |
+                         rainbowBits_sse2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, x + 48, var) << 48;
+
+         storeMaskBits(mask, mask_x + x, bits, 64);
+      }
+
+      if (x < width) {
+         // The last vector overlaps the previous one if width isn't a multiple of 16.
+         int i = x;
+         uint64_t bits = 0;
+
+         for ( ; x < width; x += 16) {
+            int j = x < width - 16 ? x : width - 16;
+            bits |= rainbowBits_sse2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, j, var) >> (x - j) << (x - i);
+         }
+
+         storeMaskBits(mask, mask_x + i, bits, width - i);
+      }
+
+      srcp_u += stride_uv;
+      srcp_v += stride_uv;
+
+      srcc_u += stride_uv;
+      srcc_v += stride_uv;
+
+      srcn_u += stride_uv;
+      srcn_v += stride_uv;
+
+      mask += mask_stride;
+   }
+}
+
+
+// 0xff for the samples whose bit of the 16 bits is 0.
+static inline __m128i maskIsZero_sse2(uint32_t bits) {
+   const __m128i bit_values = _mm_set_epi8(-128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+
+   // Each byte of bits is repeated 8 times.
+   __m128i bytes = _mm_cvtsi32_si128((int)bits);
+   bytes = _mm_unpacklo_epi8(bytes, bytes);
+   bytes = _mm_unpacklo_epi16(bytes, bytes);
+   bytes = _mm_unpacklo_epi32(bytes, bytes);
+
+   return _mm_cmpeq_epi8(_mm_and_si128(bytes, bit_values), _mm_setzero_si128());
+}
+
+
+static inline __m128i blend_sse2(__m128i p, __m128i c, __m128i n, __m128i mask_is_zero, __m128i is_next, __m128i is_prev) {
+   // (2*c + p + n + 3) >> 2 is equal to avg(c, avg(p, n)).
+   __m128i blended = _mm_avg_epu8(c, _mm_avg_epu8(p, n));
+   blended = select_si128(is_next, _mm_avg_epu8(c, n), blended);
+   blended = select_si128(is_prev, _mm_avg_epu8(c, p), blended);
+
+   return select_si128(mask_is_zero, c, blended);
+}
+
+
+static inline void applyRainbowMask_sse2(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                                         const uint8_t *srcc_u, const uint8_t *srcc_v,
+                                         const uint8_t *srcn_u, const uint8_t *srcn_v,
+                                         uint32_t mask_bits, const uint8_t *directions,
+                                         __m128i *result_u, __m128i *result_v) {
+
+   __m128i dirs = _mm_loadu_si128((const __m128i *)directions);
+   __m128i is_next = _mm_cmpeq_epi8(dirs, _mm_set1_epi8(bdNext));
+   __m128i is_prev = _mm_cmpeq_epi8(dirs, _mm_set1_epi8(bdPrev));
+   __m128i mask_is_zero = maskIsZero_sse2(mask_bits);
+
+   *result_u = blend_sse2(_mm_loadu_si128((const __m128i *)srcp_u),
+                          _mm_loadu_si128((const __m128i *)srcc_u),
+                          _mm_loadu_si128((const __m128i *)srcn_u),
+                          mask_is_zero, is_next, is_prev);
+   *result_v = blend_sse2(_mm_loadu_si128((const __m128i *)srcp_v),
+                          _mm_loadu_si128((const __m128i *)srcc_v),
+                          _mm_loadu_si128((const __m128i *)srcn_v),
+                          mask_is_zero, is_next, is_prev);
+}
+
+
+void applyRainbowMaskRow_sse2(const uint8_t *srcp_u, const uint8_t *srcp_v,
+                              const uint8_t *srcc_u, const uint8_t *srcc_v,
+                              const uint8_t *srcn_u, const uint8_t *srcn_v,
+                              const uint8_t *mask, int mask_x, uint8_t *dst_u, uint8_t *dst_v, const uint8_t *directions,
+                              int width, int block_width_uv, int height, ptrdiff_t stride_uv, ptrdiff_t mask_stride) {
+
+   for (int y = 0; y < height; y++) {
+      // The last vector overlaps the previous one if width isn't a multiple of 16.
+      for (int i = 0; i < width; i += 16) {
+         int x = i < width - 16 ? i : width - 16;
+
+         __m128i result_u, result_v;
+
+         applyRainbowMask_sse2(srcp_u + x, srcp_v + x,
+                               srcc_u + x, srcc_v + x,
+                               srcn_u + x, srcn_v + x,
+                               loadMaskBits(mask, mask_x + x), directions + x, &result_u, &result_v);
+
+         _mm_storeu_si128((__m128i *)&dst_u[x], result_u);
+         _mm_storeu_si128((__m128i *)&dst_v[x], result_v);
+      }
+
+      srcp_u += stride_uv;
+      srcp_v += stride_uv;
+
+      srcc_u += stride_uv;
+      srcc_v += stride_uv;
+
+      srcn_u += stride_uv;
+      srcn_v += stride_uv;
+
+      mask += mask_stride;
+
+      dst_u += stride_uv;
+      dst_v += stride_uv;
+   }
+}
+
+
+// 0xff where a - b isn't greater than variation.
+static inline __m128i notGreater_sse2(__m128i a, __m128i b, __m128i variation) {
+   return _mm_cmpeq_epi8(_mm_subs_epu8(_mm_subs_epu8(a, b), variation), _mm_setzero_si128());
+}
+
+
+void chromaDiff_sse2(const uint8_t *src1_u, const uint8_t *src1_v,
+                     const uint8_t *src2_u, const uint8_t *src2_v,
+                     uint8_t *diffs, int width, int height, ptrdiff_t stride_uv, ptrdiff_t diffs_stride, int variation) {
+
+   const __m128i var = _mm_set1_epi8((char)(variation > 255 ? 255 : variation));
+
+   const __m128i u_greater = _mm_set1_epi8(0x21);
+   const __m128i u_smaller = _mm_set1_epi8(0x12);
+   const __m128i v_greater = _mm_set1_epi8((char)0x84);
+   const __m128i v_smaller = _mm_set1_epi8(0x48);
+
+   for (int y = 0; y < height; y++) {
+      // The last vector overlaps the previous one if width isn't a multiple of 16.
+      for (int i = 0; i < width; i += 16) {
+         int x = i < width - 16 ? i : width - 16;
+
+         __m128i u1 = _mm_loadu_si128((const __m128i *)&src1_u[x]);
+         __m128i u2 = _mm_loadu_si128((const __m128i *)&src2_u[x]);
+
+         __m128i v1 = _mm_loadu_si128((const __m128i *)&src1_v[x]);
+         __m128i v2 = _mm_loadu_si128((const __m128i *)&src2_v[x]);
+
+         __m128i bits = _mm_or_si128(_mm_or_si128(_mm_andnot_si128(notGreater_sse2(u1, u2, var), u_greater),
+                                                  _mm_andnot_si128(notGreater_sse2(u2, u1, var), u_smaller)),
+                                     _mm_or_si128(_mm_andnot_si128(notGreater_sse2(v1, v2, var), v_greater),
+                                                  _mm_andnot_si128(notGreater_sse2(v2, v1, var), v_smaller)));
+
+         _mm_storeu_si128((__m128i *)&diffs[x], bits);
+      }
+
+      src1_u += stride_uv;
+      src1_v += stride_uv;
+
+      src2_u += stride_uv;
+      src2_v += stride_uv;
+
+      diffs += diffs_stride;
+   }
+}
+
+
+// One bit for each of the 16 samples starting at x, set where there is a rainbow.
+static inline uint64_t rainbowBitsFromDiffs_sse2(const uint8_t *diffsp, const uint8_t *diffsc, int x) {
+   __m128i p = _mm_loadu_si128((const __m128i *)&diffsp[x]);
+   __m128i c = _mm_loadu_si128((const __m128i *)&diffsc[x]);
+
+   // There is no byte shift, so the bits shifted in from the next byte are masked out.
+   __m128i rainbow = _mm_and_si128(p, _mm_and_si128(_mm_srli_epi16(c, 4), _mm_set1_epi8(0x0f)));
+
+   // Adding 127 sets the top bit of the nonzero bytes.
+   return (uint16_t)_mm_movemask_epi8(_mm_adds_epu8(rainbow, _mm_set1_epi8(127)));
+}
+
+
+void makeRainbowMaskFromDiffsRow_sse2(const uint8_t *diffsp, const uint8_t *diffsc, uint8_t *mask, int mask_x,
+                                      int width, int height, ptrdiff_t diffs_stride, ptrdiff_t mask_stride) {
+
+   for (int y = 0; y < height; y++) {
+      int x = 0;
+
+      for ( ; x + 64 <= width; x += 64) {
+         uint64_t bits = rainbowBitsFromDiffs_sse2(diffsp, diffsc, x) |
+                         rainbowBitsFromDiffs_sse2(diffsp, diffsc, x + 16) << 16 |
+                         rainbowBitsFromDiffs_sse2(diffsp, diffsc, x + 32) << 32 |
+                         rainbowBitsFromDiffs_sse2(diffsp, diffsc, x + 48) << 48;
+
+         storeMaskBits(mask, mask_x + x, bits, 64);
+      }
+
+      if (x < width) {
+         // The last vector overlaps the previous one if width isn't a multiple of 16.
+         int i = x;
+         uint64_t bits = 0;
+
+         for ( ; x < width; x += 16) {
+            int j = x < width - 16 ? x : width - 16;
+            bits |= rainbowBitsFromDiffs_sse2(diffsp, diffsc, j) >> (x - j) << (x - i);
+         }
+
+         storeMaskBits(mask, mask_x + i, bits, width - i);
+      }
+
+      diffsp += diffs_stride;
+      diffsc += diffs_stride;
+
+      mask += mask_stride;
+   }
+}
+
+
+// block_width must be a multiple of 4.
+void blockLumaDiffRow16_sse2(const uint8_t *src1_y8, const uint8_t *src2_y8, int *diffs,
+                             int blocks_x, int block_width, int block_height, ptrdiff_t stride_y) {
+   const uint16_t *src1_y = (const uint16_t *)src1_y8;
+   const uint16_t *src2_y = (const uint16_t *)src2_y8;
+
+   int width = blocks_x * block_width;
+   int width_simd = width & ~7;
+
+   const __m128i zero = _mm_setzero_si128();
+
+   for (int x = 0; x < blocks_x; x++)
+      diffs[x] = 0;
+
+   for (int x = 0; x < width_simd; x += 8) {
+      __m128i sum_low = _mm_setzero_si128();
+      __m128i sum_high = _mm_setzero_si128();
+
+      for (int y = 0; y < block_height; y++) {
+         __m128i a = _mm_loadu_si128((const __m128i *)&src1_y[y * stride_y + x]);
+         __m128i b = _mm_loadu_si128((const __m128i *)&src2_y[y * stride_y + x]);
+         __m128i absdiff = _mm_or_si128(_mm_subs_epu16(a, b), _mm_subs_epu16(b, a));
+
+         sum_low = _mm_add_epi32(sum_low, _mm_unpacklo_epi16(absdiff, zero));
+         sum_high = _mm_add_epi32(sum_high, _mm_unpackhi_epi16(absdiff, zero));
+      }
+
+      // Each half holds four columns, which belong to the same block.
+      int sums[8];
+      _mm_storeu_si128((__m128i *)&sums[0], sum_low);
+      _mm_storeu_si128((__m128i *)&sums[4], sum_high);
+
+      diffs[x / block_width] += sums[0] + sums[1] + sums[2] + sums[3];
+      diffs[(x + 4) / block_width] += sums[4] + sums[5] + sums[6] + sums[7];
+   }
+
+   for (int x = width_simd; x < width; x++) {
+      int diff = 0;
+
+      for (int y = 0; y < block_height; y++)
+         diff += abs(src1_y[y * stride_y + x] - src2_y[y * stride_y + x]);
+
+      diffs[x / block_width] += diff;
+   }
+}
+
+
+// Nonzero where c is smaller or greater than both p and n by more than variation.
+static inline __m128i rainbow16_sse2(__m128i p, __m128i c, __m128i n, __m128i variation) {
+   // SSE2 has no unsigned 16 bit min and max.
+   __m128i p_minus_n = _mm_subs_epu16(p, n);
+   __m128i min = _mm_sub_epi16(p, p_minus_n);
+   __m128i max = _mm_add_epi16(n, p_minus_n);
+
+   __m128i below = _mm_subs_epu16(_mm_subs_epu16(min, c), variation);
+   __m128i above = _mm_subs_epu16(_mm_subs_epu16(c, max), variation);
+
+   return _mm_or_si128(below, above);
+}
+
+
+static inline __m128i makeRainbowMask16_sse2(const uint16_t *srcp_u, const uint16_t *srcp_v,
+                                             const uint16_t *srcc_u, const uint16_t *srcc_v,
+                                             const uint16_t *srcn_u, const uint16_t *srcn_v,
+                                             __m128i variation) {
+
+   __m128i up = _mm_loadu_si128((const __m128i *)srcp_u);
+   __m128i uc = _mm_loadu_si128((const __m128i *)srcc_u);
+   __m128i un = _mm_loadu_si128((const __m128i *)srcn_u);
+
+   __m128i vp = _mm_loadu_si128((const __m128i *)srcp_v);
+   __m128i vc = _mm_loadu_si128((const __m128i *)srcc_v);
+   __m128i vn = _mm_loadu_si128((const __m128i *)srcn_v);
+
+   __m128i mask = _mm_or_si128(rainbow16_sse2(up, uc, un, variation), rainbow16_sse2(vp, vc, vn, variation));
+
+   // 0xffff where there is no rainbow.
+   return _mm_cmpeq_epi16(mask, _mm_setzero_si128());
+}
+
+
+// One bit for each of the 16 samples starting at x, set where there is a rainbow.
+static inline uint64_t rainbowBits16_sse2(const uint16_t *srcp_u, const uint16_t *srcp_v,
+                                          const uint16_t *srcc_u, const uint16_t *srcc_v,
+                                          const uint16_t *srcn_u, const uint16_t *srcn_v,
+                                          int x, __m128i variation) {
+
+   __m128i no_rainbow_low = makeRainbowMask16_sse2(srcp_u + x, srcp_v + x,
+                                                   srcc_u + x, srcc_v + x,
+                                                   srcn_u + x, srcn_v + x, variation);
+   __m128i no_rainbow_high = makeRainbowMask16_sse2(srcp_u + x + 8, srcp_v + x + 8,
+                                                    srcc_u + x + 8, srcc_v + x + 8,
+                                                    srcn_u + x + 8, srcn_v + x + 8, variation);
+
+   return (uint16_t)~_mm_movemask_epi8(_mm_packs_epi16(no_rainbow_low, no_rainbow_high));
+}
+
+
+void makeRainbowMaskRow16_sse2(const uint8_t *srcp_u8, const uint8_t *srcp_v8,
+                               const uint8_t *srcc_u8, const uint8_t *srcc_v8,
+                               const uint8_t *srcn_u8, const uint8_t *srcn_v8,
+                               uint8_t *mask, int mask_x, int width, int height,
+                               ptrdiff_t stride_uv, ptrdiff_t mask_stride, int variation) {
+
+   const uint16_t *srcp_u = (const uint16_t *)srcp_u8;
+   const uint16_t *srcp_v = (const uint16_t *)srcp_v8;
+   const uint16_t *srcc_u = (const uint16_t *)srcc_u8;
+   const uint16_t *srcc_v = (const uint16_t *)srcc_v8;
+   const uint16_t *srcn_u = (const uint16_t *)srcn_u8;
+   const uint16_t *srcn_v = (const uint16_t *)srcn_v8;
+
+   const __m128i var = _mm_set1_epi16((short)(variation > 65535 ? 65535 : variation));
+
+   for (int y = 0; y < height; y++) {
+      int x = 0;
+
+      for ( ; x + 64 <= width; x += 64) {
+         uint64_t bits = rainbowBits16_sse2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, x, var) |
+                         rainbowBits16_sse2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, x + 16, var) << 16 |
+                         rainbowBits16_sse2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, x + 32, var) << 32 |
+                         rainbowBits16_sse2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, x + 48, var) << 48;
+
+         storeMaskBits(mask, mask_x + x, bits, 64);
+      }
+
+      if (x < width) {
+         // The last vector overlaps the previous one if width isn't a multiple of 16.
+         int i = x;
+         uint64_t bits = 0;
+
+         for ( ; x < width; x += 16) {
+            int j = x < width - 16 ? x : width - 16;
+            bits |= rainbowBits16_sse2(srcp_u, srcp_v, srcc_u, srcc_v, srcn_u, srcn_v, j, var) >> (x - j) << (x - i);
+         }
+
+         storeMaskBits(mask, mask_x + i, bits, width - i);
+      }
+
+      srcp_u += stride_uv;
+      srcp_v += stride_uv;
+
+      srcc_u += stride_uv;
+      srcc_v += stride_uv;
+
+      srcn_u += stride_uv;
+      srcn_v += stride_uv;
+
+      mask += mask_stride;
+   }
+}
+
+
+static inline __m128i blend16_sse2(__m128i p, __m128i c, __m128i n, __m128i mask_is_zero, __m128i is_next, __m128i is_prev) {
+   __m128i blended = _mm_avg_epu16(c, _mm_avg_epu16(p, n));
+   blended = select_si128(is_next, _mm_avg_epu16(c, n), blended);
+   blended = select_si128(is_prev, _mm_avg_epu16(c, p), blended);
+
+   return select_si128(mask_is_zero, c, blended);
+}
+
+
+void applyRainbowMaskRow16_sse2(const uint8_t *srcp_u8, const uint8_t *srcp_v8,
+                                const uint8_t *srcc_u8, const uint8_t *srcc_v8,
+                                const uint8_t *srcn_u8, const uint8_t *srcn_v8,
+                                const uint8_t *mask, int mask_x, uint8_t *dst_u8, uint8_t *dst_v8, const uint8_t *directions,
+                                int width, int block_width_uv, int height, ptrdiff_t stride_uv, ptrdiff_t mask_stride) {
+
+   const uint16_t *srcp_u = (const uint16_t *)srcp_u8;
+   const uint16_t *srcp_v = (const uint16_t *)srcp_v8;
+   const uint16_t *srcc_u = (const uint16_t *)srcc_u8;
+   const uint16_t *srcc_v = (const uint16_t *)srcc_v8;
+   const uint16_t *srcn_u = (const uint16_t *)srcn_u8;
+   const uint16_t *srcn_v = (const uint16_t *)srcn_v8;
+   uint16_t *dst_u = (uint16_t *)dst_u8;
+   uint16_t *dst_v = (uint16_t *)dst_v8;
+
+   const __m128i zero = _mm_setzero_si128();
+
+   for (int y = 0; y < height; y++) {
+      // The last vector overlaps the previous one if width isn't a multiple of 16.
+      for (int i = 0; i < width; i += 16) {
+         int x = i < width - 16 ? i : width - 16;
+
+         __m128i dirs = _mm_loadu_si128((const __m128i *)&directions[x]);
+         __m128i mask_is_zero = maskIsZero_sse2(loadMaskBits(mask, mask_x + x));
+
+         // Widen the bytes to 16 bits, eight columns at a time.
+         for (int half = 0; half < 2; half++) {
+            int xx = x + 8 * half;
+
+            __m128i dirs16 = half ? _mm_unpackhi_epi8(dirs, zero) : _mm_unpacklo_epi8(dirs, zero);
+            __m128i is_next = _mm_cmpeq_epi16(dirs16, _mm_set1_epi16(bdNext));
+            __m128i is_prev = _mm_cmpeq_epi16(dirs16, _mm_set1_epi16(bdPrev));
+            __m128i is_zero = half ? _mm_unpackhi_epi8(mask_is_zero, mask_is_zero) : _mm_unpacklo_epi8(mask_is_zero, mask_is_zero);
+
+            __m128i result_u = blend16_sse2(_mm_loadu_si128((const __m128i *)&srcp_u[xx]),
+                                            _mm_loadu_si128((const __m128i *)&srcc_u[xx]),
+                                            _mm_loadu_si128((const __m128i *)&srcn_u[xx]),
+                                            is_zero, is_next, is_prev);
+            __m128i result_v = blend16_sse2(_mm_loadu_si128((const __m128i *)&srcp_v[xx]),
+                                            _mm_loadu_si128((const __m128i *)&srcc_v[xx]),
+                                            _mm_loadu_si128((const __m128i *)&srcn_v[xx]),
+                                            is_zero, is_next, is_prev);
+
+            _mm_storeu_si128((__m128i *)&dst_u[xx], result_u);
+            _mm_storeu_si128((__m128i *)&dst_v[xx], result_v);
+         }
+      }
+
+      srcp_u += stride_uv;
+      srcp_v += stride_uv;
+
+      srcc_u += stride_uv;
+      srcc_v += stride_uv;
+
+      srcn_u += stride_uv;
+      srcn_v += stride_uv;
+
+      mask += mask_stride;
+
+      dst_u += stride_uv;
+      dst_v += stride_uv;
+   }
+}
+
+
+// 0xff where a - b isn't greater than variation, for 16 samples.
+static inline __m128i notGreater16_sse2(const uint16_t *a, const uint16_t *b, __m128i variation) {
+   const __m128i zero = _mm_setzero_si128();
+
+   __m128i low = _mm_subs_epu16(_mm_loadu_si128((const __m128i *)a), _mm_loadu_si128((const __m128i *)b));
+   __m128i high = _mm_subs_epu16(_mm_loadu_si128((const __m128i *)(a + 8)), _mm_loadu_si128((const __m128i *)(b + 8)));
+
+   return _mm_packs_epi16(_mm_cmpeq_epi16(_mm_subs_epu16(low, variation), zero),
+                          _mm_cmpeq_epi16(_mm_subs_epu16(high, variation), zero));
+}
+
+
+void chromaDiff16_sse2(const uint8_t *src1_u8, const uint8_t *src1_v8,
+                       const uint8_t *src2_u8, const uint8_t *src2_v8,
+                       uint8_t *diffs, int width, int height, ptrdiff_t stride_uv, ptrdiff_t diffs_stride, int variation) {
+
+   const uint16_t *src1_u = (const uint16_t *)src1_u8;
+   const uint16_t *src1_v = (const uint16_t *)src1_v8;
+   const uint16_t *src2_u = (const uint16_t *)src2_u8;
+   const uint16_t *src2_v = (const uint16_t *)src2_v8;
+
+   const __m128i var = _mm_set1_epi16((short)(variation > 65535 ? 65535 : variation));
+
+   const __m128i u_greater = _mm_set1_epi8(0x21);
+   const __m128i u_smaller = _mm_set1_epi8(0x12);
+   const __m128i v_greater = _mm_set1_epi8((char)0x84);
+   const __m128i v_smaller = _mm_set1_epi8(0x48);
+
+   for (int y = 0; y < height; y++) {
+      // The last vector overlaps the previous one if width isn't a multiple of 16.
+      for (int i = 0; i < width; i += 16) {
+         int x = i < width - 16 ? i : width - 16;
+
+         __m128i bits = _mm_or_si128(_mm_or_si128(_mm_andnot_si128(notGreater16_sse2(src1_u + x, src2_u + x, var), u_greater),
+                                                  _mm_andnot_si128(notGreater16_sse2(src2_u + x, src1_u + x, var), u_smaller)),
+                                     _mm_or_si128(_mm_andnot_si128(notGreater16_sse2(src1_v + x, src2_v + x, var), v_greater),
+                                                  _mm_andnot_si128(notGreater16_sse2(src2_v + x, src1_v + x, var), v_smaller)));
+
+         _mm_storeu_si128((__m128i *)&diffs[x], bits);
+      }
+
+      src1_u += stride_uv;
+      src1_v += stride_uv;
+
+      src2_u += stride_uv;
+      src2_v += stride_uv;
+
+      diffs += diffs_stride;
+   }
+}
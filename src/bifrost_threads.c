@@ -0,0 +1,190 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "bifrost_threads.h"
+
+
+typedef struct BifrostJob {
+   BandFunction function;
+   void *job_data;
+   int bands;
+   int next_band;
+   int unfinished_bands;
+   struct BifrostJob *next;
+} BifrostJob;
+
+
+struct BifrostThreadPool {
+   pthread_mutex_t lock;
+   pthread_cond_t work_available;
+   pthread_cond_t job_finished;
+
+   // Jobs that still have bands nobody has started.
+   BifrostJob *first_job;
+   BifrostJob *last_job;
+
+   int quit;
+
+   int workers;
+   pthread_t *threads;
+};
+
+
+// Must be called with the lock held. Returns the band that was claimed.
+static int claimBand(BifrostThreadPool *pool, BifrostJob *job) {
+   int band = job->next_band++;
+
+   if (job->next_band == job->bands) {
+      BifrostJob **link = &pool->first_job;
+      BifrostJob *previous = NULL;
+
+      while (*link != job) {
+         previous = *link;
+         link = &(*link)->next;
+      }
+
+      *link = job->next;
+      if (pool->last_job == job)
+         pool->last_job = previous;
+   }
+
+   return band;
+}
+
+
+// Must be called with the lock held.
+static void finishBand(BifrostThreadPool *pool, BifrostJob *job) {
+   job->unfinished_bands--;
+
+   if (!job->unfinished_bands)
+      pthread_cond_broadcast(&pool->job_finished);
+}
+
+
+static void *workerThread(void *arg) {
+   BifrostThreadPool *pool = (BifrostThreadPool *)arg;
+
+   pthread_mutex_lock(&pool->lock);
+
+   while (1) {
+      while (!pool->first_job && !pool->quit)
+         pthread_cond_wait(&pool->work_available, &pool->lock);
+
+      if (pool->quit)
+         break;
+
+      BifrostJob *job = pool->first_job;
+      int band = claimBand(pool, job);
+
+      pthread_mutex_unlock(&pool->lock);
+
+      job->function(job->job_data, band);
+
+      pthread_mutex_lock(&pool->lock);
+
+      finishBand(pool, job);
+   }
+
+   pthread_mutex_unlock(&pool->lock);
+
+   return NULL;
+}
+
+
+BifrostThreadPool *threadPoolCreate(int threads) {
+   if (threads < 2)
+      return NULL;
+
+   BifrostThreadPool *pool = malloc(sizeof(BifrostThreadPool));
+   pool->first_job = NULL;
+   pool->last_job = NULL;
+   pool->quit = 0;
+   pool->workers = 0;
+   pool->threads = malloc((threads - 1) * sizeof(pthread_t));
+
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->work_available, NULL);
+   pthread_cond_init(&pool->job_finished, NULL);
+
+   for (int i = 0; i < threads - 1; i++) {
+      if (pthread_create(&pool->threads[i], NULL, workerThread, pool))
+         break;
+
+      pool->workers++;
+   }
+
+   if (!pool->workers) {
+      threadPoolFree(pool);
+      return NULL;
+   }
+
+   return pool;
+}
+
+
+void threadPoolFree(BifrostThreadPool *pool) {
+   if (!pool)
+      return;
+
+   pthread_mutex_lock(&pool->lock);
+   pool->quit = 1;
+   pthread_cond_broadcast(&pool->work_available);
+   pthread_mutex_unlock(&pool->lock);
+
+   for (int i = 0; i < pool->workers; i++)
+      pthread_join(pool->threads[i], NULL);
+
+   pthread_cond_destroy(&pool->job_finished);
+   pthread_cond_destroy(&pool->work_available);
+   pthread_mutex_destroy(&pool->lock);
+
+   free(pool->threads);
+   free(pool);
+}
+
+
+int threadPoolThreads(const BifrostThreadPool *pool) {
+   return pool ? pool->workers + 1 : 1;
+}
+
+
+void threadPoolRun(BifrostThreadPool *pool, BandFunction function, void *job_data, int bands) {
+   if (!pool || bands < 2) {
+      for (int band = 0; band < bands; band++)
+         function(job_data, band);
+
+      return;
+   }
+
+   BifrostJob job = { function, job_data, bands, 0, bands, NULL };
+
+   pthread_mutex_lock(&pool->lock);
+
+   if (pool->last_job)
+      pool->last_job->next = &job;
+   else
+      pool->first_job = &job;
+   pool->last_job = &job;
+
+   if (bands > 2)
+      pthread_cond_broadcast(&pool->work_available);
+   else
+      pthread_cond_signal(&pool->work_available);
+
+   while (job.next_band < job.bands) {
+      int band = claimBand(pool, &job);
+
+      pthread_mutex_unlock(&pool->lock);
+
+      function(job_data, band);
+
+      pthread_mutex_lock(&pool->lock);
+
+      finishBand(pool, &job);
+   }
+
+   while (job.unfinished_bands)
+      pthread_cond_wait(&pool->job_finished, &pool->lock);
+
+   pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,28 @@
+#ifndef BIFROST_THREADS_H
+#define BIFROST_THREADS_H
+
+
+// Processes one of the bands of a job.
+typedef void (*BandFunction)(void *job_data, int band);
+
+
+typedef struct BifrostThreadPool BifrostThreadPool;
+
+
+// Starts threads - 1 workers, because the calling thread also processes bands.
+// Returns NULL if threads < 2 or if the workers couldn't be started.
+BifrostThreadPool *threadPoolCreate(int threads);
+
+void threadPoolFree(BifrostThreadPool *pool);
+
+// Number of threads that can work on a job, including the calling thread.
+int threadPoolThreads(const BifrostThreadPool *pool);
+
+// Calls function once for every band from 0 to bands - 1 and returns when all of them are done.
+// Several threads can submit jobs at the same time. The calling thread processes bands of its
+// own job while it waits, so a job always makes progress even when the workers are busy.
+// With a NULL pool all the bands are processed by the calling thread.
+void threadPoolRun(BifrostThreadPool *pool, BandFunction function, void *job_data, int bands);
+
+
+#endif // BIFROST_THREADS_H
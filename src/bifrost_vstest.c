@@ -0,0 +1,847 @@
+// bifrost_vstest: runs the filters of the plugin on a short recorded clip,
+// through a small stand-in for VapourSynth, and compares their output with
+// that of the code of Bifrost 3.0.
+//
+// Usage: bifrost_vstest [clip.y4m]
+//
+// The clip must be 8 bit 4:2:0, with a width and a height that are multiples
+// of 8, so that its fields divide into 4x4 blocks and its frames into 8x8.
+// Every case runs with each opt the CPU supports. The luma differences, the
+// chroma, and the frame properties must match the reference, and every frame
+// and node must be freed at the end.
+// The exit status is 1 if anything differs.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vapoursynth/VapourSynth4.h>
+
+#include "bifrost.h"
+#include "bifrost_core.h"
+#include "bifrost_mockvs.h"
+#include "bifrost_reference.h"
+
+
+#ifndef BIFROST_TEST_CLIP
+#define BIFROST_TEST_CLIP "test/rainbow.y4m"
+#endif
+
+#define CACHE_PATH "bifrost_vstest.cache"
+
+
+static const VSAPI *vsapi;
+static int failures;
+
+
+typedef struct {
+   VSVideoInfo vi;
+   const VSFrame **frames;
+} Clip;
+
+
+typedef struct {
+   const char *name;
+
+   int interlaced;
+   int tff;
+   int block_width;
+   int block_height;
+
+   int linear;
+   int altclip;
+   int maskclip;
+   int conservative_mask;
+} Case;
+
+
+static const Case cases[] = {
+   { "progressive",         0, 1, 4, 4, 0, 0, 0, 0 },
+   { "progressive 8x8",     0, 1, 8, 8, 0, 0, 0, 0 },
+   { "interlaced",          1, 1, 4, 4, 0, 0, 0, 0 },
+   { "tff=0",               1, 0, 4, 4, 0, 0, 0, 0 },
+   { "linear",              0, 1, 4, 4, 1, 0, 0, 0 },
+   { "linear interlaced",   1, 1, 4, 4, 1, 0, 0, 0 },
+   { "linear tff=0",        1, 0, 4, 4, 1, 0, 0, 0 },
+   { "altclip",             0, 1, 4, 4, 0, 1, 0, 0 },
+   { "altclip interlaced",  1, 1, 4, 4, 0, 1, 0, 0 },
+   { "maskclip",            1, 1, 4, 4, 0, 0, 1, 0 },
+   { "conservative",        0, 1, 8, 4, 0, 0, 0, 1 },
+};
+
+
+// What the output of Bifrost 3.0 is, for the whole clip.
+typedef struct {
+   int fields;
+   int blocks_x;
+   int blocks_y;
+
+   int *diffs; // blocks_x * blocks_y per picture
+   const VSFrame **frames; // the expected output
+   uint8_t *decisions; // fields * blocks_x * blocks_y per frame
+   int64_t *rainbow_pixels; // per frame
+} Reference;
+
+
+static void fail(const char *test, const char *format, ...) {
+   va_list args;
+   va_start(args, format);
+
+   printf("%s: FAILED: ", test);
+   vprintf(format, args);
+   printf("\n");
+
+   va_end(args);
+
+   failures++;
+}
+
+
+static const char *readLine(FILE *file, char *line, int size) {
+   if (!fgets(line, size, file) || !strchr(line, '\n'))
+      return "bifrost_vstest: The clip is truncated or its header is too long.";
+
+   return NULL;
+}
+
+
+// Reads an 8 bit 4:2:0 Y4M file. Returns an error message, or NULL.
+static const char *readClip(const char *path, Clip *clip) {
+   memset(clip, 0, sizeof(Clip));
+
+   FILE *file = fopen(path, "rb");
+   if (!file)
+      return "bifrost_vstest: Failed to open the clip.";
+
+   char line[256];
+   const char *error = readLine(file, line, sizeof(line));
+
+   if (!error && strncmp(line, "YUV4MPEG2 ", 10))
+      error = "bifrost_vstest: The clip isn't a Y4M file.";
+
+   for (char *token = strtok(line + 10, " \n"); token && !error; token = strtok(NULL, " \n")) {
+      if (token[0] == 'W')
+         clip->vi.width = atoi(token + 1);
+      else if (token[0] == 'H')
+         clip->vi.height = atoi(token + 1);
+      else if (token[0] == 'C' && strncmp(token, "C420", 4))
+         error = "bifrost_vstest: The clip must be 4:2:0 with 8 bits per sample.";
+   }
+
+   if (!error && (clip->vi.width <= 0 || clip->vi.height <= 0))
+      error = "bifrost_vstest: The clip has no width or height.";
+
+   vsapi->queryVideoFormat(&clip->vi.format, cfYUV, stInteger, 8, 1, 1, mockCore());
+   clip->vi.fpsNum = 30000;
+   clip->vi.fpsDen = 1001;
+
+   while (!error && fgets(line, sizeof(line), file)) {
+      if (strncmp(line, "FRAME", 5)) {
+         error = "bifrost_vstest: The clip has something else than a frame.";
+         break;
+      }
+
+      VSFrame *frame = vsapi->newVideoFrame(&clip->vi.format, clip->vi.width, clip->vi.height, NULL, mockCore());
+
+      for (int plane = 0; plane < 3 && !error; plane++) {
+         uint8_t *data = vsapi->getWritePtr(frame, plane);
+
+         for (int y = 0; y < vsapi->getFrameHeight(frame, plane) && !error; y++)
+            if (fread(data + y * vsapi->getStride(frame, plane), 1, vsapi->getFrameWidth(frame, plane), file) != (size_t)vsapi->getFrameWidth(frame, plane))
+               error = "bifrost_vstest: The clip is truncated.";
+      }
+
+      clip->frames = realloc(clip->frames, (clip->vi.numFrames + 1) * sizeof(VSFrame *));
+      clip->frames[clip->vi.numFrames++] = frame;
+   }
+
+   if (!error && clip->vi.numFrames < 5)
+      error = "bifrost_vstest: The clip must have at least 5 frames.";
+
+   fclose(file);
+
+   return error;
+}
+
+
+static void freeFrames(const VSFrame **frames, int num_frames) {
+   for (int i = 0; i < num_frames && frames; i++)
+      vsapi->freeFrame(frames[i]);
+
+   free(frames);
+}
+
+
+// A copy of the clip whose chroma is flat, used as altclip.
+static VSNode *makeAltClip(const Clip *clip, const VSFrame ***alt_frames) {
+   const VSFrame **frames = malloc(clip->vi.numFrames * sizeof(VSFrame *));
+
+   for (int n = 0; n < clip->vi.numFrames; n++) {
+      VSFrame *frame = vsapi->copyFrame(clip->frames[n], mockCore());
+
+      for (int plane = 1; plane < 3; plane++)
+         memset(vsapi->getWritePtr(frame, plane), plane == 1 ? 100 : 150, vsapi->getStride(frame, plane) * vsapi->getFrameHeight(frame, plane));
+
+      frames[n] = frame;
+   }
+
+   *alt_frames = frames;
+
+   return mockCreateClip(&clip->vi, frames);
+}
+
+
+// A gray clip that is zero on the left half, so those blocks must keep their chroma.
+static VSNode *makeMaskClip(const Clip *clip) {
+   VSVideoInfo vi = clip->vi;
+   vsapi->queryVideoFormat(&vi.format, cfGray, stInteger, 8, 0, 0, mockCore());
+
+   VSFrame *frame = vsapi->newVideoFrame(&vi.format, vi.width, vi.height, NULL, mockCore());
+
+   for (int y = 0; y < vi.height; y++) {
+      uint8_t *row = vsapi->getWritePtr(frame, 0) + y * vsapi->getStride(frame, 0);
+
+      memset(row, 0, vi.width / 2);
+      memset(row + vi.width / 2, 255, vi.width - vi.width / 2);
+   }
+
+   const VSFrame **frames = malloc(vi.numFrames * sizeof(VSFrame *));
+   for (int n = 0; n < vi.numFrames; n++)
+      frames[n] = frame;
+
+   VSNode *node = mockCreateClip(&vi, frames);
+
+   free(frames);
+   vsapi->freeFrame(frame);
+
+   return node;
+}
+
+
+// The first line of picture p of a plane. In interlaced mode frame n holds
+// pictures 2n and 2n+1, the first of which is the top field when tff is set.
+static const uint8_t *pictureLine(const VSFrame *frame, int plane, int picture, int fields, int tff) {
+   int row = fields == 1 ? 0 : (picture & 1) ^ !tff;
+
+   return vsapi->getReadPtr(frame, plane) + row * vsapi->getStride(frame, plane);
+}
+
+
+static int clampPicture(int picture, int last_picture) {
+   return picture < 0 ? 0 : (picture > last_picture ? last_picture : picture);
+}
+
+
+// Runs the code of Bifrost 3.0 on the clip, like SeparateFields, BlockDiff,
+// Bifrost, and DoubleWeave did. The blocks left of first_block_x are outside
+// the mask, so they keep their chroma.
+static void makeReference(const Clip *clip, const Case *c, const VSFrame **alt_frames, int first_block_x, Reference *ref) {
+   int frames = clip->vi.numFrames;
+   int fields = c->interlaced ? 2 : 1;
+   int pictures = frames * fields;
+
+   ref->fields = fields;
+   ref->blocks_x = clip->vi.width / c->block_width;
+   ref->blocks_y = clip->vi.height / fields / c->block_height;
+
+   int blocks = ref->blocks_x * ref->blocks_y;
+   int blocks_x = ref->blocks_x - first_block_x; // processed in every row
+   int block_width_uv = c->block_width >> clip->vi.format.subSamplingW;
+   int block_height_uv = c->block_height >> clip->vi.format.subSamplingH;
+
+   // Only the processed blocks are passed to the reference, in rows of blocks_x.
+   ref->diffs = malloc(pictures * blocks * sizeof(int));
+
+   for (int p = 0; p < pictures; p++) {
+      int next = clampPicture(p + fields, pictures - 1);
+
+      referenceBlockDiffs(pictureLine(clip->frames[p / fields], 0, p, fields, c->tff) + first_block_x * c->block_width,
+                          pictureLine(clip->frames[next / fields], 0, next, fields, c->tff) + first_block_x * c->block_width,
+                          vsapi->getStride(clip->frames[0], 0) * fields, blocks_x, ref->blocks_y,
+                          c->block_width, c->block_height, ref->diffs + p * blocks);
+   }
+
+   ref->frames = malloc(frames * sizeof(VSFrame *));
+   ref->decisions = malloc(frames * fields * blocks);
+   ref->rainbow_pixels = calloc(frames, sizeof(int64_t));
+
+   uint8_t *decisions = malloc(blocks);
+
+   for (int n = 0; n < frames; n++) {
+      VSFrame *dst = vsapi->copyFrame(clip->frames[n], mockCore());
+      ptrdiff_t stride_uv = vsapi->getStride(dst, 1);
+
+      for (int field = 0; field < fields; field++) {
+         int p = n * fields + field;
+
+         ReferenceInput input;
+
+         for (int i = 0; i < 5; i++) {
+            int source = clampPicture(p + (i - 2) * fields, pictures - 1);
+
+            input.src_u[i] = pictureLine(clip->frames[source / fields], 1, source, fields, c->tff) + first_block_x * block_width_uv;
+            input.src_v[i] = pictureLine(clip->frames[source / fields], 2, source, fields, c->tff) + first_block_x * block_width_uv;
+
+            if (i < 4)
+               input.diffs[i] = ref->diffs + source * blocks;
+         }
+
+         const VSFrame *alt = alt_frames ? alt_frames[n] : clip->frames[n];
+         input.alt_u = pictureLine(alt, 1, p, fields, c->tff) + first_block_x * block_width_uv;
+         input.alt_v = pictureLine(alt, 2, p, fields, c->tff) + first_block_x * block_width_uv;
+         input.stride_uv = stride_uv * fields;
+
+         ptrdiff_t offset = pictureLine(dst, 1, p, fields, c->tff) - vsapi->getReadPtr(dst, 1) + first_block_x * block_width_uv;
+
+         int64_t rainbow_pixels;
+         referenceProcess(&input, vsapi->getWritePtr(dst, 1) + offset, vsapi->getWritePtr(dst, 2) + offset,
+                          blocks_x, ref->blocks_y, block_width_uv, block_height_uv,
+                          10.0f * c->block_width * c->block_height, 5, c->conservative_mask,
+                          decisions, &rainbow_pixels);
+
+         ref->rainbow_pixels[n] += rainbow_pixels;
+
+         // Back to rows of every block, with 15 for the blocks outside the mask.
+         uint8_t *frame_decisions = ref->decisions + (n * fields + field) * blocks;
+
+         for (int y = 0; y < ref->blocks_y; y++) {
+            memset(frame_decisions + y * ref->blocks_x, 15, first_block_x);
+            memcpy(frame_decisions + y * ref->blocks_x + first_block_x, decisions + y * blocks_x, blocks_x);
+         }
+      }
+
+      ref->frames[n] = dst;
+   }
+
+   free(decisions);
+
+   // The differences of the blocks outside the mask aren't in the right place
+   // for comparing them, so only those of the whole clip are kept.
+   if (first_block_x) {
+      free(ref->diffs);
+      ref->diffs = NULL;
+   }
+}
+
+
+static void freeReference(Reference *ref, int frames) {
+   free(ref->diffs);
+   freeFrames(ref->frames, frames);
+   free(ref->decisions);
+   free(ref->rainbow_pixels);
+}
+
+
+// Returns the node, or NULL after printing the error. Frees args.
+static VSNode *invokeFilter(const char *test, const char *name, VSMap *args, const char **expected_error) {
+   VSMap *ret = vsapi->invoke(mockBifrostPlugin(), name, args);
+   vsapi->freeMap(args);
+
+   const char *error = vsapi->mapGetError(ret);
+   VSNode *node = NULL;
+
+   if (expected_error) {
+      if (!error || !strstr(error, *expected_error))
+         fail(test, "%s should have failed with \"%s\", but returned \"%s\".", name, *expected_error, error ? error : "a clip");
+   } else if (error) {
+      fail(test, "%s failed: %s", name, error);
+   } else {
+      node = vsapi->mapGetNode(ret, "clip", 0, NULL);
+   }
+
+   vsapi->freeMap(ret);
+
+   return node;
+}
+
+
+static int samePlane(const VSFrame *a, const VSFrame *b, int plane) {
+   size_t row_size = (size_t)vsapi->getFrameWidth(a, plane) * vsapi->getVideoFrameFormat(a)->bytesPerSample;
+
+   for (int y = 0; y < vsapi->getFrameHeight(a, plane); y++)
+      if (memcmp(vsapi->getReadPtr(a, plane) + y * vsapi->getStride(a, plane),
+                 vsapi->getReadPtr(b, plane) + y * vsapi->getStride(b, plane), row_size))
+         return 0;
+
+   return 1;
+}
+
+
+static int64_t getIntProp(const VSFrame *frame, const char *key) {
+   int err;
+   int64_t value = vsapi->mapGetInt(vsapi->getFramePropertiesRO(frame), key, 0, &err);
+
+   return err ? -1 : value;
+}
+
+
+// Compares the properties set by stats and decisions with the reference.
+static void checkDecisionProps(const char *test, int n, const VSFrame *frame, const Reference *ref) {
+   int size = ref->fields * ref->blocks_x * ref->blocks_y;
+   const uint8_t *decisions = ref->decisions + n * size;
+
+   int err;
+   const VSMap *props = vsapi->getFramePropertiesRO(frame);
+   const char *map = vsapi->mapGetData(props, "BifrostDecisions", 0, &err);
+
+   if (err || vsapi->mapGetDataSize(props, "BifrostDecisions", 0, NULL) != size || memcmp(map, decisions, size)) {
+      fail(test, "BifrostDecisions of frame %d differs.", n);
+      return;
+   }
+
+   int64_t counts[6] = { 0 };
+   for (int i = 0; i < size; i++) {
+      int decision = decisions[i];
+
+      if (decision == 15) {
+         counts[5]++;
+      } else if (decision == msAltClip) {
+         counts[4]++;
+      } else {
+         counts[0] += (decision & 3) == msCurrent;
+         counts[1 + (decision >> 2)]++;
+      }
+   }
+
+   static const char *const names[6] = {
+      "BifrostStaticBlocks", "BifrostBlendNextBlocks", "BifrostBlendPrevBlocks",
+      "BifrostBlendBothBlocks", "BifrostAltClipBlocks", "BifrostOutsideBlocks"
+   };
+
+   for (int i = 0; i < 6; i++)
+      if (getIntProp(frame, names[i]) != counts[i])
+         fail(test, "%s of frame %d is %lld instead of %lld.", names[i], n, (long long)getIntProp(frame, names[i]), (long long)counts[i]);
+
+   if (getIntProp(frame, "BifrostRainbowPixels") != ref->rainbow_pixels[n])
+      fail(test, "BifrostRainbowPixels of frame %d is %lld instead of %lld.", n,
+           (long long)getIntProp(frame, "BifrostRainbowPixels"), (long long)ref->rainbow_pixels[n]);
+}
+
+
+// Fetches every frame of node and compares it with the reference.
+static void checkBifrostOutput(const char *test, VSNode *node, const Clip *clip, const Reference *ref, int check_props) {
+   for (int n = 0; n < clip->vi.numFrames; n++) {
+      const char *error;
+      const VSFrame *frame = mockGetFrame(node, n, &error);
+
+      if (!frame) {
+         fail(test, "frame %d failed: %s", n, error);
+         return;
+      }
+
+      if (!samePlane(frame, clip->frames[n], 0))
+         fail(test, "the luma of frame %d was changed.", n);
+
+      if (!samePlane(frame, ref->frames[n], 1) || !samePlane(frame, ref->frames[n], 2))
+         fail(test, "the chroma of frame %d differs from the reference.", n);
+
+      if (check_props)
+         checkDecisionProps(test, n, frame, ref);
+
+      vsapi->freeFrame(frame);
+   }
+}
+
+
+// Bifrost on its own, with each opt, checking that altclip is only requested
+// for the frames that have blocks copied from it.
+static void testBifrost(const Clip *clip, const Case *c) {
+   const VSFrame **alt_frames = NULL;
+   VSNode *alt = c->altclip ? makeAltClip(clip, &alt_frames) : NULL;
+
+   int first_block_x = c->maskclip ? clip->vi.width / 2 / c->block_width : 0;
+
+   Reference ref;
+   makeReference(clip, c, alt_frames, first_block_x, &ref);
+
+   int blocks = ref.fields * ref.blocks_x * ref.blocks_y;
+   int alt_frames_needed = 0;
+
+   for (int n = 0; n < clip->vi.numFrames; n++)
+      alt_frames_needed += memchr(ref.decisions + n * blocks, msAltClip, blocks) != NULL;
+
+   for (int opt = 1; opt <= 3; opt++) {
+      int selected = opt;
+      if (bifrostSelectOptLevel(&selected)) {
+         printf("%-20s opt=%d skipped, not supported\n", c->name, opt);
+         continue;
+      }
+
+      char test[80];
+      snprintf(test, sizeof(test), "%s opt=%d", c->name, opt);
+
+      VSMap *args = vsapi->createMap();
+      VSNode *source = mockCreateClip(&clip->vi, clip->frames);
+      vsapi->mapConsumeNode(args, "clip", source, maReplace);
+      vsapi->mapSetInt(args, "interlaced", c->interlaced, maReplace);
+      vsapi->mapSetInt(args, "tff", c->tff, maReplace);
+      vsapi->mapSetInt(args, "blockx", c->block_width, maReplace);
+      vsapi->mapSetInt(args, "blocky", c->block_height, maReplace);
+      vsapi->mapSetInt(args, "linear", c->linear, maReplace);
+      vsapi->mapSetInt(args, "conservative_mask", c->conservative_mask, maReplace);
+      vsapi->mapSetInt(args, "opt", opt, maReplace);
+      vsapi->mapSetInt(args, "threads", 2, maReplace);
+      vsapi->mapSetInt(args, "stats", 1, maReplace);
+      vsapi->mapSetInt(args, "decisions", 1, maReplace);
+      if (alt)
+         vsapi->mapSetNode(args, "altclip", alt, maReplace);
+      if (c->maskclip)
+         vsapi->mapConsumeNode(args, "maskclip", makeMaskClip(clip), maReplace);
+
+      int alt_frames_made = alt ? mockFramesMade(alt) : 0;
+
+      VSNode *node = invokeFilter(test, "Bifrost", args, NULL);
+      if (!node)
+         continue;
+
+      checkBifrostOutput(test, node, clip, &ref, 1);
+
+      if (alt && mockFramesMade(alt) - alt_frames_made != alt_frames_needed)
+         fail(test, "altclip was requested %d times, for %d frames that need it.",
+              mockFramesMade(alt) - alt_frames_made, alt_frames_needed);
+
+      vsapi->freeNode(node);
+   }
+
+   if (alt && (alt_frames_needed == 0 || alt_frames_needed == clip->vi.numFrames))
+      fail(c->name, "the clip should have frames that need altclip and frames that don't.");
+
+   int64_t rainbow_pixels = 0;
+   for (int n = 0; n < clip->vi.numFrames; n++)
+      rainbow_pixels += ref.rainbow_pixels[n];
+
+   printf("%-20s %d frames need altclip, %lld rainbow pixels\n", c->name, alt_frames_needed,
+          (long long)rainbow_pixels);
+
+   freeReference(&ref, clip->vi.numFrames);
+   freeFrames(alt_frames, clip->vi.numFrames);
+   vsapi->freeNode(alt);
+}
+
+
+static VSMap *blockDiffArgs(const Clip *clip, int interlaced, int tff, int gray) {
+   VSMap *args = vsapi->createMap();
+
+   vsapi->mapConsumeNode(args, "clip", mockCreateClip(&clip->vi, clip->frames), maReplace);
+   vsapi->mapSetInt(args, "interlaced", interlaced, maReplace);
+   vsapi->mapSetInt(args, "tff", tff, maReplace);
+   vsapi->mapSetInt(args, "gray", gray, maReplace);
+
+   return args;
+}
+
+
+// Compares the differences in a frame of BlockDiff with the reference.
+static int sameBlockDiffs(const VSFrame *frame, int n, int gray, const Reference *ref) {
+   int blocks = ref->blocks_x * ref->blocks_y;
+   const int *expected = ref->diffs + n * ref->fields * blocks;
+
+   if (gray) {
+      if (vsapi->getFrameWidth(frame, 0) != ref->blocks_x || vsapi->getFrameHeight(frame, 0) != ref->blocks_y * ref->fields)
+         return 0;
+
+      for (int y = 0; y < ref->blocks_y * ref->fields; y++)
+         if (memcmp(vsapi->getReadPtr(frame, 0) + y * vsapi->getStride(frame, 0), expected + y * ref->blocks_x, ref->blocks_x * sizeof(int)))
+            return 0;
+
+      return 1;
+   }
+
+   int err;
+   const VSMap *props = vsapi->getFramePropertiesRO(frame);
+   const char *diffs = vsapi->mapGetData(props, "BifrostLumaDiff", 0, &err);
+
+   return !err && vsapi->mapGetDataSize(props, "BifrostLumaDiff", 0, NULL) == (int)(ref->fields * blocks * sizeof(int)) &&
+          !memcmp(diffs, expected, ref->fields * blocks * sizeof(int));
+}
+
+
+// Fetches every frame of a BlockDiff and compares it with the reference.
+static void checkBlockDiffOutput(const char *test, VSNode *node, const Clip *clip, int gray, const Reference *ref) {
+   for (int n = 0; n < clip->vi.numFrames; n++) {
+      const char *error;
+      const VSFrame *frame = mockGetFrame(node, n, &error);
+
+      if (!frame) {
+         fail(test, "frame %d failed: %s", n, error);
+         return;
+      }
+
+      if (!sameBlockDiffs(frame, n, gray, ref))
+         fail(test, "the differences of frame %d differ from the reference.", n);
+
+      if (!gray && !samePlane(frame, clip->frames[n], 0))
+         fail(test, "the luma of frame %d was changed.", n);
+
+      vsapi->freeFrame(frame);
+   }
+}
+
+
+// BlockDiff, with the differences attached to the frames of the clip and as a gray clip.
+static void testBlockDiff(const Clip *clip) {
+   for (int interlaced = 0; interlaced < 2; interlaced++) {
+      for (int tff = !interlaced; tff < 2; tff++) {
+         Case c = { "", interlaced, tff, 4, 4, 0, 0, 0, 0 };
+
+         Reference ref;
+         makeReference(clip, &c, NULL, 0, &ref);
+
+         for (int gray = 0; gray < 2; gray++) {
+            char test[80];
+            snprintf(test, sizeof(test), "BlockDiff interlaced=%d tff=%d gray=%d", interlaced, tff, gray);
+
+            VSNode *node = invokeFilter(test, "BlockDiff", blockDiffArgs(clip, interlaced, tff, gray), NULL);
+            if (!node)
+               continue;
+
+            checkBlockDiffOutput(test, node, clip, gray, &ref);
+
+            vsapi->freeNode(node);
+         }
+
+         freeReference(&ref, clip->vi.numFrames);
+      }
+   }
+}
+
+
+// Runs a BlockDiff with the cache. Returns how many frames it requested from the clip.
+static int runCachedBlockDiff(const char *test, const Clip *clip, int decimation, const Reference *ref) {
+   VSMap *args = blockDiffArgs(clip, 1, 1, 1);
+   VSNode *source = vsapi->mapGetNode(args, "clip", 0, NULL);
+   vsapi->mapSetInt(args, "decimation", decimation, maReplace);
+   vsapi->mapSetData(args, "cache", CACHE_PATH, -1, dtUtf8, maReplace);
+
+   VSNode *node = invokeFilter(test, "BlockDiff", args, NULL);
+   int frames_made = -1;
+
+   if (node) {
+      // The decimated differences are estimates, and only their frame size is checked.
+      if (ref) {
+         checkBlockDiffOutput(test, node, clip, 1, ref);
+      } else {
+         for (int n = 0; n < clip->vi.numFrames; n++) {
+            const char *error;
+            const VSFrame *frame = mockGetFrame(node, n, &error);
+
+            if (!frame)
+               fail(test, "frame %d failed: %s", n, error);
+            vsapi->freeFrame(frame);
+         }
+      }
+
+      frames_made = mockFramesMade(source);
+      vsapi->freeNode(node);
+   }
+
+   vsapi->freeNode(source);
+
+   return frames_made;
+}
+
+
+// The cache file: once it has every frame, a gray BlockDiff only reads the
+// fingerprint frames of the clip, and a different decimation starts it over.
+static void testCache(const Clip *clip) {
+   const char *test = "cache";
+
+   remove(CACHE_PATH);
+
+   Case c = { "", 1, 1, 4, 4, 0, 0, 0, 0 };
+   Reference ref;
+   makeReference(clip, &c, NULL, 0, &ref);
+
+   int frames = clip->vi.numFrames;
+
+   int computed = runCachedBlockDiff(test, clip, 1, &ref);
+   int cached = runCachedBlockDiff(test, clip, 1, &ref);
+
+   if (computed < frames)
+      fail(test, "the first BlockDiff only requested %d frames.", computed);
+   if (cached < 0 || cached > 5)
+      fail(test, "a BlockDiff with every frame in the cache requested %d frames.", cached);
+
+   runCachedBlockDiff(test, clip, 2, NULL);
+
+   int recomputed = runCachedBlockDiff(test, clip, 1, &ref);
+   if (recomputed < frames)
+      fail(test, "the cache wasn't started over for another decimation, only %d frames were requested.", recomputed);
+
+   // Bifrost passes the cache to its BlockDiff.
+   VSMap *args = vsapi->createMap();
+   vsapi->mapConsumeNode(args, "clip", mockCreateClip(&clip->vi, clip->frames), maReplace);
+   vsapi->mapSetData(args, "cache", CACHE_PATH, -1, dtUtf8, maReplace);
+
+   Reference bifrost_ref;
+   makeReference(clip, &c, NULL, 0, &bifrost_ref);
+
+   VSNode *node = invokeFilter("cache Bifrost", "Bifrost", args, NULL);
+   if (node) {
+      checkBifrostOutput("cache Bifrost", node, clip, &bifrost_ref, 0);
+      vsapi->freeNode(node);
+   }
+
+   freeReference(&bifrost_ref, frames);
+   freeReference(&ref, frames);
+
+   remove(CACHE_PATH);
+
+   printf("%-20s %d frames computed, %d read with the cache\n", test, computed, cached);
+}
+
+
+typedef struct {
+   const char *name;
+   const char *parameter; // given to BlockDiff, or NULL for a clip BlockDiff didn't make
+   int value;
+   const char *error; // NULL if Bifrost must accept it
+} DiffClipCase;
+
+
+static const DiffClipCase diffclip_cases[] = {
+   { "diffclip",            "tff",        1, NULL },
+   { "diffclip tff",        "tff",        0, "different block size, interlaced, or tff" },
+   { "diffclip decimation", "decimation", 2, "different decimation" },
+   { "diffclip roi",        "roi",        8, "different roi" },
+   { "diffclip not made",   NULL,         0, "weren't made by BlockDiff" },
+};
+
+
+// Bifrost checks the frames of diffclip, which can only be done once they're made.
+static VSNode *makeDiffClip(const Clip *clip, const DiffClipCase *dc) {
+   if (!dc->parameter) {
+      VSVideoInfo vi = clip->vi;
+      vsapi->queryVideoFormat(&vi.format, cfGray, stInteger, 32, 0, 0, mockCore());
+      vi.width = clip->vi.width / 4;
+      vi.height = clip->vi.height / 4;
+
+      VSFrame *frame = vsapi->newVideoFrame(&vi.format, vi.width, vi.height, NULL, mockCore());
+      memset(vsapi->getWritePtr(frame, 0), 0, vsapi->getStride(frame, 0) * vi.height);
+
+      const VSFrame **frames = malloc(vi.numFrames * sizeof(VSFrame *));
+      for (int n = 0; n < vi.numFrames; n++)
+         frames[n] = frame;
+
+      VSNode *node = mockCreateClip(&vi, frames);
+
+      free(frames);
+      vsapi->freeFrame(frame);
+
+      return node;
+   }
+
+   VSMap *args = blockDiffArgs(clip, 1, 1, 1);
+
+   if (!strcmp(dc->parameter, "roi")) {
+      for (int i = 0; i < 4; i++)
+         vsapi->mapSetInt(args, "roi", dc->value * (i + 1), maAppend);
+   } else {
+      vsapi->mapSetInt(args, dc->parameter, dc->value, maReplace);
+   }
+
+   return invokeFilter(dc->name, "BlockDiff", args, NULL);
+}
+
+
+static void testDiffClip(const Clip *clip) {
+   Case c = { "", 1, 1, 4, 4, 0, 0, 0, 0 };
+   Reference ref;
+   makeReference(clip, &c, NULL, 0, &ref);
+
+   for (size_t i = 0; i < sizeof(diffclip_cases) / sizeof(diffclip_cases[0]); i++) {
+      const DiffClipCase *dc = &diffclip_cases[i];
+
+      VSNode *diffclip = makeDiffClip(clip, dc);
+      if (!diffclip)
+         continue;
+
+      VSMap *args = vsapi->createMap();
+      vsapi->mapConsumeNode(args, "clip", mockCreateClip(&clip->vi, clip->frames), maReplace);
+      vsapi->mapConsumeNode(args, "diffclip", diffclip, maReplace);
+
+      VSNode *node = invokeFilter(dc->name, "Bifrost", args, NULL);
+      if (!node)
+         continue;
+
+      if (dc->error) {
+         const char *error;
+         const VSFrame *frame = mockGetFrame(node, 0, &error);
+
+         if (frame || !strstr(error, dc->error))
+            fail(dc->name, "the frame should have failed with \"%s\", but %s%s.", dc->error,
+                 frame ? "it was made" : "it failed with ", frame ? "" : error);
+
+         vsapi->freeFrame(frame);
+      } else {
+         checkBifrostOutput(dc->name, node, clip, &ref, 0);
+      }
+
+      vsapi->freeNode(node);
+   }
+
+   // These are found when the filter is made.
+   const char *size_error = "diffclip must be made from clip by BlockDiff";
+   VSMap *diff_args = blockDiffArgs(clip, 1, 1, 1);
+   vsapi->mapSetInt(diff_args, "blockx", 8, maReplace);
+
+   VSMap *args = vsapi->createMap();
+   vsapi->mapConsumeNode(args, "clip", mockCreateClip(&clip->vi, clip->frames), maReplace);
+   vsapi->mapConsumeNode(args, "diffclip", invokeFilter("diffclip blockx", "BlockDiff", diff_args, NULL), maReplace);
+   invokeFilter("diffclip blockx", "Bifrost", args, &size_error);
+
+   const char *cache_error = "cache can't be used with diffclip";
+   args = vsapi->createMap();
+   vsapi->mapConsumeNode(args, "clip", mockCreateClip(&clip->vi, clip->frames), maReplace);
+   vsapi->mapConsumeNode(args, "diffclip", invokeFilter("diffclip cache", "BlockDiff", blockDiffArgs(clip, 1, 1, 1), NULL), maReplace);
+   vsapi->mapSetData(args, "cache", CACHE_PATH, -1, dtUtf8, maReplace);
+   invokeFilter("diffclip cache", "Bifrost", args, &cache_error);
+
+   freeReference(&ref, clip->vi.numFrames);
+}
+
+
+int main(int argc, char **argv) {
+   if (argc > 2) {
+      fprintf(stderr, "Usage: bifrost_vstest [clip.y4m]\n");
+      return 1;
+   }
+
+   vsapi = mockInit();
+
+   Clip clip;
+   const char *error = readClip(argc == 2 ? argv[1] : BIFROST_TEST_CLIP, &clip);
+   if (error) {
+      fprintf(stderr, "%s\n", error);
+      freeFrames(clip.frames, clip.vi.numFrames);
+      return 1;
+   }
+
+   if (clip.vi.width % 8 || clip.vi.height % 8) {
+      fprintf(stderr, "bifrost_vstest: The width and height of the clip must be multiples of 8.\n");
+      freeFrames(clip.frames, clip.vi.numFrames);
+      return 1;
+   }
+
+   printf("%dx%d, %d frames.\n\n", clip.vi.width, clip.vi.height, clip.vi.numFrames);
+
+   for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+      testBifrost(&clip, &cases[i]);
+
+   testBlockDiff(&clip);
+   testCache(&clip);
+   testDiffClip(&clip);
+
+   freeFrames(clip.frames, clip.vi.numFrames);
+
+   if (mockFramesAlive() || mockNodesAlive())
+      fail("leaks", "%d frames and %d nodes weren't freed.", mockFramesAlive(), mockNodesAlive());
+
+   if (failures)
+      printf("\n%d checks failed.\n", failures);
+   else
+      printf("\nThe output matches the reference.\n");
+
+   return !!failures;
+}